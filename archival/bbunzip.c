@@ -268,11 +268,21 @@ int uncompress_main(int argc UNUSED_PARAM, char **argv)
  */
 //usage:#define gunzip_trivial_usage
 //usage:       "[-cft] [FILE]..."
+//usage:	IF_FEATURE_GUNZIP_INDEX(
+//usage:       "\n       gunzip --index=IDX [--offset=N] [--length=N] [-p N] FILE"
+//usage:	)
 //usage:#define gunzip_full_usage "\n\n"
 //usage:       "Decompress FILEs (or stdin)\n"
 //usage:     "\n	-c	Write to stdout"
 //usage:     "\n	-f	Force"
 //usage:     "\n	-t	Test file integrity"
+//usage:	IF_FEATURE_GUNZIP_INDEX(
+//usage:     "\n	--index=IDX	Write part of FILE to stdout, using index IDX"
+//usage:     "\n			(built by decompressing all of FILE if missing)"
+//usage:     "\n	--offset=N	Start at uncompressed offset N"
+//usage:     "\n	--length=N	Write at most N bytes"
+//usage:     "\n	-p N	With --index: use N processes (stdout must be a file)"
+//usage:	)
 //usage:
 //usage:#define gunzip_example_usage
 //usage:       "$ ls -la /tmp/BusyBox*\n"
@@ -293,6 +303,18 @@ int uncompress_main(int argc UNUSED_PARAM, char **argv)
 //config:	  gunzip is used to decompress archives created by gzip.
 //config:	  You can use the `-t' option to test the integrity of
 //config:	  an archive, without decompressing it.
+//config:
+//config:config FEATURE_GUNZIP_INDEX
+//config:	bool "Enable --index: random access to .gz files"
+//config:	default y
+//config:	depends on GUNZIP && LONG_OPTS
+//config:	help
+//config:	  gunzip --index=IDX --offset=N --length=N FILE writes a part
+//config:	  of FILE to stdout. The first run decompresses all of FILE
+//config:	  and saves a restart point every 1 Mb of output in IDX
+//config:	  (about 32 kb each); later runs start decompressing at the
+//config:	  nearest restart point. With -p N, up to N processes
+//config:	  decompress parts of the range at once.
 
 //applet:IF_GUNZIP(APPLET(gunzip, BB_DIR_BIN, BB_SUID_DROP))
 //applet:IF_GUNZIP(APPLET_ODDNAME(zcat, gunzip, BB_DIR_BIN, BB_SUID_DROP, zcat))
@@ -329,6 +351,170 @@ IF_DESKTOP(long long) int FAST_FUNC unpack_gunzip(transformer_aux_data_t *aux)
 {
 	return unpack_gz_stream(aux, STDIN_FILENO, STDOUT_FILENO);
 }
+
+#if ENABLE_FEATURE_GUNZIP_INDEX
+/* Index file: a header of "BBGZIDX1" followed by size and mtime
+ * of the .gz file and its uncompressed size (LE64 each), then
+ * the restart points written by unpack_gz_stream() (see gz_index_t).
+ * The header is written last, an unfinished index is not valid. */
+enum {
+	GZI_HDR_SIZE = 4 * 8,
+	GZI_POINT_SIZE = 2 * 8 + GZ_INDEX_WINDOW,
+	GZI_SPAN = 1024 * 1024, /* output bytes between restart points */
+};
+
+static void read_gz_index(int fd, void *buf, size_t size, off_t pos)
+{
+	if (pread(fd, buf, size, pos) != (ssize_t)size)
+		bb_error_msg_and_die("corrupted index");
+}
+
+/* Write [offset, offset+length) of uncompressed FILE to stdout
+ * (at pwrite_pos if it is >= 0), starting at the last restart point
+ * at or before offset */
+static int unpack_gz_range(const char *filename, int idx_fd, unsigned npoints,
+		off_t offset, off_t length, off_t pwrite_pos)
+{
+	transformer_aux_data_t aux;
+	gz_index_t gz;
+	uint64_t point[2];
+	unsigned lo, hi;
+	int fd;
+
+	memset(&gz, 0, sizeof(gz));
+	gz.build_fd = -1;
+	gz.skip = offset;
+	gz.limit = length;
+	gz.pwrite_pos = pwrite_pos;
+
+	/* Find the number of restart points at or before offset */
+	lo = 0;
+	hi = npoints;
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		read_gz_index(idx_fd, point, sizeof(point), GZI_HDR_SIZE + (off_t)mid * GZI_POINT_SIZE);
+		if ((off_t)SWAP_LE64(point[0]) <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo != 0) {
+		off_t pos = GZI_HDR_SIZE + (off_t)(lo - 1) * GZI_POINT_SIZE;
+		read_gz_index(idx_fd, point, sizeof(point), pos);
+		gz.start_out = SWAP_LE64(point[0]);
+		gz.start_bit = SWAP_LE64(point[1]);
+		gz.window = xmalloc(GZ_INDEX_WINDOW);
+		read_gz_index(idx_fd, gz.window, GZ_INDEX_WINDOW, pos + sizeof(point));
+		gz.skip = offset - gz.start_out;
+	}
+
+	fd = xopen(filename, O_RDONLY);
+	init_transformer_aux_data(&aux);
+	aux.check_signature = 1;
+	aux.gz_index = &gz;
+	offset = unpack_gz_stream(&aux, fd, STDOUT_FILENO);
+	close(fd);
+	free(gz.window);
+	return offset < 0;
+}
+
+static int gunzip_indexed(char **argv, const char *idx_name,
+		off_t offset, off_t length, unsigned nprocs)
+{
+	const char *filename = argv[0];
+	struct stat st;
+	uint64_t hdr[4];
+	unsigned npoints;
+	off_t total;
+	int idx_fd;
+
+	if (!filename || argv[1])
+		bb_show_usage();
+	xstat(filename, &st);
+
+	idx_fd = open(idx_name, O_RDONLY);
+	if (idx_fd < 0
+	 || full_read(idx_fd, hdr, sizeof(hdr)) != sizeof(hdr)
+	 || memcmp(hdr, "BBGZIDX1", 8) != 0
+	 || SWAP_LE64(hdr[1]) != (uint64_t)st.st_size
+	 || SWAP_LE64(hdr[2]) != (uint64_t)st.st_mtime
+	) {
+		/* No valid index: decompress all of FILE, building it */
+		transformer_aux_data_t aux;
+		gz_index_t gz;
+		int fd;
+
+		if (idx_fd >= 0)
+			close(idx_fd);
+		idx_fd = xopen(idx_name, O_WRONLY | O_CREAT | O_TRUNC);
+		xlseek(idx_fd, GZI_HDR_SIZE, SEEK_SET);
+
+		memset(&gz, 0, sizeof(gz));
+		gz.build_fd = idx_fd;
+		gz.span = GZI_SPAN;
+		gz.skip = offset;
+		gz.limit = length;
+		gz.pwrite_pos = -1;
+		fd = xopen(filename, O_RDONLY);
+		init_transformer_aux_data(&aux);
+		aux.check_signature = 1;
+		aux.gz_index = &gz;
+		if (unpack_gz_stream(&aux, fd, STDOUT_FILENO) < 0) {
+			close(idx_fd);
+			unlink(idx_name);
+			return EXIT_FAILURE;
+		}
+		close(fd);
+
+		memcpy(hdr, "BBGZIDX1", 8);
+		hdr[1] = SWAP_LE64((uint64_t)st.st_size);
+		hdr[2] = SWAP_LE64((uint64_t)st.st_mtime);
+		hdr[3] = SWAP_LE64((uint64_t)gz.out_total);
+		xlseek(idx_fd, 0, SEEK_SET);
+		xwrite(idx_fd, hdr, sizeof(hdr));
+		xclose(idx_fd);
+		return EXIT_SUCCESS;
+	}
+
+	total = SWAP_LE64(hdr[3]);
+	xfstat(idx_fd, &st, idx_name);
+	npoints = (st.st_size - GZI_HDR_SIZE) / GZI_POINT_SIZE;
+	if (offset > total)
+		offset = total;
+	if (length < 0 || length > total - offset)
+		length = total - offset;
+
+#if BB_MMU
+	if (nprocs > 1 && length > GZI_SPAN) {
+		/* Every child writes its part of the range with pwrite() */
+		off_t base = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+		if (base >= 0 && !(fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND)) {
+			off_t chunk = length / nprocs + 1;
+			off_t pos;
+			int status;
+			int exitcode = EXIT_SUCCESS;
+
+			if (chunk < GZI_SPAN)
+				chunk = GZI_SPAN;
+			for (pos = 0; pos < length; pos += chunk) {
+				if (xfork() == 0) {
+					_exit(unpack_gz_range(filename, idx_fd, npoints,
+						offset + pos, MIN(chunk, length - pos), base + pos));
+				}
+			}
+			while (wait(&status) > 0) {
+				if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+					exitcode = EXIT_FAILURE;
+			}
+			xlseek(STDOUT_FILENO, base + length, SEEK_SET);
+			return exitcode;
+		}
+	}
+#endif
+	return unpack_gz_range(filename, idx_fd, npoints, offset, length, -1);
+}
+#endif
+
 /*
  * Linux kernel build uses gzip -d -n. We accept and ignore it.
  * Man page says:
@@ -345,9 +531,41 @@ IF_DESKTOP(long long) int FAST_FUNC unpack_gunzip(transformer_aux_data_t *aux)
 int gunzip_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int gunzip_main(int argc UNUSED_PARAM, char **argv)
 {
-	getopt32(argv, "cfvqdtn");
+#if ENABLE_FEATURE_GUNZIP_INDEX
+	static const char gunzip_longopts[] ALIGN1 =
+		"index\0"  Required_argument "\xff"
+		"offset\0" Required_argument "\xfe"
+		"length\0" Required_argument "\xfd"
+		;
+	const char *nprocs = "1";
+	const char *idx_name = NULL;
+	const char *offset = "0";
+	const char *length = NULL;
+
+	/* "gzip -d" comes here with gzip's long options, leave them be */
+	if (applet_name[1] != 'z')
+		applet_long_options = gunzip_longopts;
+#endif
+	getopt32(argv, "cfvqdtn" IF_FEATURE_GUNZIP_INDEX("p:\xff:\xfe:\xfd:")
+			IF_FEATURE_GUNZIP_INDEX(, &nprocs, &idx_name, &offset, &length)
+	);
 	argv += optind;
 
+#if ENABLE_FEATURE_GUNZIP_INDEX
+	/* -p N only works together with --index */
+	if (!idx_name && (option_mask32 & (1 << 7)))
+		bb_show_usage();
+	if (idx_name) {
+		unsigned n = xatou_range(nprocs, 0, 1024);
+		if (n == 0)
+			n = get_cpu_count();
+		if (n == 0)
+			n = 1;
+		return gunzip_indexed(argv, idx_name, XATOOFF(offset),
+				length ? XATOOFF(length) : (off_t)-1, n);
+	}
+#endif
+
 	/* If called as zcat...
 	 * Normally, "zcat" is just "gunzip -c".
 	 * But if seamless magic is enabled, then we are much more clever.
@@ -367,11 +585,14 @@ int gunzip_main(int argc UNUSED_PARAM, char **argv)
  * Licensed under GPLv2 or later, see file LICENSE in this source tree.
  */
 //usage:#define bunzip2_trivial_usage
-//usage:       "[-cf] [FILE]..."
+//usage:       "[-cf] "IF_FEATURE_BUNZIP2_PARALLEL("[-p N] ")"[FILE]..."
 //usage:#define bunzip2_full_usage "\n\n"
 //usage:       "Decompress FILEs (or stdin)\n"
 //usage:     "\n	-c	Write to stdout"
 //usage:     "\n	-f	Force"
+//usage:	IF_FEATURE_BUNZIP2_PARALLEL(
+//usage:     "\n	-p N	Decompress using N processes (0: one per CPU)"
+//usage:	)
 //usage:#define bzcat_trivial_usage
 //usage:       "[FILE]..."
 //usage:#define bzcat_full_usage "\n\n"
@@ -389,22 +610,48 @@ int gunzip_main(int argc UNUSED_PARAM, char **argv)
 //config:
 //config:	  Unless you have a specific application which requires bunzip2, you
 //config:	  should probably say N here.
+//config:
+//config:config FEATURE_BUNZIP2_PARALLEL
+//config:	bool "Enable -p N: decompress using N processes"
+//config:	default y
+//config:	depends on BUNZIP2 && !NOMMU
+//config:	help
+//config:	  Input is scanned for bzip2 block signatures, and blocks
+//config:	  are decoded by up to N child processes at once.
 
 //applet:IF_BUNZIP2(APPLET(bunzip2, BB_DIR_USR_BIN, BB_SUID_DROP))
 //applet:IF_BUNZIP2(APPLET_ODDNAME(bzcat, bunzip2, BB_DIR_USR_BIN, BB_SUID_DROP, bzcat))
 //kbuild:lib-$(CONFIG_BZIP2) += bbunzip.o
 //kbuild:lib-$(CONFIG_BUNZIP2) += bbunzip.o
 #if ENABLE_BUNZIP2
+# if ENABLE_FEATURE_BUNZIP2_PARALLEL
+static unsigned bunzip2_nprocs;
+# endif
 static
 IF_DESKTOP(long long) int FAST_FUNC unpack_bunzip2(transformer_aux_data_t *aux)
 {
+# if ENABLE_FEATURE_BUNZIP2_PARALLEL
+	return unpack_bz2_stream_parallel(aux, STDIN_FILENO, STDOUT_FILENO, bunzip2_nprocs);
+# else
 	return unpack_bz2_stream(aux, STDIN_FILENO, STDOUT_FILENO);
+# endif
 }
 int bunzip2_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int bunzip2_main(int argc UNUSED_PARAM, char **argv)
 {
-	getopt32(argv, "cfvqdt");
+# if ENABLE_FEATURE_BUNZIP2_PARALLEL
+	const char *nprocs = "1";
+# endif
+
+	getopt32(argv, "cfvqdt" IF_FEATURE_BUNZIP2_PARALLEL("p:")
+			IF_FEATURE_BUNZIP2_PARALLEL(, &nprocs)
+	);
 	argv += optind;
+# if ENABLE_FEATURE_BUNZIP2_PARALLEL
+	bunzip2_nprocs = xatou_range(nprocs, 0, 1024);
+	if (bunzip2_nprocs == 0)
+		bunzip2_nprocs = get_cpu_count();
+# endif
 	if (applet_name[2] == 'c') /* bzcat */
 		option_mask32 |= OPT_STDOUT;
 
@@ -442,19 +689,25 @@ int bunzip2_main(int argc UNUSED_PARAM, char **argv)
 //usage:       "Decompress to stdout"
 //usage:
 //usage:#define unxz_trivial_usage
-//usage:       "[-cf] [FILE]..."
+//usage:       "[-cf] "IF_FEATURE_UNXZ_PARALLEL("[-p N] ")"[FILE]..."
 //usage:#define unxz_full_usage "\n\n"
 //usage:       "Decompress FILE (or stdin)\n"
 //usage:     "\n	-c	Write to stdout"
 //usage:     "\n	-f	Force"
+//usage:	IF_FEATURE_UNXZ_PARALLEL(
+//usage:     "\n	-p N	Decompress using N processes (0: one per CPU)"
+//usage:	)
 //usage:
 //usage:#define xz_trivial_usage
-//usage:       "-d [-cf] [FILE]..."
+//usage:       "-d [-cf] "IF_FEATURE_UNXZ_PARALLEL("[-p N] ")"[FILE]..."
 //usage:#define xz_full_usage "\n\n"
 //usage:       "Decompress FILE (or stdin)\n"
 //usage:     "\n	-d	Decompress"
 //usage:     "\n	-c	Write to stdout"
 //usage:     "\n	-f	Force"
+//usage:	IF_FEATURE_UNXZ_PARALLEL(
+//usage:     "\n	-p N	Decompress using N processes (0: one per CPU)"
+//usage:	)
 //usage:
 //usage:#define xzcat_trivial_usage
 //usage:       "[FILE]..."
@@ -531,21 +784,46 @@ int unlzma_main(int argc UNUSED_PARAM, char **argv)
 //config:	help
 //config:	  Enable this option if you want commands like "xz -d" to work.
 //config:	  IOW: you'll get xz applet, but it will always require -d option.
+//config:
+//config:config FEATURE_UNXZ_PARALLEL
+//config:	bool "Enable -p N: decompress using N processes"
+//config:	default y
+//config:	depends on UNXZ && !NOMMU
+//config:	help
+//config:	  Blocks of files made by "xz -T" are decoded by up to N
+//config:	  child processes at once.
 
 //applet:IF_UNXZ(APPLET(unxz, BB_DIR_USR_BIN, BB_SUID_DROP))
 //applet:IF_UNXZ(APPLET_ODDNAME(xzcat, unxz, BB_DIR_USR_BIN, BB_SUID_DROP, xzcat))
 //applet:IF_XZ(APPLET_ODDNAME(xz, unxz, BB_DIR_USR_BIN, BB_SUID_DROP, xz))
 //kbuild:lib-$(CONFIG_UNXZ) += bbunzip.o
 #if ENABLE_UNXZ
+# if ENABLE_FEATURE_UNXZ_PARALLEL
+static unsigned unxz_nprocs;
+# endif
 static
 IF_DESKTOP(long long) int FAST_FUNC unpack_unxz(transformer_aux_data_t *aux)
 {
+# if ENABLE_FEATURE_UNXZ_PARALLEL
+	return unpack_xz_stream_parallel(aux, STDIN_FILENO, STDOUT_FILENO, unxz_nprocs);
+# else
 	return unpack_xz_stream(aux, STDIN_FILENO, STDOUT_FILENO);
+# endif
 }
 int unxz_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int unxz_main(int argc UNUSED_PARAM, char **argv)
 {
-	IF_XZ(int opts =) getopt32(argv, "cfvqdt");
+# if ENABLE_FEATURE_UNXZ_PARALLEL
+	const char *nprocs = "1";
+# endif
+	IF_XZ(int opts =) getopt32(argv, "cfvqdt" IF_FEATURE_UNXZ_PARALLEL("p:")
+			IF_FEATURE_UNXZ_PARALLEL(, &nprocs)
+	);
+# if ENABLE_FEATURE_UNXZ_PARALLEL
+	unxz_nprocs = xatou_range(nprocs, 0, 1024);
+	if (unxz_nprocs == 0)
+		unxz_nprocs = get_cpu_count();
+# endif
 # if ENABLE_XZ
 	/* xz without -d or -t? */
 	if (applet_name[2] == '\0' && !(opts & (OPT_DECOMPRESS|OPT_TEST)))
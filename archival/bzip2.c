@@ -19,6 +19,14 @@
 //config:
 //config:	  Unless you have a specific application which requires bzip2, you
 //config:	  should probably say N here.
+//config:
+//config:config FEATURE_BZIP2_PARALLEL
+//config:	bool "Enable -p N: compress using N processes"
+//config:	default y
+//config:	depends on BZIP2 && !NOMMU
+//config:	help
+//config:	  Blocks are sorted and Huffman coded by up to N child
+//config:	  processes at once. The output is the same as without -p.
 
 //applet:IF_BZIP2(APPLET(bzip2, BB_DIR_USR_BIN, BB_SUID_DROP))
 //kbuild:lib-$(CONFIG_BZIP2) += bzip2.o
@@ -31,6 +39,9 @@
 //usage:     "\n	-d	Decompress"
 //usage:     "\n	-c	Write to stdout"
 //usage:     "\n	-f	Force"
+//usage:	IF_FEATURE_BZIP2_PARALLEL(
+//usage:     "\n	-p N	Compress using N processes (0: one per CPU)"
+//usage:	)
 
 #include "libbb.h"
 #include "bb_archive.h"
@@ -78,6 +89,9 @@ enum {
 };
 
 static uint8_t level;
+#if ENABLE_FEATURE_BZIP2_PARALLEL
+static unsigned nprocs;
+#endif
 
 /* NB: compressStream() has to return -1 on errors, not die.
  * bbunpack() will correctly clean up in this case
@@ -162,10 +176,222 @@ IF_DESKTOP(long long) int FAST_FUNC compressStream(transformer_aux_data_t *aux U
 	return total;
 }
 
+#if ENABLE_FEATURE_BZIP2_PARALLEL
+/* Parallel compression. The parent cuts input into blocks exactly
+ * the way BZ2_bzCompress() does, and forks a child to sort and code
+ * each block. Coded blocks depend on nothing but their own data,
+ * so the parent merely concatenates their bits (blocks are not byte
+ * aligned) and adds the stream header and trailer. The result is
+ * the same as what compressStream() produces.
+ */
+struct bz_out {
+	IF_DESKTOP(long long total;)
+	uint32_t acc;
+	unsigned live;	/* number of not yet written bits in acc */
+	unsigned cnt;
+	smallint error;
+	uint8_t buf[IOBUF_SIZE];
+};
+
+static void out_flush(struct bz_out *out)
+{
+	int n;
+
+	if (out->cnt == 0)
+		return;
+	if (!out->error) {
+		n = full_write(STDOUT_FILENO, out->buf, out->cnt);
+		if (n != (int)out->cnt) {
+			if (n >= 0)
+				errno = 0; /* prevent bogus error message */
+			bb_perror_msg(n >= 0 ? "short write" : bb_msg_write_error);
+			out->error = 1;
+		}
+		IF_DESKTOP(out->total += out->cnt;)
+	}
+	/* After an error, output is discarded */
+	out->cnt = 0;
+}
+
+/* n <= 24 */
+static void out_bits(struct bz_out *out, unsigned n, uint32_t v)
+{
+	out->acc = (out->acc << n) | v;
+	out->live += n;
+	while (out->live >= 8) {
+		out->live -= 8;
+		out->buf[out->cnt++] = out->acc >> out->live;
+		if (out->cnt == IOBUF_SIZE)
+			out_flush(out);
+	}
+}
+
+static void out_block(struct bz_out *out, const uint8_t *p, uint32_t nbits)
+{
+	while (nbits >= 8) {
+		out_bits(out, 8, *p++);
+		nbits -= 8;
+	}
+	if (nbits)
+		out_bits(out, nbits, *p >> (8 - nbits));
+}
+
+/* Sort and code the block, leave its bits in s->zbits. Returns bit count */
+static uint32_t code_block(EState *s)
+{
+	uint32_t nbits;
+
+	BZ2_blockSort(s);
+	s->zbits = &((uint8_t*)s->arr2)[s->nblock];
+	s->numZ = 0;
+	BZ2_bsInitWrite(s);
+	compressBlockData(s);
+	nbits = s->numZ * 8 + s->bsLive;
+	bsFinishWrite(s);
+	return nbits;
+}
+
+/* Sets out->error if the child failed */
+static void collect_block(struct bz_out *out, pid_t pid, int fd)
+{
+	uint32_t nbits;
+	uint8_t *p;
+	int ok = 0;
+
+	if (full_read(fd, &nbits, sizeof(nbits)) == sizeof(nbits)) {
+		p = xmalloc((nbits + 7) / 8);
+		if (full_read(fd, p, (nbits + 7) / 8) == (ssize_t)((nbits + 7) / 8)) {
+			out_block(out, p, nbits);
+			ok = 1;
+		}
+		free(p);
+	}
+	close(fd);
+	if (wait4pid(pid) != 0)
+		ok = 0;
+	if (!ok && !out->error) {
+		bb_error_msg("child process failed");
+		out->error = 1;
+	}
+}
+
+static
+IF_DESKTOP(long long) int FAST_FUNC compressStreamParallel(transformer_aux_data_t *aux UNUSED_PARAM)
+{
+	struct bz_out *out;
+	struct fd_pair *fds;
+	pid_t *pids;
+	bz_stream bzs;
+	EState *s;
+	uint8_t *rbuf;
+	uint32_t combinedCRC = 0;
+	ssize_t count = 1;
+	unsigned first = 0;
+	unsigned njobs = 0;
+
+	out = xzalloc(sizeof(*out));
+	rbuf = xmalloc(IOBUF_SIZE);
+	fds = xmalloc(nprocs * sizeof(fds[0]));
+	pids = xmalloc(nprocs * sizeof(pids[0]));
+	BZ2_bzCompressInit(&bzs, level);
+	s = bzs.state;
+	bzs.avail_in = 0;
+
+	out_bits(out, 16, BZ_HDR_BZh0 >> 16);
+	out_bits(out, 16, (BZ_HDR_BZh0 & 0xffff) + level);
+
+	while (1) {
+		copy_input_until_stop(s);
+		if (s->nblock < s->nblockMAX) {
+			/* Block isn't full, input is exhausted */
+			count = full_read(STDIN_FILENO, rbuf, IOBUF_SIZE);
+			if (count < 0) {
+				bb_perror_msg(bb_msg_read_error);
+				out->error = 1;
+				break;
+			}
+			if (count != 0) {
+				bzs.next_in = (char*)rbuf;
+				bzs.avail_in = count;
+				continue;
+			}
+			flush_RL(s);
+		}
+
+		if (s->nblock > 0) {
+			BZ_FINALISE_CRC(s->blockCRC);
+			combinedCRC = (combinedCRC << 1) | (combinedCRC >> 31);
+			combinedCRC ^= s->blockCRC;
+
+			if (count == 0 && njobs == 0) {
+				/* The only block, no need to fork */
+				uint32_t nbits = code_block(s);
+				out_block(out, s->zbits, nbits);
+			} else {
+				struct fd_pair pipe_fds;
+				pid_t pid;
+
+				if (njobs == nprocs) {
+					collect_block(out, pids[first], fds[first].rd);
+					first = (first + 1) % nprocs;
+					njobs--;
+					if (out->error)
+						break;
+				}
+				xpiped_pair(pipe_fds);
+				pid = xfork();
+				if (pid == 0) {
+					uint32_t nbits;
+
+					close(pipe_fds.rd);
+					nbits = code_block(s);
+					xwrite(pipe_fds.wr, &nbits, sizeof(nbits));
+					xwrite(pipe_fds.wr, s->zbits, (nbits + 7) / 8);
+					_exit(EXIT_SUCCESS);
+				}
+				close(pipe_fds.wr);
+				pids[(first + njobs) % nprocs] = pid;
+				fds[(first + njobs) % nprocs] = pipe_fds;
+				njobs++;
+			}
+		}
+		if (count == 0)
+			break;
+		prepare_new_block(s);
+	}
+
+	while (njobs != 0) {
+		collect_block(out, pids[first], fds[first].rd);
+		first = (first + 1) % nprocs;
+		njobs--;
+	}
+
+	/* Stream trailer, same as BZ2_compressBlock() writes */
+	out_bits(out, 24, 0x177245);
+	out_bits(out, 24, 0x385090);
+	out_bits(out, 16, combinedCRC >> 16);
+	out_bits(out, 16, combinedCRC & 0xffff);
+	if (out->live)
+		out_bits(out, 8 - out->live, 0);
+	out_flush(out);
+
+	BZ2_bzCompressEnd(&bzs);
+	free(pids);
+	free(fds);
+	free(rbuf);
+	count = out->error ? -1 : IF_DESKTOP(out->total) + 0;
+	free(out);
+	return count;
+}
+#endif
+
 int bzip2_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int bzip2_main(int argc UNUSED_PARAM, char **argv)
 {
 	unsigned opt;
+#if ENABLE_FEATURE_BZIP2_PARALLEL
+	const char *nprocs_str = "1";
+#endif
 
 	/* standard bzip2 flags
 	 * -d --decompress force decompression
@@ -184,7 +410,10 @@ int bzip2_main(int argc UNUSED_PARAM, char **argv)
 
 	opt_complementary = "s2"; /* -s means -2 (compatibility) */
 	/* Must match bbunzip's constants OPT_STDOUT, OPT_FORCE! */
-	opt = getopt32(argv, "cfv" IF_BUNZIP2("dt") "123456789qzs");
+	opt = getopt32(argv, "cfv" IF_BUNZIP2("dt") "123456789qzs"
+			IF_FEATURE_BZIP2_PARALLEL("p:")
+			IF_FEATURE_BZIP2_PARALLEL(, &nprocs_str)
+	);
 #if ENABLE_BUNZIP2 /* bunzip2_main may not be visible... */
 	if (opt & 0x18) // -d and/or -t
 		return bunzip2_main(argc, argv);
@@ -202,5 +431,12 @@ int bzip2_main(int argc UNUSED_PARAM, char **argv)
 
 	argv += optind;
 	option_mask32 &= 0x7; /* ignore all except -cfv */
+#if ENABLE_FEATURE_BZIP2_PARALLEL
+	nprocs = xatou_range(nprocs_str, 0, 1024);
+	if (nprocs == 0)
+		nprocs = get_cpu_count();
+	if (nprocs > 1)
+		return bbunpack(argv, compressStreamParallel, append_ext, "bz2");
+#endif
 	return bbunpack(argv, compressStream, append_ext, "bz2");
 }
@@ -62,17 +62,44 @@ aa:      85.1% -- replaced with aa.gz
 //config:	  1: larger buffers, larger hash-tables
 //config:	  2: larger buffers, largest hash-tables
 //config:	  Larger models may give slightly better compression
+//config:
+//config:config FEATURE_GZIP_LEVELS
+//config:	bool "Enable compression levels"
+//config:	default y
+//config:	depends on GZIP
+//config:	help
+//config:	  Honor -1..-9 (default -6) as GNU gzip does: lower levels search
+//config:	  shorter hash chains, and -1..-3 also skip lazy matching.
+//config:	  Without this, options are accepted but ignored, and gzip
+//config:	  always compresses as with -9.
+//config:
+//config:config FEATURE_GZIP_PARALLEL
+//config:	bool "Enable -p N: compress using N processes"
+//config:	default y
+//config:	depends on GZIP && !NOMMU
+//config:	help
+//config:	  Input is split into 128 kb pieces which are compressed
+//config:	  by up to N child processes at once, each piece using the end
+//config:	  of the previous one as a dictionary (like pigz does).
+//config:	  The result is one ordinary gzip stream, only slightly
+//config:	  bigger than one produced without -p.
 
 //applet:IF_GZIP(APPLET(gzip, BB_DIR_BIN, BB_SUID_DROP))
 //kbuild:lib-$(CONFIG_GZIP) += gzip.o
 
 //usage:#define gzip_trivial_usage
-//usage:       "[-cfd] [FILE]..."
+//usage:       "[-cfd" IF_FEATURE_GZIP_LEVELS("123456789") "] [FILE]..."
 //usage:#define gzip_full_usage "\n\n"
 //usage:       "Compress FILEs (or stdin)\n"
 //usage:     "\n	-d	Decompress"
 //usage:     "\n	-c	Write to stdout"
 //usage:     "\n	-f	Force"
+//usage:	IF_FEATURE_GZIP_LEVELS(
+//usage:     "\n	-1..-9	Compression level"
+//usage:	)
+//usage:	IF_FEATURE_GZIP_PARALLEL(
+//usage:     "\n	-p N	Compress using N processes (0: one per CPU)"
+//usage:	)
 //usage:
 //usage:#define gzip_example_usage
 //usage:       "$ ls -la /tmp/busybox*\n"
@@ -252,6 +279,7 @@ enum {
  * input file length plus MIN_LOOKAHEAD.
  */
 
+#if !ENABLE_FEATURE_GZIP_LEVELS
 	max_chain_length = 4096,
 /* To speed up deflation, hash chains are never searched beyond this length.
  * A higher limit improves compression ratio but degrades the speed.
@@ -283,8 +311,32 @@ enum {
  * For deflate_fast() (levels <= 3) good is ignored and lazy has a different
  * meaning.
  */
+#endif
 };
 
+#if ENABLE_FEATURE_GZIP_LEVELS
+/* Values for max_lazy_match, good_match, nice_match and max_chain_length,
+ * depending on the desired pack level (1..9). Same as in GNU gzip.
+ */
+static const struct {
+	uint8_t good;
+	uint8_t chain_shift;	/* log2(max_chain_length) */
+	uint16_t lazy;
+	uint16_t nice;
+} gzip_level_config[9] ALIGN2 = {
+	/* good chain lazy nice */
+	{  4,  2,   4,   8 }, /* 1 - no lazy matches, lazy limits insertion */
+	{  4,  3,   5,  16 }, /* 2 */
+	{  4,  5,   6,  32 }, /* 3 */
+	{  4,  4,   4,  16 }, /* 4 - lazy matches */
+	{  8,  5,  16,  32 }, /* 5 */
+	{  8,  7,  16, 128 }, /* 6 - default */
+	{  8,  8,  32, 128 }, /* 7 */
+	{ 32, 10, 128, 258 }, /* 8 */
+	{ 32, 12, 258, 258 }, /* 9 - max compression */
+};
+#endif
+
 
 struct globals {
 
@@ -392,6 +444,25 @@ struct globals {
 
 	/*uint32_t *crc_32_tab;*/
 	uint32_t crc;	/* shift register contents */
+
+#if ENABLE_FEATURE_GZIP_LEVELS
+	unsigned level;		/* -1..-9 */
+	unsigned max_chain_length;
+	unsigned max_lazy_match;
+	unsigned good_match;
+	unsigned nice_match;
+#define max_chain_length (G1.max_chain_length)
+#define max_lazy_match   (G1.max_lazy_match)
+#define max_insert_length max_lazy_match
+#define good_match       (G1.good_match)
+#define nice_match       (G1.nice_match)
+#endif
+
+#if ENABLE_FEATURE_GZIP_PARALLEL
+	unsigned nprocs;	/* -p N */
+	const uch *mem_in;	/* if not NULL, file_read() takes data from here */
+	unsigned mem_left;
+#endif
 };
 
 #define G1 (*(ptr_to_globals - 1))
@@ -460,6 +531,16 @@ static unsigned file_read(void *buf, unsigned size)
 
 	Assert(G1.insize == 0, "l_buf not empty");
 
+#if ENABLE_FEATURE_GZIP_PARALLEL
+	if (G1.mem_in) {
+		/* Piece of input given to us by zip_parallel() */
+		len = size < G1.mem_left ? size : G1.mem_left;
+		memcpy(buf, G1.mem_in, len);
+		G1.mem_in += len;
+		G1.mem_left -= len;
+		return len;
+	}
+#endif
 	len = safe_read(ifd, buf, size);
 	if (len == (unsigned)(-1) || len == 0)
 		return len;
@@ -609,6 +690,8 @@ static void fill_window(void)
 		n = file_read(G1.window + G1.strstart + G1.lookahead, more);
 		if (n == 0 || n == (unsigned) -1) {
 			G1.eofile = 1;
+			/* Don't let garbage pollute the dictionary */
+			memset(G1.window + G1.strstart + G1.lookahead, 0, MIN_MATCH - 1);
 		} else {
 			G1.lookahead += n;
 		}
@@ -679,14 +762,31 @@ static int longest_match(IPos cur_match)
 		 */
 		scan += 2, match++;
 
-		/* We check for insufficient lookahead only every 8th comparison;
-		 * the 256th check will be made at strstart+258.
+		/* Compare a word at a time: the first differing byte is found
+		 * from the lowest (on big endian, highest) set bit of XOR.
+		 * We check for insufficient lookahead only once per word;
+		 * the window has room for a word read past strstart+258.
 		 */
-		do {
-		} while (*++scan == *++match && *++scan == *++match &&
-				 *++scan == *++match && *++scan == *++match &&
-				 *++scan == *++match && *++scan == *++match &&
-				 *++scan == *++match && *++scan == *++match && scan < strend);
+		for (;;) {
+			unsigned long sw, mw;
+			move_from_unaligned_long(sw, scan);
+			move_from_unaligned_long(mw, match);
+			sw ^= mw;
+			if (sw != 0) {
+#if BB_LITTLE_ENDIAN
+				scan += __builtin_ctzl(sw) / 8;
+#else
+				scan += __builtin_clzl(sw) / 8;
+#endif
+				break;
+			}
+			scan += sizeof(long);
+			match += sizeof(long);
+			if (scan >= strend)
+				break;
+		}
+		if (scan > strend)
+			scan = strend;
 
 		len = MAX_MATCH - (int) (strend - scan);
 		scan = strend - MAX_MATCH;
@@ -1542,8 +1642,13 @@ static int ct_tally(int dist, int lc)
 		G2.flags = 0;
 		G2.flag_bit = 1;
 	}
-	/* Try to guess if it is profitable to stop the current block here */
+	/* Try to guess if it is profitable to stop the current block here.
+	 * GNU gzip doesn't do it at -1 and -2, neither do we */
+#if ENABLE_FEATURE_GZIP_LEVELS
+	if (G1.level > 2 && (G2.last_lit & 0xfff) == 0) {
+#else
 	if ((G2.last_lit & 0xfff) == 0) {
+#endif
 		/* Compute an upper bound for the compressed length */
 		ulg out_length = G2.last_lit * 8L;
 		ulg in_length = (ulg) G1.strstart - G1.block_start;
@@ -1749,7 +1854,90 @@ do { \
 	head[G1.ins_h] = (s); \
 } while (0)
 
-static ulg deflate(void)
+#if ENABLE_FEATURE_GZIP_LEVELS
+/* ===========================================================================
+ * Processes a new input file and return its compressed length. This
+ * function does not perform lazy evaluation of matches and inserts
+ * new strings in the dictionary only for unmatched strings or for short
+ * matches. It is used only for the fast compression options.
+ */
+static ulg deflate_fast(int eof)
+{
+	IPos hash_head;		/* head of hash chain */
+	int flush;			/* set if current block must be flushed */
+	unsigned match_length = 0;	/* length of best match */
+
+	G1.prev_length = MIN_MATCH - 1;
+	while (G1.lookahead != 0) {
+		/* Insert the string window[strstart .. strstart+2] in the
+		 * dictionary, and set hash_head to the head of the hash chain:
+		 */
+		INSERT_STRING(G1.strstart, hash_head);
+
+		/* Find the longest match, discarding those <= prev_length.
+		 * At this point we have always match_length < MIN_MATCH
+		 */
+		if (hash_head != 0 && G1.strstart - hash_head <= MAX_DIST
+		 && G1.strstart <= WINDOW_SIZE - MIN_LOOKAHEAD
+		) {
+			match_length = longest_match(hash_head);
+			/* longest_match() sets match_start */
+			if (match_length > G1.lookahead)
+				match_length = G1.lookahead;
+		}
+		if (match_length >= MIN_MATCH) {
+			check_match(G1.strstart, G1.match_start, match_length);
+			flush = ct_tally(G1.strstart - G1.match_start, match_length - MIN_MATCH);
+			G1.lookahead -= match_length;
+
+			/* Insert new strings in the hash table only if the match length
+			 * is not too large. This saves time but degrades compression.
+			 */
+			if (match_length <= max_insert_length) {
+				match_length--; /* string at strstart already in hash table */
+				do {
+					G1.strstart++;
+					INSERT_STRING(G1.strstart, hash_head);
+					/* strstart never exceeds WSIZE-MAX_MATCH, so there are
+					 * always MIN_MATCH bytes ahead.
+					 */
+				} while (--match_length != 0);
+				G1.strstart++;
+			} else {
+				G1.strstart += match_length;
+				match_length = 0;
+				G1.ins_h = G1.window[G1.strstart];
+				UPDATE_HASH(G1.ins_h, G1.window[G1.strstart + 1]);
+#if MIN_MATCH != 3
+# error Call UPDATE_HASH() MIN_MATCH-3 more times
+#endif
+			}
+		} else {
+			/* No match, output a literal byte */
+			Tracevv((stderr, "%c", G1.window[G1.strstart]));
+			flush = ct_tally(0, G1.window[G1.strstart]);
+			G1.lookahead--;
+			G1.strstart++;
+		}
+		if (flush) {
+			FLUSH_BLOCK(0);
+			G1.block_start = G1.strstart;
+		}
+
+		/* Make sure that we always have enough lookahead, except
+		 * at the end of the input file. We need MAX_MATCH bytes
+		 * for the next match, plus MIN_MATCH bytes to insert the
+		 * string following the next match.
+		 */
+		while (G1.lookahead < MIN_LOOKAHEAD && !G1.eofile)
+			fill_window();
+	}
+
+	return FLUSH_BLOCK(eof);
+}
+#endif
+
+static ulg deflate(int eof)
 {
 	IPos hash_head;		/* head of hash chain */
 	IPos prev_match;	/* previous match */
@@ -1757,6 +1945,11 @@ static ulg deflate(void)
 	int match_available = 0;	/* set if previous match exists */
 	unsigned match_length = MIN_MATCH - 1;	/* length of best match */
 
+#if ENABLE_FEATURE_GZIP_LEVELS
+	if (G1.level <= 3)
+		return deflate_fast(eof);
+#endif
+
 	/* Process the input block. */
 	while (G1.lookahead != 0) {
 		/* Insert the string window[strstart .. strstart+2] in the
@@ -1772,6 +1965,7 @@ static ulg deflate(void)
 
 		if (hash_head != 0 && G1.prev_length < max_lazy_match
 		 && G1.strstart - hash_head <= MAX_DIST
+		 && G1.strstart <= WINDOW_SIZE - MIN_LOOKAHEAD
 		) {
 			/* To simplify the code, we prevent matches with the string
 			 * of window index 0 (in particular we have to avoid a match
@@ -1851,7 +2045,7 @@ static ulg deflate(void)
 	if (match_available)
 		ct_tally(0, G1.window[G1.strstart - 1]);
 
-	return FLUSH_BLOCK(1);	/* eof */
+	return FLUSH_BLOCK(eof);
 }
 
 
@@ -1869,25 +2063,33 @@ static void bi_init(void)
 
 
 /* ===========================================================================
- * Initialize the "longest match" routines for a new file
+ * Initialize the "longest match" routines for a new file.
+ * If dict_len != 0, window[0..dict_len-1] is preset by the caller
+ * and is used as a dictionary.
  */
-static void lm_init(ush * flagsp)
+static void lm_init(ush * flagsp, unsigned dict_len)
 {
 	unsigned j;
+	IPos hash_head;
 
 	/* Initialize the hash table. */
 	memset(head, 0, HASH_SIZE * sizeof(*head));
 	/* prev will be initialized on the fly */
 
 	/* speed options for the general purpose bit flag */
-	*flagsp |= 2;	/* FAST 4, SLOW 2 */
+#if ENABLE_FEATURE_GZIP_LEVELS
+	if (G1.level == 1)
+		*flagsp |= 4;	/* FAST */
+	else if (G1.level == 9)
+#endif
+		*flagsp |= 2;	/* FAST 4, SLOW 2 */
 	/* ??? reduce max_chain_length for binary files */
 
-	G1.strstart = 0;
-	G1.block_start = 0L;
+	G1.strstart = dict_len;
+	G1.block_start = dict_len;
 
-	G1.lookahead = file_read(G1.window,
-			sizeof(int) <= 2 ? (unsigned) WSIZE : 2 * WSIZE);
+	G1.lookahead = file_read(G1.window + dict_len,
+			(sizeof(int) <= 2 ? (unsigned) WSIZE : 2 * WSIZE) - dict_len);
 
 	if (G1.lookahead == 0 || G1.lookahead == (unsigned) -1) {
 		G1.eofile = 1;
@@ -1907,6 +2109,8 @@ static void lm_init(ush * flagsp)
 	/* If lookahead < MIN_MATCH, ins_h is garbage, but this is
 	 * not important since only literal bytes will be emitted.
 	 */
+	for (j = 0; j < dict_len; j++)
+		INSERT_STRING(j, hash_head);
 }
 
 
@@ -2025,12 +2229,12 @@ static void zip(ulg time_stamp)
 
 	bi_init();
 	ct_init();
-	lm_init(&deflate_flags);
+	lm_init(&deflate_flags, 0);
 
 	put_8bit(deflate_flags);	/* extra flags */
 	put_8bit(3);	/* OS identifier = 3 (Unix) */
 
-	deflate();
+	deflate(1);
 
 	/* Write the crc and uncompressed size */
 	put_32bit(~G1.crc);
@@ -2040,6 +2244,136 @@ static void zip(ulg time_stamp)
 }
 
 
+#if ENABLE_FEATURE_GZIP_PARALLEL
+/* ===========================================================================
+ * Parallel deflate. Input is cut into CHUNK_SIZE pieces, each one is
+ * deflated by a child process with the last WSIZE bytes of the previous
+ * piece preset as a dictionary. Children end their output with an empty
+ * stored block, which byte-aligns it, so the outputs are simply written
+ * one after another. The stream is ended by an empty final block.
+ */
+#define CHUNK_SIZE (128 * 1024)
+
+/* data[0..dict_len-1]: dictionary, data[dict_len..dict_len+len-1]: input */
+static void deflate_chunk(const uch *data, unsigned dict_len, unsigned len, int eof)
+{
+	ush deflate_flags = 0;
+
+	memcpy(G1.window, data, dict_len);
+	G1.mem_in = data + dict_len;
+	G1.mem_left = len;
+
+	bi_init();
+	ct_init();
+	lm_init(&deflate_flags, dict_len);
+	deflate(eof);
+	if (!eof) {
+		send_bits(STORED_BLOCK << 1, 3);
+		copy_block(NULL, 0, 1);
+	}
+	flush_outbuf();
+	G1.mem_in = NULL;
+}
+
+/* Write out compressed piece from child */
+static void collect_chunk(pid_t pid, int fd)
+{
+	if (bb_copyfd_eof(fd, ofd) < 0)
+		xfunc_die();
+	close(fd);
+	if (wait4pid(pid) != 0)
+		bb_error_msg_and_die("child process failed");
+}
+
+static void zip_parallel(ulg time_stamp)
+{
+	struct fd_pair *fds;
+	pid_t *pids;
+	uch *buf;
+	unsigned dict_len = 0;
+	unsigned first = 0;
+	unsigned njobs = 0;
+
+	G1.outcnt = 0;
+	put_32bit(0x00088b1f);
+	put_32bit(time_stamp);
+	put_8bit(2);	/* extra flags, as set by lm_init() */
+	put_8bit(3);	/* OS identifier = 3 (Unix) */
+	G1.crc = ~0;
+	bi_init();
+
+	/* buf[0..WSIZE-1]: dictionary, buf[WSIZE..]: current piece */
+	buf = xmalloc(WSIZE + CHUNK_SIZE);
+	fds = xmalloc(G1.nprocs * sizeof(fds[0]));
+	pids = xmalloc(G1.nprocs * sizeof(pids[0]));
+
+	while (1) {
+		struct fd_pair pipe_fds;
+		pid_t pid;
+		int len;
+
+		len = full_read(ifd, buf + WSIZE, CHUNK_SIZE);
+		if (len < 0)
+			bb_perror_msg_and_die(bb_msg_read_error);
+		if (len == 0)
+			break;
+		updcrc(buf + WSIZE, len);
+		G1.isize += len;
+
+		if (G1.isize == (unsigned)len && len < CHUNK_SIZE) {
+			/* Input fits in one piece, no need to fork */
+			deflate_chunk(buf + WSIZE, 0, len, 1);
+			goto trailer;
+		}
+		flush_outbuf();
+
+		if (njobs == G1.nprocs) {
+			collect_chunk(pids[first], fds[first].rd);
+			first = (first + 1) % G1.nprocs;
+			njobs--;
+		}
+		xpiped_pair(pipe_fds);
+		pid = xfork();
+		if (pid == 0) {
+			close(pipe_fds.rd);
+			xmove_fd(pipe_fds.wr, ofd);
+			deflate_chunk(buf + WSIZE - dict_len, dict_len, len, 0);
+			_exit(EXIT_SUCCESS);
+		}
+		close(pipe_fds.wr);
+		pids[(first + njobs) % G1.nprocs] = pid;
+		fds[(first + njobs) % G1.nprocs] = pipe_fds;
+		njobs++;
+
+		/* The end of this piece is the dictionary for the next one */
+		dict_len = len < WSIZE ? len : WSIZE;
+		memmove(buf + WSIZE - dict_len, buf + WSIZE + len - dict_len, dict_len);
+
+		if (len < CHUNK_SIZE)
+			break;
+	}
+
+	while (njobs != 0) {
+		collect_chunk(pids[first], fds[first].rd);
+		first = (first + 1) % G1.nprocs;
+		njobs--;
+	}
+	/* Empty final block with static trees */
+	send_bits((STATIC_TREES << 1) + 1, 3);
+	send_bits(0, 7);	/* END_BLOCK code */
+	bi_windup();
+ trailer:
+	put_32bit(~G1.crc);
+	put_32bit(G1.isize);
+	flush_outbuf();
+
+	free(pids);
+	free(fds);
+	free(buf);
+}
+#endif
+
+
 /* ======================================================================== */
 static
 IF_DESKTOP(long long) int FAST_FUNC pack_gzip(transformer_aux_data_t *aux UNUSED_PARAM)
@@ -2079,6 +2413,12 @@ IF_DESKTOP(long long) int FAST_FUNC pack_gzip(transformer_aux_data_t *aux UNUSED
 
 	s.st_ctime = 0;
 	fstat(STDIN_FILENO, &s);
+#if ENABLE_FEATURE_GZIP_PARALLEL
+	if (G1.nprocs > 1) {
+		zip_parallel(s.st_ctime);
+		return 0;
+	}
+#endif
 	zip(s.st_ctime);
 	return 0;
 }
@@ -2097,6 +2437,9 @@ static const char gzip_longopts[] ALIGN1 =
 	"quiet\0"               No_argument       "q"
 	"fast\0"                No_argument       "1"
 	"best\0"                No_argument       "9"
+#if ENABLE_FEATURE_GZIP_PARALLEL
+	"processes\0"           Required_argument "p"
+#endif
 	;
 #endif
 
@@ -2122,15 +2465,31 @@ int gzip_main(int argc UNUSED_PARAM, char **argv)
 #endif
 {
 	unsigned opt;
+#if ENABLE_FEATURE_GZIP_PARALLEL
+	const char *nprocs = "1";
+#endif
 
 #if ENABLE_FEATURE_GZIP_LONG_OPTIONS
 	applet_long_options = gzip_longopts;
+#endif
+#if ENABLE_FEATURE_GZIP_LEVELS
+	/* Each -N unsets the others: the last one given wins, as in GNU gzip */
+	opt_complementary =
+		"1-23456789:2-13456789:3-12456789:4-12356789:5-12346789:"
+		"6-12345789:7-12345689:8-12345679:9-12345678";
 #endif
 	/* Must match bbunzip's constants OPT_STDOUT, OPT_FORCE! */
-	opt = getopt32(argv, "cfv" IF_GUNZIP("dt") "q123456789n");
+	opt = getopt32(argv, "cfv" IF_GUNZIP("dt") "q123456789n"
+			IF_FEATURE_GZIP_PARALLEL("p:")
+			IF_FEATURE_GZIP_PARALLEL(, &nprocs)
+	);
 #if ENABLE_GUNZIP /* gunzip_main may not be visible... */
 	if (opt & 0x18) // -d and/or -t
 		return gunzip_main(argc, argv);
+#endif
+#if ENABLE_FEATURE_GZIP_LEVELS
+	opt >>= ENABLE_GUNZIP ? 6 : 4; /* drop cfv[dt]q bits */
+	opt &= 0x1ff; /* -1..-9 */
 #endif
 	option_mask32 &= 0x7; /* ignore -q, -0..9 */
 	//if (opt & 0x1) // -c
@@ -2141,13 +2500,29 @@ int gzip_main(int argc UNUSED_PARAM, char **argv)
 	SET_PTR_TO_GLOBALS((char *)xzalloc(sizeof(struct globals)+sizeof(struct globals2))
 			+ sizeof(struct globals));
 
+#if ENABLE_FEATURE_GZIP_LEVELS
+	/* At most one bit is left in opt */
+	G1.level = opt ? 32 - __builtin_clz(opt) : 6;
+	max_chain_length = 1 << gzip_level_config[G1.level - 1].chain_shift;
+	good_match       = gzip_level_config[G1.level - 1].good;
+	max_lazy_match   = gzip_level_config[G1.level - 1].lazy;
+	nice_match       = gzip_level_config[G1.level - 1].nice;
+#endif
+
 	/* Allocate all global buffers (for DYN_ALLOC option) */
 	ALLOC(uch, G1.l_buf, INBUFSIZ);
 	ALLOC(uch, G1.outbuf, OUTBUFSIZ);
 	ALLOC(ush, G1.d_buf, DIST_BUFSIZE);
-	ALLOC(uch, G1.window, 2L * WSIZE);
+	/* + sizeof(long): longest_match() may read a word past the end */
+	ALLOC(uch, G1.window, 2L * WSIZE + sizeof(long));
 	ALLOC(ush, G1.prev, 1L << BITS);
 
+#if ENABLE_FEATURE_GZIP_PARALLEL
+	G1.nprocs = xatou_range(nprocs, 0, 1024);
+	if (G1.nprocs == 0)
+		G1.nprocs = get_cpu_count();
+#endif
+
 	/* Initialize the CRC32 table */
 	global_crc32_table = crc32_filltable(NULL, 0);
 
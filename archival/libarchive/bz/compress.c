@@ -602,6 +602,41 @@ void sendMTFValues(EState* s)
 }
 
 
+/*---------------------------------------------------*/
+/* Write the bits of a sorted block: they depend on nothing but the block
+ * itself, which is what parallel bzip2 relies on */
+static
+void compressBlockData(EState* s)
+{
+	/*bsPutU8(s, 0x31);*/
+	/*bsPutU8(s, 0x41);*/
+	/*bsPutU8(s, 0x59);*/
+	/*bsPutU8(s, 0x26);*/
+	bsPutU32(s, 0x31415926);
+	/*bsPutU8(s, 0x53);*/
+	/*bsPutU8(s, 0x59);*/
+	bsPutU16(s, 0x5359);
+
+	/*-- Now the block's CRC, so it is in a known place. --*/
+	bsPutU32(s, s->blockCRC);
+
+	/*
+	 * Now a single bit indicating (non-)randomisation.
+	 * As of version 0.9.5, we use a better sorting algorithm
+	 * which makes randomisation unnecessary.  So always set
+	 * the randomised bit to 'no'.  Of course, the decoder
+	 * still needs to be able to handle randomised blocks
+	 * so as to maintain backwards compatibility with
+	 * older versions of bzip2.
+	 */
+	bsW(s, 1, 0);
+
+	bsW(s, 24, s->origPtr);
+	generateMTFValues(s);
+	sendMTFValues(s);
+}
+
+
 /*---------------------------------------------------*/
 static
 void BZ2_compressBlock(EState* s, int is_last_block)
@@ -628,34 +663,8 @@ void BZ2_compressBlock(EState* s, int is_last_block)
 		bsPutU32(s, BZ_HDR_BZh0 + s->blockSize100k);
 	}
 
-	if (s->nblock > 0) {
-		/*bsPutU8(s, 0x31);*/
-		/*bsPutU8(s, 0x41);*/
-		/*bsPutU8(s, 0x59);*/
-		/*bsPutU8(s, 0x26);*/
-		bsPutU32(s, 0x31415926);
-		/*bsPutU8(s, 0x53);*/
-		/*bsPutU8(s, 0x59);*/
-		bsPutU16(s, 0x5359);
-
-		/*-- Now the block's CRC, so it is in a known place. --*/
-		bsPutU32(s, s->blockCRC);
-
-		/*
-		 * Now a single bit indicating (non-)randomisation.
-		 * As of version 0.9.5, we use a better sorting algorithm
-		 * which makes randomisation unnecessary.  So always set
-		 * the randomised bit to 'no'.  Of course, the decoder
-		 * still needs to be able to handle randomised blocks
-		 * so as to maintain backwards compatibility with
-		 * older versions of bzip2.
-		 */
-		bsW(s, 1, 0);
-
-		bsW(s, 24, s->origPtr);
-		generateMTFValues(s);
-		sendMTFValues(s);
-	}
+	if (s->nblock > 0)
+		compressBlockData(s);
 
 	/*-- If this is the last block, add the stream trailer. --*/
 	if (is_last_block) {
@@ -0,0 +1,265 @@
+/* vi: set sw=4 ts=4: */
+/*
+ * Licensed under GPLv2 or later, see file LICENSE in this source tree.
+ */
+
+#include "libbb.h"
+#include "bb_archive.h"
+
+/* Extracting a small file takes about six syscalls (open, write, close,
+ * chown, chmod, utimes), and on slow storage each of them can block
+ * for a while. Regular files and hard links are therefore handed,
+ * together with their data, to a pool of worker processes, while
+ * the parent goes on reading headers. Everything else (directories,
+ * symlinks, device nodes) is created by the parent, so that it exists
+ * by the time later entries need it.
+ *
+ * Each worker handles its jobs in order. A file always goes to the same
+ * worker as earlier entries with the same name, and a hard link goes
+ * to the worker which wrote its target, so overwrites and links work
+ * as in serial extraction. Before the parent touches a name itself,
+ * it waits for the worker owning that name to catch up.
+ */
+
+struct extract_job {
+	off_t size;
+	time_t mtime;
+	uid_t uid;
+	gid_t gid;
+	mode_t mode;
+	/* String lengths including NUL, 0 for NULL.
+	 * name_len == 0 is a sync request. */
+	unsigned name_len;
+	unsigned link_len;
+#if ENABLE_FEATURE_TAR_UNAME_GNAME
+	unsigned uname_len;
+	unsigned gname_len;
+#endif
+};
+
+struct extract_worker {
+	pid_t pid;
+	int job_fd;
+	int reply_fd;
+	smallint busy; /* got jobs since last sync */
+};
+
+struct extract_pool {
+	unsigned nprocs;
+	unsigned buf_size;
+	char *buf;
+	struct extract_worker w[];
+};
+
+static unsigned str_size(const char *s)
+{
+	return s ? strlen(s) + 1 : 0;
+}
+
+static char *put_str(char *p, const char *s, unsigned len)
+{
+	return len ? mempcpy(p, s, len) : p;
+}
+
+static char *get_str(char **pp, unsigned len)
+{
+	char *s = *pp;
+	*pp += len;
+	return len ? s : NULL;
+}
+
+static void NORETURN extract_worker(archive_handle_t *archive_handle,
+		int job_fd, int reply_fd)
+{
+	file_header_t *file_header = archive_handle->file_header;
+	struct extract_job job;
+	char *strings = NULL;
+
+	archive_handle->src_fd = job_fd;
+	archive_handle->seek = seek_by_read;
+	archive_handle->tar__pool = NULL;
+
+	while (full_read(job_fd, &job, sizeof(job)) == sizeof(job)) {
+		char *p;
+
+		if (job.name_len == 0) {
+			xwrite(reply_fd, "", 1);
+			continue;
+		}
+		p = strings = xrealloc(strings, job.name_len + job.link_len
+				IF_FEATURE_TAR_UNAME_GNAME(+ job.uname_len + job.gname_len));
+		xread(job_fd, p, job.name_len + job.link_len
+				IF_FEATURE_TAR_UNAME_GNAME(+ job.uname_len + job.gname_len));
+		file_header->name = get_str(&p, job.name_len);
+		file_header->link_target = get_str(&p, job.link_len);
+#if ENABLE_FEATURE_TAR_UNAME_GNAME
+		file_header->tar__uname = get_str(&p, job.uname_len);
+		file_header->tar__gname = get_str(&p, job.gname_len);
+#endif
+		file_header->size = job.size;
+		file_header->mtime = job.mtime;
+		file_header->uid = job.uid;
+		file_header->gid = job.gid;
+		file_header->mode = job.mode;
+		data_extract_all(archive_handle);
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+static struct extract_worker *worker_for(struct extract_pool *pool, const char *name)
+{
+	unsigned h = 0;
+
+	while (*name)
+		h = h * 31 + (unsigned char)*name++;
+	return &pool->w[h % pool->nprocs];
+}
+
+static void send_job(struct extract_pool *pool, struct extract_worker *w,
+		archive_handle_t *archive_handle)
+{
+	file_header_t *file_header = archive_handle->file_header;
+	struct extract_job job;
+	unsigned len;
+	char *p;
+
+	memset(&job, 0, sizeof(job));
+	job.size = file_header->size;
+	job.mtime = file_header->mtime;
+	job.uid = file_header->uid;
+	job.gid = file_header->gid;
+	job.mode = file_header->mode;
+	job.name_len = str_size(file_header->name);
+	job.link_len = str_size(file_header->link_target);
+#if ENABLE_FEATURE_TAR_UNAME_GNAME
+	job.uname_len = str_size(file_header->tar__uname);
+	job.gname_len = str_size(file_header->tar__gname);
+#endif
+	len = sizeof(job) + job.name_len + job.link_len
+		IF_FEATURE_TAR_UNAME_GNAME(+ job.uname_len + job.gname_len);
+	if (len > pool->buf_size) {
+		pool->buf_size = len;
+		pool->buf = xrealloc(pool->buf, len);
+	}
+
+	/* Header and names in one write: a small file is two syscalls */
+	p = mempcpy(pool->buf, &job, sizeof(job));
+	p = put_str(p, file_header->name, job.name_len);
+	p = put_str(p, file_header->link_target, job.link_len);
+#if ENABLE_FEATURE_TAR_UNAME_GNAME
+	p = put_str(p, file_header->tar__uname, job.uname_len);
+	put_str(p, file_header->tar__gname, job.gname_len);
+#endif
+	xwrite(w->job_fd, pool->buf, len);
+	bb_copyfd_exact_size(archive_handle->src_fd, w->job_fd, file_header->size);
+	w->busy = 1;
+}
+
+static void sync_worker(struct extract_worker *w)
+{
+	struct extract_job job;
+	char c;
+
+	if (!w->busy)
+		return;
+	memset(&job, 0, sizeof(job));
+	xwrite(w->job_fd, &job, sizeof(job));
+	if (safe_read(w->reply_fd, &c, 1) != 1)
+		xfunc_die(); /* worker died, and has said why */
+	w->busy = 0;
+}
+
+void FAST_FUNC data_extract_parallel(archive_handle_t *archive_handle)
+{
+	struct extract_pool *pool = archive_handle->tar__pool;
+	file_header_t *file_header = archive_handle->file_header;
+	const char *name = file_header->name;
+	struct extract_worker *w;
+
+	/* We encode hard links as regular files of size 0 with a symlink */
+	if (S_ISREG(file_header->mode)
+	 && file_header->link_target
+	 && file_header->size == 0
+	) {
+		name = file_header->link_target;
+	}
+	w = worker_for(pool, name);
+
+	if (S_ISREG(file_header->mode)
+#if ENABLE_FEATURE_TAR_SELINUX
+	/* setfscreatecon() works on the calling process only */
+	 && !archive_handle->tar__sctx[PAX_NEXT_FILE]
+	 && !archive_handle->tar__sctx[PAX_GLOBAL]
+#endif
+	) {
+		send_job(pool, w, archive_handle);
+		return;
+	}
+
+	sync_worker(w);
+	data_extract_all(archive_handle);
+}
+
+void FAST_FUNC start_extract_workers(archive_handle_t *archive_handle, unsigned nprocs)
+{
+	struct extract_pool *pool;
+	unsigned i;
+
+	pool = xzalloc(sizeof(*pool) + nprocs * sizeof(pool->w[0]));
+	pool->nprocs = nprocs;
+
+	/* A worker which failed has printed why, we only need to exit */
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < nprocs; i++) {
+		struct extract_worker *w = &pool->w[i];
+		struct fd_pair job_pipe, reply_pipe;
+
+		xpiped_pair(job_pipe);
+		xpiped_pair(reply_pipe);
+		w->pid = xfork();
+		if (w->pid == 0) {
+			/* Don't keep earlier workers' pipes open,
+			 * or they will never see EOF */
+			while (w != pool->w) {
+				w--;
+				close(w->job_fd);
+				close(w->reply_fd);
+			}
+			close(job_pipe.wr);
+			close(reply_pipe.rd);
+			close(archive_handle->src_fd);
+			extract_worker(archive_handle, job_pipe.rd, reply_pipe.wr);
+		}
+		close(job_pipe.rd);
+		close(reply_pipe.wr);
+		w->job_fd = job_pipe.wr;
+		w->reply_fd = reply_pipe.rd;
+	}
+
+	archive_handle->tar__pool = pool;
+	archive_handle->action_data = data_extract_parallel;
+}
+
+int FAST_FUNC finish_extract_workers(archive_handle_t *archive_handle)
+{
+	struct extract_pool *pool = archive_handle->tar__pool;
+	int exitcode = EXIT_SUCCESS;
+	unsigned i;
+
+	for (i = 0; i < pool->nprocs; i++)
+		close(pool->w[i].job_fd);
+	for (i = 0; i < pool->nprocs; i++) {
+		if (wait4pid(pool->w[i].pid) != 0)
+			exitcode = EXIT_FAILURE;
+		close(pool->w[i].reply_fd);
+	}
+
+	if (ENABLE_FEATURE_CLEAN_UP) {
+		free(pool->buf);
+		free(pool);
+	}
+	archive_handle->tar__pool = NULL;
+	archive_handle->action_data = data_extract_all;
+	return exitcode;
+}
@@ -103,6 +103,11 @@ struct bunzip_data {
 	/* For I/O error handling */
 	jmp_buf jmpbuf;
 
+#if ENABLE_FEATURE_BUNZIP2_PARALLEL
+	/* 1: decode only one block (parallel worker), 2: it is decoded */
+	smallint one_block;
+#endif
+
 	/* Big things go last (register-relative addressing can be larger for big offsets) */
 	uint32_t crc32Table[256];
 	uint8_t selectors[32768];  /* nSelectors=15 bits */
@@ -634,7 +639,17 @@ int FAST_FUNC read_bunzip(bunzip_data *bd, char *outbuf, int len)
 
 	/* Refill the intermediate buffer by Huffman-decoding next block of input */
 	{
-		int r = get_next_block(bd);
+		int r;
+#if ENABLE_FEATURE_BUNZIP2_PARALLEL
+		if (bd->one_block > 1)
+			r = RETVAL_LAST_BLOCK;
+		else {
+			bd->one_block <<= 1;
+#else
+		{
+#endif
+			r = get_next_block(bd);
+		}
 		if (r) { /* error/end */
 			bd->writeCount = r;
 			return (r != RETVAL_LAST_BLOCK) ? r : len;
@@ -756,8 +771,7 @@ unpack_bz2_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd)
 				i = IOBUF_SIZE - i; /* number of bytes produced */
 				if (i == 0) /* EOF? */
 					break;
-				if (i != full_write(dst_fd, outbuf, i)) {
-					bb_error_msg("short write");
+				if (transformer_write(aux, dst_fd, outbuf, i) != i) {
 					i = RETVAL_SHORT_WRITE;
 					goto release_mem;
 				}
@@ -807,6 +821,322 @@ unpack_bz2_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd)
 	return i ? i : IF_DESKTOP(total_written) + 0;
 }
 
+#if ENABLE_FEATURE_BUNZIP2_PARALLEL
+/* Parallel decompression.
+ *
+ * Blocks of a bzip2 stream are coded independently, but they are not
+ * byte aligned and their compressed length is unknown until they are
+ * decoded. Input is read into a buffer which is scanned for the 48-bit
+ * block signature at every bit offset. A child process is forked
+ * to decode the block at each signature found, up to nprocs of them
+ * at a time. The signature can also occur by chance inside compressed
+ * data: the parent knows where the real blocks are, because every child
+ * reports where its block ends. Children started at other places are
+ * killed.
+ */
+
+/* Max compressed size of a block: 20 bits per symbol, plus tables */
+#define BLOCK_BOUND (900000 / 8 * 20 + 64 * 1024)
+
+enum {
+	BLOCK_MAGIC = 0x314159265359ULL,
+	EOS_MAGIC_HI = 0x177245,
+	EOS_MAGIC_LO = 0x385090,
+};
+
+struct bz_job {
+	off_t bitpos;
+	pid_t pid;
+	int fd;		/* reads data from child */
+};
+
+/* What the child writes before the decompressed data */
+struct bz_job_hdr {
+	int32_t status;
+	uint32_t crc;
+	uint32_t nbits;
+};
+
+/* Find the first block signature starting at or after bit 'from'
+ * which lies entirely within buf[0..len-1] */
+static off_t find_block_magic(const uint8_t *buf, off_t from, size_t len)
+{
+	uint64_t w = 0;
+	size_t i;
+
+	for (i = from / 8; i < len; i++) {
+		int sh;
+
+		w = (w << 8) | buf[i];
+		for (sh = 7; sh >= 0; sh--) {
+			if (((w >> sh) & 0xffffffffffffULL) == BLOCK_MAGIC) {
+				off_t pos = (off_t)i * 8 - 40 - sh;
+				if (pos >= from)
+					return pos;
+			}
+		}
+	}
+	return -1;
+}
+
+/* n <= 32 bits starting at bit 'pos' */
+static uint32_t get_bits_at(const uint8_t *buf, off_t pos, int n)
+{
+	uint64_t w = 0;
+	int i, k;
+
+	buf += pos / 8;
+	k = ((pos & 7) + n + 7) / 8;
+	for (i = 0; i < k; i++)
+		w = (w << 8) | buf[i];
+	return (w >> (k * 8 - (pos & 7) - n)) & (((uint64_t)1 << n) - 1);
+}
+
+/* Child: decode one block starting at bit 'pos' of buf[0..len-1],
+ * write struct bz_job_hdr and the data to fd */
+static void NORETURN decode_one_block(const uint8_t *buf, size_t len, off_t pos, int fd)
+{
+	struct bz_job_hdr hdr;
+	bunzip_data *bd;
+	char *outbuf;
+	int i;
+
+	bd = xzalloc(sizeof(*bd));
+	bd->in_fd = -1;
+	bd->inbuf = (uint8_t*)buf + pos / 8;
+	bd->inbufCount = len - pos / 8;
+	crc32_filltable(bd->crc32Table, 1);
+	/* The block may come from any stream, allow the biggest block size */
+	bd->dbufSize = 900000;
+	bd->dbuf = xmalloc(bd->dbufSize * sizeof(bd->dbuf[0]));
+	bd->one_block = 1;
+	outbuf = xmalloc(IOBUF_SIZE);
+
+	i = setjmp(bd->jmpbuf);
+	if (i == 0) {
+		get_bits(bd, pos & 7);
+		/* Decode the block, but produce no output yet */
+		i = read_bunzip(bd, outbuf, 0);
+		if (bd->writeCount < 0)
+			i = bd->writeCount;
+	}
+	hdr.status = i;
+	hdr.crc = bd->headerCRC;
+	hdr.nbits = bd->inbufPos * 8 - bd->inbufBitCount - (pos & 7);
+	xwrite(fd, &hdr, sizeof(hdr));
+	if (i != 0)
+		_exit(EXIT_FAILURE);
+
+	/* read_bunzip() returns IOBUF_SIZE ("nothing filled") or
+	 * RETVAL_LAST_BLOCK after the block. On CRC error, it sets
+	 * totalCRC to a wrong value and returns RETVAL_LAST_BLOCK. */
+	while ((i = read_bunzip(bd, outbuf, IOBUF_SIZE)) >= 0 && i != IOBUF_SIZE)
+		xwrite(fd, outbuf, IOBUF_SIZE - i);
+	_exit(bd->totalCRC == bd->headerCRC ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void drop_job(struct bz_job *job)
+{
+	kill(job->pid, SIGKILL);
+	close(job->fd);
+	waitpid(job->pid, NULL, 0);
+}
+
+IF_DESKTOP(long long) int FAST_FUNC
+unpack_bz2_stream_parallel(transformer_aux_data_t *aux, int src_fd, int dst_fd, unsigned nprocs)
+{
+	IF_DESKTOP(long long total_written = 0;)
+	struct bz_job *jobs;
+	uint8_t *buf;
+	size_t buf_size, buf_len;
+	off_t expect;		/* where the next block or stream trailer is */
+	off_t next_scan;	/* where to look for signatures from */
+	uint32_t totalCRC = 0;
+	unsigned first = 0;
+	unsigned njobs = 0;
+	smallint eof = 0;
+	smallint need_header = 1;
+	int i;
+
+	if (nprocs <= 1)
+		return unpack_bz2_stream(aux, src_fd, dst_fd);
+
+	if (check_signature16(aux, src_fd, BZIP2_MAGIC))
+		return -1;
+
+	jobs = xmalloc(nprocs * sizeof(jobs[0]));
+	buf_size = 2 * BLOCK_BOUND;
+	buf = xmalloc(buf_size);
+	/* Signature is already consumed, put it back */
+	buf[0] = 'B';
+	buf[1] = 'Z';
+	buf_len = 2;
+	expect = next_scan = 0;
+	i = RETVAL_OK;
+
+	while (1) {
+		struct bz_job *job;
+		struct bz_job_hdr hdr;
+		off_t n;
+
+		/* Start children on block signatures which are fully buffered */
+		while (njobs < nprocs) {
+			struct fd_pair pipe_fds;
+			off_t pos;
+
+			if (next_scan < expect)
+				next_scan = expect;
+			pos = find_block_magic(buf, next_scan, buf_len);
+			if (pos < 0) {
+				if (buf_len * 8 > (size_t)next_scan + 47)
+					next_scan = buf_len * 8 - 47;
+				break;
+			}
+			next_scan = pos;
+			if (!eof && pos / 8 + BLOCK_BOUND > buf_len)
+				break;
+			xpiped_pair(pipe_fds);
+			job = &jobs[(first + njobs) % nprocs];
+			job->bitpos = pos;
+			job->fd = pipe_fds.rd;
+			job->pid = xfork();
+			if (job->pid == 0) {
+				close(pipe_fds.rd);
+				decode_one_block(buf, buf_len, pos, pipe_fds.wr);
+			}
+			close(pipe_fds.wr);
+			njobs++;
+			next_scan = pos + 1;
+		}
+
+		/* Children started on false signatures */
+		while (njobs != 0 && jobs[first].bitpos < expect) {
+			drop_job(&jobs[first]);
+			first = (first + 1) % nprocs;
+			njobs--;
+		}
+
+		if (need_header) {
+			/* "BZh1".."BZh9". Not "BZ" after a stream (or EOF):
+			 * we are done. More streams come from pbzip2 */
+			if (buf_len < (size_t)expect / 8 + 4 && !eof)
+				goto read_more;
+			if (buf_len < (size_t)expect / 8 + 2
+			 || buf[expect / 8] != 'B' || buf[expect / 8 + 1] != 'Z'
+			) {
+				break;
+			}
+			if (buf_len < (size_t)expect / 8 + 4
+			 || buf[expect / 8 + 2] != 'h'
+			 || (unsigned)(buf[expect / 8 + 3] - '1') > 8
+			) {
+				i = RETVAL_NOT_BZIP_DATA;
+				goto bunzip_err;
+			}
+			expect += 4 * 8;
+			totalCRC = 0;
+			need_header = 0;
+			continue;
+		}
+
+		/* Is it a block or the stream trailer? */
+		if (buf_len < (size_t)(expect + 80 + 7) / 8)
+			goto read_more;
+		if (get_bits_at(buf, expect, 24) == EOS_MAGIC_HI
+		 && get_bits_at(buf, expect + 24, 24) == EOS_MAGIC_LO
+		) {
+			if (get_bits_at(buf, expect + 48, 32) != totalCRC) {
+				bb_error_msg("CRC error");
+				i = -1;
+				break;
+			}
+			/* Trailer is padded to a byte boundary */
+			expect = (expect + 80 + 7) / 8 * 8;
+			need_header = 1;
+			continue;
+		}
+
+		if (njobs == 0 || jobs[first].bitpos != expect) {
+			/* No signature here, or the block is not read in yet */
+			if (njobs == 0 && !eof)
+				goto read_more;
+			i = RETVAL_NOT_BZIP_DATA;
+			goto bunzip_err;
+		}
+
+		/* The next block is being decoded, copy out its data */
+		job = &jobs[first];
+		if (full_read(job->fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+			hdr.status = RETVAL_UNEXPECTED_INPUT_EOF;
+		if (hdr.status != 0) {
+			i = hdr.status;
+			goto bunzip_err;
+		}
+		n = bb_copyfd_eof(job->fd, dst_fd);
+		if (n < 0) {
+			i = RETVAL_SHORT_WRITE;
+			break;
+		}
+		IF_DESKTOP(total_written += n;)
+		close(job->fd);
+		if (wait4pid(job->pid) != 0) {
+			bb_error_msg("CRC error");
+			njobs--;
+			first = (first + 1) % nprocs;
+			i = -1;
+			break;
+		}
+		first = (first + 1) % nprocs;
+		njobs--;
+		totalCRC = ((totalCRC << 1) | (totalCRC >> 31)) ^ hdr.crc;
+		expect += hdr.nbits;
+		continue;
+
+ read_more:
+		if (eof) {
+			i = RETVAL_UNEXPECTED_INPUT_EOF;
+			goto bunzip_err;
+		}
+		if (buf_size - buf_len < 64 * 1024) {
+			/* Everything before the next block is done with */
+			size_t skip = expect / 8;
+
+			memmove(buf, buf + skip, buf_len - skip);
+			buf_len -= skip;
+			expect -= (off_t)skip * 8;
+			next_scan -= (off_t)skip * 8;
+			for (n = 0; n < njobs; n++)
+				jobs[(first + n) % nprocs].bitpos -= (off_t)skip * 8;
+			if (buf_size - buf_len < 64 * 1024) {
+				buf_size += buf_size / 2;
+				buf = xrealloc(buf, buf_size);
+			}
+		}
+		n = safe_read(src_fd, buf + buf_len, buf_size - buf_len);
+		if (n < 0)
+			bb_perror_msg_and_die(bb_msg_read_error);
+		if (n == 0)
+			eof = 1;
+		buf_len += n;
+		continue;
+
+ bunzip_err:
+		bb_error_msg("bunzip error %d", i);
+		break;
+	}
+
+	while (njobs != 0) {
+		drop_job(&jobs[first]);
+		first = (first + 1) % nprocs;
+		njobs--;
+	}
+	free(buf);
+	free(jobs);
+
+	return i ? -1 : IF_DESKTOP(total_written) + 0;
+}
+#endif
+
 #ifdef TESTING
 
 static char *const bunzip_errors[] = {
@@ -37,22 +37,45 @@
 #include "libbb.h"
 #include "bb_archive.h"
 
+/* Decoding table entry. A code of up to 'root' bits is decoded by
+ * a single lookup in the root table; longer codes take one more
+ * lookup in a subtable linked from the root table entry.
+ * b is always the full length of the code. */
 typedef struct huft_t {
-	unsigned char e;	/* number of extra bits or operation */
-	unsigned char b;	/* number of bits in this code or subcode */
-	union {
-		unsigned short n;	/* literal, length base, or distance base */
-		struct huft_t *t;	/* pointer to next level of table */
-	} v;
+	unsigned char e;	/* operation, see HUFT_xxx */
+	unsigned char b;	/* number of bits in this code */
+	unsigned short v;	/* literal, length/distance base, or subtable offset */
 } huft_t;
 
+enum {
+	HUFT_LIT  = 0x00,	/* v is a literal byte */
+	HUFT_BASE = 0x10,	/* v is length or distance base, low 4 bits: extra bits */
+	HUFT_SUB  = 0x20,	/* v is subtable offset, low 4 bits: subtable index bits */
+	HUFT_EOB  = 0x40,	/* end of block */
+	HUFT_BAD  = 0x80,	/* invalid code */
+};
+
+/* Bit buffer is a machine word: refilled a whole word at a time */
+typedef unsigned long bitbuf_t;
+#define BITBUF_BITS ((unsigned)sizeof(bitbuf_t) * 8)
+
 enum {
 	/* gunzip_window size--must be a power of two, and
 	 * at least 32K for zip's deflate method */
 	GUNZIP_WSIZE = 0x8000,
-	/* If BMAX needs to be larger than 16, then h and x[] should be ulg. */
-	BMAX = 16,	/* maximum bit length of any code (16 for explode) */
+	BMAX = 15,	/* maximum bit length of any code */
 	N_MAX = 288,	/* maximum number of codes in any set */
+	/* root table bits for literal/length and distance codes */
+	LBITS = 9,
+	DBITS = 6,
+	/* Largest possible tables for the above roots (computed by
+	 * zlib's examples/enough.c for 286 and 30 codes) */
+	ENOUGH_L = 852,
+	ENOUGH_D = 592,
+	/* Longest match, and bytes of input the fast decoder may
+	 * need for one literal/length + distance pair */
+	MAX_MATCH = 258,
+	FAST_INPUT = 16,
 };
 
 
@@ -80,7 +103,7 @@ typedef struct state_t {
 	uint32_t *gunzip_crc_table;
 
 	/* bitbuffer */
-	unsigned gunzip_bb; /* bit buffer */
+	bitbuf_t gunzip_bb; /* bit buffer */
 	unsigned char gunzip_bk; /* bits in bit buffer */
 
 	/* input (compressed) data */
@@ -91,19 +114,13 @@ typedef struct state_t {
 	unsigned bytebuffer_size;       /* how much data is there (size <= max) */
 
 	/* private data of inflate_codes() */
-	unsigned inflate_codes_ml; /* masks for bl and bd bits */
-	unsigned inflate_codes_md; /* masks for bl and bd bits */
-	unsigned inflate_codes_bb; /* bit buffer */
-	unsigned inflate_codes_k; /* number of bits in bit buffer */
-	unsigned inflate_codes_w; /* current gunzip_window position */
-	huft_t *inflate_codes_tl;
-	huft_t *inflate_codes_td;
-	unsigned inflate_codes_bl;
+	unsigned inflate_codes_bl; /* root bits of tl and td */
 	unsigned inflate_codes_bd;
 	unsigned inflate_codes_nn; /* length and index for copy */
 	unsigned inflate_codes_dd;
 
 	smallint resume_copy;
+	smallint fixed_tables; /* tl and td hold the fixed block tables */
 
 	/* private data of inflate_get_next_window() */
 	smallint method; /* method == -1 for stored, -2 for codes */
@@ -112,12 +129,20 @@ typedef struct state_t {
 
 	/* private data of inflate_stored() */
 	unsigned inflate_stored_n;
-	unsigned inflate_stored_b;
-	unsigned inflate_stored_k;
-	unsigned inflate_stored_w;
 
 	const char *error_msg;
 	jmp_buf error_jmp;
+
+	transformer_aux_data_t *aux_data; /* for transformer_write() */
+
+#if ENABLE_FEATURE_GUNZIP_INDEX
+	gz_index_t *gz_idx;
+	off_t out_base; /* uncompressed offset of current member */
+	smallint resumed; /* current member started at a checkpoint */
+#endif
+
+	huft_t inflate_codes_tl[ENOUGH_L];
+	huft_t inflate_codes_td[ENOUGH_D];
 } state_t;
 #define gunzip_bytes_out    (S()gunzip_bytes_out   )
 #define gunzip_crc          (S()gunzip_crc         )
@@ -134,11 +159,6 @@ typedef struct state_t {
 #define bytebuffer          (S()bytebuffer         )
 #define bytebuffer_offset   (S()bytebuffer_offset  )
 #define bytebuffer_size     (S()bytebuffer_size    )
-#define inflate_codes_ml    (S()inflate_codes_ml   )
-#define inflate_codes_md    (S()inflate_codes_md   )
-#define inflate_codes_bb    (S()inflate_codes_bb   )
-#define inflate_codes_k     (S()inflate_codes_k    )
-#define inflate_codes_w     (S()inflate_codes_w    )
 #define inflate_codes_tl    (S()inflate_codes_tl   )
 #define inflate_codes_td    (S()inflate_codes_td   )
 #define inflate_codes_bl    (S()inflate_codes_bl   )
@@ -146,15 +166,17 @@ typedef struct state_t {
 #define inflate_codes_nn    (S()inflate_codes_nn   )
 #define inflate_codes_dd    (S()inflate_codes_dd   )
 #define resume_copy         (S()resume_copy        )
+#define fixed_tables        (S()fixed_tables       )
 #define method              (S()method             )
 #define need_another_block  (S()need_another_block )
 #define end_reached         (S()end_reached        )
 #define inflate_stored_n    (S()inflate_stored_n   )
-#define inflate_stored_b    (S()inflate_stored_b   )
-#define inflate_stored_k    (S()inflate_stored_k   )
-#define inflate_stored_w    (S()inflate_stored_w   )
 #define error_msg           (S()error_msg          )
 #define error_jmp           (S()error_jmp          )
+#define aux_data            (S()aux_data           )
+#define gz_idx              (S()gz_idx             )
+#define out_base            (S()out_base           )
+#define resumed             (S()resumed            )
 
 /* This is a generic part */
 #if STATE_IN_BSS /* Use global data segment */
@@ -218,254 +240,219 @@ static const uint8_t border[] ALIGN1 = {
 };
 
 
-/*
- * Free the malloc'ed tables built by huft_build(), which makes a linked
- * list of the tables it made, with the links in a dummy first entry of
- * each table.
- * t: table to free
- */
-static void huft_free(huft_t *p)
+static void abort_unzip(STATE_PARAM_ONLY) NORETURN;
+static void abort_unzip(STATE_PARAM_ONLY)
 {
-	huft_t *q;
-
-	/* Go through linked list, freeing from the malloced (t[-1]) address. */
-	while (p) {
-		q = (--p)->v.t;
-		free(p);
-		p = q;
-	}
+	longjmp(error_jmp, 1);
 }
 
-static void huft_free_all(STATE_PARAM_ONLY)
+static void refill_bytebuffer(STATE_PARAM_ONLY)
 {
-	huft_free(inflate_codes_tl);
-	huft_free(inflate_codes_td);
-	inflate_codes_tl = NULL;
-	inflate_codes_td = NULL;
+	unsigned sz = bytebuffer_max - 4;
+	if (to_read >= 0 && (unsigned) to_read < sz) /* unzip only */
+		sz = to_read;
+	/* Leave the first 4 bytes empty so we can always unwind the bitbuffer
+	 * to the front of the bytebuffer */
+	bytebuffer_size = safe_read(gunzip_src_fd, &bytebuffer[4], sz);
+	if ((int)bytebuffer_size < 1) {
+		error_msg = "unexpected end of file";
+		abort_unzip(PASS_STATE_ONLY);
+	}
+	if (to_read >= 0) /* unzip only */
+		to_read -= bytebuffer_size;
+	bytebuffer_size += 4;
+	bytebuffer_offset = 4;
 }
 
-static void abort_unzip(STATE_PARAM_ONLY) NORETURN;
-static void abort_unzip(STATE_PARAM_ONLY)
+static bitbuf_t fill_bitbuffer(STATE_PARAM bitbuf_t bitbuffer, unsigned *current, const unsigned required)
 {
-	huft_free_all(PASS_STATE_ONLY);
-	longjmp(error_jmp, 1);
+	if (*current < required) {
+		/* Drop bits preloaded past *current by inflate_codes() */
+		bitbuffer &= ~(~(bitbuf_t)0 << *current);
+		do {
+			if (bytebuffer_offset >= bytebuffer_size)
+				refill_bytebuffer(PASS_STATE_ONLY);
+			bitbuffer |= ((bitbuf_t) bytebuffer[bytebuffer_offset]) << *current;
+			bytebuffer_offset++;
+			*current += 8;
+		} while (*current < required);
+	}
+	return bitbuffer;
 }
 
-static unsigned fill_bitbuffer(STATE_PARAM unsigned bitbuffer, unsigned *current, const unsigned required)
+/* Load a bitbuf_t worth of input bytes, first byte in the low bits */
+static ALWAYS_INLINE bitbuf_t load_bitbuf(const unsigned char *p)
 {
-	while (*current < required) {
-		if (bytebuffer_offset >= bytebuffer_size) {
-			unsigned sz = bytebuffer_max - 4;
-			if (to_read >= 0 && (unsigned) to_read < sz) /* unzip only */
-				sz = to_read;
-			/* Leave the first 4 bytes empty so we can always unwind the bitbuffer
-			 * to the front of the bytebuffer */
-			bytebuffer_size = safe_read(gunzip_src_fd, &bytebuffer[4], sz);
-			if ((int)bytebuffer_size < 1) {
-				error_msg = "unexpected end of file";
-				abort_unzip(PASS_STATE_ONLY);
-			}
-			if (to_read >= 0) /* unzip only */
-				to_read -= bytebuffer_size;
-			bytebuffer_size += 4;
-			bytebuffer_offset = 4;
-		}
-		bitbuffer |= ((unsigned) bytebuffer[bytebuffer_offset]) << *current;
-		bytebuffer_offset++;
-		*current += 8;
-	}
-	return bitbuffer;
+	bitbuf_t v;
+#if BB_LITTLE_ENDIAN
+	move_from_unaligned_long(v, p);
+#else
+	unsigned i = sizeof(v);
+	v = 0;
+	while (i)
+		v = (v << 8) | p[--i];
+#endif
+	return v;
 }
 
 
-/* Given a list of code lengths and a maximum table size, make a set of
- * tables to decode that set of codes.  Return zero on success, one if
- * the given code set is incomplete (the tables are still built in this
- * case), two if the input is invalid (all zero length codes or an
- * oversubscribed set of lengths) - in this case stores NULL in *t.
+/* Given a list of code lengths and a maximum table size, make
+ * a table to decode that set of codes.  Return zero on success, one if
+ * the given code set is incomplete (the table is still built in this
+ * case if it needs no subtables), two if the input is invalid
+ * (all zero length codes or an oversubscribed set of lengths).
  *
  * b:	code lengths in bits (all assumed <= BMAX)
  * n:	number of codes (assumed <= N_MAX)
  * s:	number of simple-valued codes (0..s-1)
  * d:	list of base values for non-simple codes
  * e:	list of extra bits for non-simple codes
- * t:	result: starting table
- * m:	maximum lookup bits, returns actual
+ * t:	result: the table (root table followed by subtables)
+ * m:	maximum root table bits, returns actual
  */
 static int huft_build(const unsigned *b, const unsigned n,
 			const unsigned s, const unsigned short *d,
-			const unsigned char *e, huft_t **t, unsigned *m)
+			const unsigned char *e, huft_t *t, unsigned *m)
 {
-	unsigned a;             /* counter for codes of length k */
 	unsigned c[BMAX + 1];   /* bit length count table */
-	unsigned eob_len;       /* length of end-of-block code (value 256) */
-	unsigned f;             /* i repeats in table every f entries */
-	int g;                  /* maximum code length */
-	int htl;                /* table level */
-	unsigned i;             /* counter, current code */
-	unsigned j;             /* counter */
-	int k;                  /* number of bits in current code */
-	unsigned *p;            /* pointer into c[], b[], or v[] */
-	huft_t *q;              /* points to current table */
+	unsigned x[BMAX + 1];   /* offsets into v[] for each length */
+	uint16_t v[N_MAX];      /* values in order of bit length */
+	unsigned min, max;      /* minimum and maximum code length */
+	unsigned root;          /* bits in root table */
+	unsigned curr;          /* bits in current subtable */
+	unsigned low;           /* root index of current subtable */
+	unsigned next;          /* offset of next subtable */
+	unsigned code;          /* current code, bit-reversed */
+	unsigned i, k;
+	int left;               /* number of unused codes */
+	int incomplete;
 	huft_t r;               /* table entry for structure assignment */
-	huft_t *u[BMAX];        /* table stack */
-	unsigned v[N_MAX];      /* values in order of bit length */
-	int ws[BMAX + 1];       /* bits decoded stack */
-	int w;                  /* bits decoded */
-	unsigned x[BMAX + 1];   /* bit offsets, then code stack */
-	unsigned *xp;           /* pointer into x */
-	int y;                  /* number of dummy codes added */
-	unsigned z;             /* number of entries in current table */
-
-	/* Length of EOB code, if any */
-	eob_len = n > 256 ? b[256] : BMAX;
-
-	*t = NULL;
+	huft_t *q;              /* current subtable */
+	uint16_t *p;
 
 	/* Generate counts for each bit length */
 	memset(c, 0, sizeof(c));
-	p = (unsigned *) b; /* cast allows us to reuse p for pointing to b */
-	i = n;
-	do {
-		c[*p]++; /* assume all entries <= BMAX */
-		p++;     /* can't combine with above line (Solaris bug) */
-	} while (--i);
-	if (c[0] == n) {  /* null input - all zero length codes */
-		*m = 0;
-		return 2;
-	}
-
-	/* Find minimum and maximum length, bound *m by those */
-	for (j = 1; (j <= BMAX) && (c[j] == 0); j++)
+	for (i = 0; i < n; i++)
+		c[b[i]]++;
+	for (max = BMAX; max != 0 && c[max] == 0; max--)
 		continue;
-	k = j; /* minimum code length */
-	for (i = BMAX; (c[i] == 0) && i; i--)
+	if (max == 0)  /* null input - all zero length codes */
+		return 2;
+	for (min = 1; c[min] == 0; min++)
 		continue;
-	g = i; /* maximum code length */
-	*m = (*m < j) ? j : ((*m > i) ? i : *m);
 
-	/* Adjust last length count to fill out codes, if needed */
-	for (y = 1 << j; j < i; j++, y <<= 1) {
-		y -= c[j];
-		if (y < 0)
+	/* Check for an oversubscribed or incomplete set of lengths */
+	left = 1;
+	for (k = 1; k <= BMAX; k++) {
+		left <<= 1;
+		left -= c[k];
+		if (left < 0)
 			return 2; /* bad input: more codes than bits */
 	}
-	y -= c[i];
-	if (y < 0)
-		return 2;
-	c[i] += y;
-
-	/* Generate starting offsets into the value table for each length */
-	x[1] = j = 0;
-	p = c + 1;
-	xp = x + 2;
-	while (--i) { /* note that i == g from above */
-		j += *p++;
-		*xp++ = j;
-	}
+	/* Incomplete sets are legal for a single code, and for the fixed
+	 * distance code; they never need subtables */
+	incomplete = (left > 0 && max != 1);
+	if (incomplete && max > *m)
+		return 1;
+
+	root = *m;
+	if (root > max)
+		root = max;
+	if (root < min)
+		root = min;
+	*m = root;
 
 	/* Make a table of values in order of bit lengths */
-	p = (unsigned *) b;
-	i = 0;
-	do {
-		j = *p++;
-		if (j != 0) {
-			v[x[j]++] = i;
-		}
-	} while (++i < n);
-
-	/* Generate the Huffman codes and for each, make the table entries */
-	x[0] = i = 0;   /* first Huffman code is zero */
-	p = v;          /* grab values in bit order */
-	htl = -1;       /* no tables yet--level -1 */
-	w = ws[0] = 0;  /* bits decoded */
-	u[0] = NULL;    /* just to keep compilers happy */
-	q = NULL;       /* ditto */
-	z = 0;          /* ditto */
-
-	/* go through the bit lengths (k already is bits in shortest code) */
-	for (; k <= g; k++) {
-		a = c[k];
-		while (a--) {
-			/* here i is the Huffman code of length k bits for value *p */
-			/* make tables up to required level */
-			while (k > ws[htl + 1]) {
-				w = ws[++htl];
-
-				/* compute minimum size table less than or equal to *m bits */
-				z = g - w;
-				z = z > *m ? *m : z; /* upper limit on table size */
-				j = k - w;
-				f = 1 << j;
-				if (f > a + 1) { /* try a k-w bit table */
-					/* too few codes for k-w bit table */
-					f -= a + 1; /* deduct codes from patterns left */
-					xp = c + k;
-					while (++j < z) { /* try smaller tables up to z bits */
-						f <<= 1;
-						if (f <= *++xp) {
-							break; /* enough codes to use up j bits */
-						}
-						f -= *xp; /* else deduct codes from patterns */
-					}
-				}
-				j = ((unsigned) (w + j) > eob_len && w >= 0 && (unsigned) w < eob_len) ? eob_len - w : j;	/* make EOB code end at table */
-				z = 1 << j;	/* table entries for j-bit table */
-				ws[htl+1] = w + j;	/* set bits decoded in stack */
-
-				/* allocate and link in new table */
-				q = xzalloc((z + 1) * sizeof(huft_t));
-				*t = q + 1;	/* link to list for huft_free() */
-				t = &(q->v.t);
-				u[htl] = ++q;	/* table starts after link */
-
-				/* connect to last table, if there is one */
-				if (htl) {
-					x[htl] = i; /* save pattern for backing up */
-					r.b = (unsigned char) (w - ws[htl - 1]); /* bits to dump before this table */
-					r.e = (unsigned char) (16 + j); /* bits in this table */
-					r.v.t = q; /* pointer to this table */
-					j = (i & ((1 << w) - 1)) >> ws[htl - 1];
-					u[htl - 1][j] = r; /* connect to last table */
-				}
-			}
-
+	x[1] = 0;
+	for (k = 1; k < BMAX; k++)
+		x[k + 1] = x[k] + c[k];
+	for (i = 0; i < n; i++)
+		if (b[i] != 0)
+			v[x[b[i]]++] = i;
+
+	/* Unused codes of an incomplete set decode as errors */
+	r.e = HUFT_BAD;
+	r.b = root;
+	r.v = 0;
+	for (i = 0; i < (1U << root); i++)
+		t[i] = r;
+
+	/* Generate the Huffman codes in order and fill the table entries */
+	code = 0;
+	low = (unsigned)-1;
+	next = 1 << root;
+	curr = 0;
+	q = NULL;
+	p = v;
+	for (k = min; k <= max; k++) {
+		for (; c[k] != 0; c[k]--) {
 			/* set up table entry in r */
-			r.b = (unsigned char) (k - w);
-			if (p >= v + n) {
-				r.e = 99; /* out of values--invalid code */
-			} else if (*p < s) {
-				r.e = (unsigned char) (*p < 256 ? 16 : 15);	/* 256 is EOB code */
-				r.v.n = (unsigned short) (*p++); /* simple code is just the value */
+			r.b = k;
+			if (*p < s) {
+				r.e = (*p < 256 ? HUFT_LIT : HUFT_EOB); /* 256 is EOB code */
+				r.v = *p;
+			} else if (e[*p - s] == 99) {
+				r.e = HUFT_BAD;
+				r.v = 0;
 			} else {
-				r.e = (unsigned char) e[*p - s]; /* non-simple--look up in lists */
-				r.v.n = d[*p++ - s];
-			}
-
-			/* fill code-like entries with r */
-			f = 1 << (k - w);
-			for (j = i >> w; j < z; j += f) {
-				q[j] = r;
+				r.e = HUFT_BASE + e[*p - s];
+				r.v = d[*p - s];
 			}
+			p++;
 
-			/* backwards increment the k-bit code i */
-			for (j = 1 << (k - 1); i & j; j >>= 1) {
-				i ^= j;
+			if (k <= root) {
+				/* fill all root entries whose low k bits are the code */
+				for (i = code; i < (1U << root); i += 1 << k)
+					t[i] = r;
+			} else {
+				if ((code & mask_bits[root]) != low) {
+					/* start a subtable big enough for the remaining
+					 * codes sharing these root bits */
+					low = code & mask_bits[root];
+					curr = k - root;
+					left = 1 << curr;
+					while (curr + root < max) {
+						left -= c[curr + root];
+						if (left <= 0)
+							break;
+						curr++;
+						left <<= 1;
+					}
+					t[low].e = HUFT_SUB + curr;
+					t[low].b = root;
+					t[low].v = next;
+					q = t + next;
+					next += 1 << curr;
+				}
+				for (i = code >> root; i < (1U << curr); i += 1 << (k - root))
+					q[i] = r;
 			}
-			i ^= j;
 
-			/* backup over finished tables */
-			while ((i & ((1 << w) - 1)) != x[htl]) {
-				w = ws[--htl];
-			}
+			/* backwards increment the k-bit code */
+			i = 1 << (k - 1);
+			while (code & i)
+				i >>= 1;
+			code = i ? (code & (i - 1)) + i : 0;
 		}
 	}
 
-	/* return actual size of base table */
-	*m = ws[1];
-
 	/* Return 1 if we were given an incomplete table */
-	return y != 0 && g != 1;
+	return incomplete;
+}
+
+/* Find the table entry for the next code, fetching input bytes
+ * one at a time so that we never read past the end of the code
+ * (unzip relies on that for the last code of a member) */
+static const huft_t *huft_decode(STATE_PARAM const huft_t *t, unsigned root, bitbuf_t *bb, unsigned *k)
+{
+	while (1) {
+		const huft_t *r = t + ((unsigned) *bb & mask_bits[root]);
+		if (r->e & HUFT_SUB)
+			r = t + r->v + ((unsigned) (*bb >> root) & mask_bits[r->e & 0xf]);
+		if (r->b <= *k)
+			return r;
+		*bb = fill_bitbuffer(PASS_STATE *bb, k, *k + 8);
+	}
 }
 
 
@@ -474,196 +461,281 @@ static int huft_build(const unsigned *b, const unsigned n,
  * Return an error code or zero if it all goes ok.
  *
  * tl, td: literal/length and distance decoder tables
- * bl, bd: number of bits decoded by tl[] and td[]
+ * bl, bd: number of root bits of tl[] and td[]
  */
 /* called once from inflate_block */
-
-/* map formerly local static variables to globals */
-#define ml inflate_codes_ml
-#define md inflate_codes_md
-#define bb inflate_codes_bb
-#define k  inflate_codes_k
-#define w  inflate_codes_w
-#define tl inflate_codes_tl
-#define td inflate_codes_td
-#define bl inflate_codes_bl
-#define bd inflate_codes_bd
-#define nn inflate_codes_nn
-#define dd inflate_codes_dd
 static void inflate_codes_setup(STATE_PARAM unsigned my_bl, unsigned my_bd)
 {
-	bl = my_bl;
-	bd = my_bd;
-	/* make local copies of globals */
-	bb = gunzip_bb;			/* initialize bit buffer */
-	k = gunzip_bk;
-	w = gunzip_outbuf_count;	/* initialize gunzip_window position */
-	/* inflate the coded data */
-	ml = mask_bits[bl];		/* precompute masks for speed */
-	md = mask_bits[bd];
+	inflate_codes_bl = my_bl;
+	inflate_codes_bd = my_bd;
 }
 /* called once from inflate_get_next_window */
 static NOINLINE int inflate_codes(STATE_PARAM_ONLY)
 {
-	unsigned e;	/* table entry flag/number of extra bits */
-	huft_t *t;	/* pointer to table entry */
-
-	if (resume_copy)
+	/* Hot state lives in locals, not in *state */
+	const huft_t *tl = inflate_codes_tl;
+	const huft_t *td = inflate_codes_td;
+	const unsigned bl = inflate_codes_bl;
+	const unsigned bd = inflate_codes_bd;
+	unsigned char *window = gunzip_window;
+	bitbuf_t bb = gunzip_bb;	/* bit buffer */
+	unsigned k = gunzip_bk;		/* number of bits in bit buffer */
+	unsigned w = gunzip_outbuf_count; /* current gunzip_window position */
+	const huft_t *t;	/* pointer to table entry */
+	unsigned e;		/* number of extra bits */
+	unsigned nn, dd;	/* length and index for copy */
+
+#define LOOKUP(tab, root) do { \
+	t = tab + ((unsigned) bb & mask_bits[root]); \
+	if (t->e & HUFT_SUB) \
+		t = tab + t->v + ((unsigned) (bb >> root) & mask_bits[t->e & 0xf]); \
+} while (0)
+#define DUMPBITS(n) do { bb >>= (n); k -= (n); } while (0)
+#define NEEDBITS(n) do { \
+	unsigned kk = k; \
+	bb = fill_bitbuffer(PASS_STATE bb, &kk, (n)); \
+	k = kk; \
+} while (0)
+
+	if (resume_copy) {
+		nn = inflate_codes_nn;
+		dd = inflate_codes_dd;
 		goto do_copy;
+	}
 
 	while (1) {			/* do until end of block */
-		bb = fill_bitbuffer(PASS_STATE bb, &k, bl);
-		t = tl + ((unsigned) bb & ml);
-		e = t->e;
-		if (e > 16)
+		if (bytebuffer_size - bytebuffer_offset >= FAST_INPUT
+		 && GUNZIP_WSIZE - w > MAX_MATCH
+		) {
+			/* Fast path: there is enough input for a whole
+			 * length/distance pair and enough window space for
+			 * the longest match, so no per-byte checks are needed.
+			 * Input is loaded a word at a time; the bytes loaded
+			 * beyond the k counted bits are the ones the next load
+			 * puts at the same place, so they are harmless. */
+			const unsigned char *in = bytebuffer + bytebuffer_offset;
+			const unsigned char *in_end = bytebuffer + bytebuffer_size - FAST_INPUT;
+#define REFILL() do { \
+	bb |= load_bitbuf(in) << k; \
+	in += (BITBUF_BITS - 1 - k) >> 3; \
+	k |= BITBUF_BITS - 8; \
+} while (0)
 			do {
-				if (e == 99)
-					abort_unzip(PASS_STATE_ONLY);;
-				bb >>= t->b;
-				k -= t->b;
-				e -= 16;
-				bb = fill_bitbuffer(PASS_STATE bb, &k, e);
-				t = t->v.t + ((unsigned) bb & mask_bits[e]);
-				e = t->e;
-			} while (e > 16);
-		bb >>= t->b;
-		k -= t->b;
-		if (e == 16) {	/* then it's a literal */
-			gunzip_window[w++] = (unsigned char) t->v.n;
+				REFILL();
+				LOOKUP(tl, bl);
+				if (t->e == HUFT_LIT) {
+					DUMPBITS(t->b);
+					window[w++] = (unsigned char) t->v;
+					/* the next literal is usually loaded already */
+					LOOKUP(tl, bl);
+					if (t->e == HUFT_LIT && t->b <= k) {
+						DUMPBITS(t->b);
+						window[w++] = (unsigned char) t->v;
+					}
+					continue;
+				}
+				if (!(t->e & HUFT_BASE)) {
+					if (t->e == HUFT_EOB) {
+						DUMPBITS(t->b);
+						bytebuffer_offset = in - bytebuffer;
+						goto eob;
+					}
+					abort_unzip(PASS_STATE_ONLY);
+				}
+				DUMPBITS(t->b);
+				e = t->e & 0xf;
+				nn = t->v + ((unsigned) bb & mask_bits[e]);
+				DUMPBITS(e);
+
+				if (BITBUF_BITS < 64)
+					REFILL();
+				LOOKUP(td, bd);
+				if (!(t->e & HUFT_BASE))
+					abort_unzip(PASS_STATE_ONLY);
+				DUMPBITS(t->b);
+				if (BITBUF_BITS < 64)
+					REFILL();
+				e = t->e & 0xf;
+				dd = t->v + ((unsigned) bb & mask_bits[e]);
+				DUMPBITS(e);
+
+				if (dd > w) {
+					/* source wraps around the window */
+					dd = w - dd;
+					bytebuffer_offset = in - bytebuffer;
+					goto do_copy;
+				}
+				{
+					unsigned char *dst = window + w;
+					const unsigned char *src = dst - dd;
+					w += nn;
+					if (dd >= nn) {
+						memcpy(dst, src, nn);
+					} else if (dd == 1) {
+						memset(dst, *src, nn);
+					} else {
+						/* Overlapping copy: [src,dst) holds whole
+						 * periods of the pattern, so it can be copied
+						 * in one go, doubling each time */
+						do {
+							e = dst - src;
+							if (e > nn)
+								e = nn;
+							memcpy(dst, src, e);
+							dst += e;
+							nn -= e;
+						} while (nn);
+					}
+				}
+			} while (in < in_end && GUNZIP_WSIZE - w > MAX_MATCH);
+#undef REFILL
+			bytebuffer_offset = in - bytebuffer;
+			continue;
+		}
+
+		/* Slow path: near the end of input buffer or window */
+		while (1) {
+			LOOKUP(tl, bl);
+			if (t->b <= k)
+				break;
+			NEEDBITS(k + 8);
+		}
+		DUMPBITS(t->b);
+		if (t->e == HUFT_LIT) {
+			window[w++] = (unsigned char) t->v;
 			if (w == GUNZIP_WSIZE) {
 				gunzip_outbuf_count = w;
+				gunzip_bb = bb;
+				gunzip_bk = k;
 				//flush_gunzip_window();
-				w = 0;
 				return 1; // We have a block to read
 			}
-		} else {		/* it's an EOB or a length */
+			continue;
+		}
+		if (!(t->e & HUFT_BASE)) {
 			/* exit if end of block */
-			if (e == 15) {
+			if (t->e == HUFT_EOB)
 				break;
-			}
+			abort_unzip(PASS_STATE_ONLY);
+		}
 
-			/* get length of block to copy */
-			bb = fill_bitbuffer(PASS_STATE bb, &k, e);
-			nn = t->v.n + ((unsigned) bb & mask_bits[e]);
-			bb >>= e;
-			k -= e;
-
-			/* decode distance of block to copy */
-			bb = fill_bitbuffer(PASS_STATE bb, &k, bd);
-			t = td + ((unsigned) bb & md);
-			e = t->e;
-			if (e > 16)
-				do {
-					if (e == 99)
-						abort_unzip(PASS_STATE_ONLY);
-					bb >>= t->b;
-					k -= t->b;
-					e -= 16;
-					bb = fill_bitbuffer(PASS_STATE bb, &k, e);
-					t = t->v.t + ((unsigned) bb & mask_bits[e]);
-					e = t->e;
-				} while (e > 16);
-			bb >>= t->b;
-			k -= t->b;
-			bb = fill_bitbuffer(PASS_STATE bb, &k, e);
-			dd = w - t->v.n - ((unsigned) bb & mask_bits[e]);
-			bb >>= e;
-			k -= e;
-
-			/* do the copy */
- do_copy:
-			do {
-				/* Was: nn -= (e = (e = GUNZIP_WSIZE - ((dd &= GUNZIP_WSIZE - 1) > w ? dd : w)) > nn ? nn : e); */
-				/* Who wrote THAT?? rewritten as: */
-				unsigned delta;
-
-				dd &= GUNZIP_WSIZE - 1;
-				e = GUNZIP_WSIZE - (dd > w ? dd : w);
-				delta = w > dd ? w - dd : dd - w;
-				if (e > nn) e = nn;
-				nn -= e;
-
-				/* copy to new buffer to prevent possible overwrite */
-				if (delta >= e) {
-					memcpy(gunzip_window + w, gunzip_window + dd, e);
-					w += e;
-					dd += e;
-				} else {
-					/* do it slow to avoid memcpy() overlap */
-					/* !NOMEMCPY */
-					do {
-						gunzip_window[w++] = gunzip_window[dd++];
-					} while (--e);
-				}
-				if (w == GUNZIP_WSIZE) {
-					gunzip_outbuf_count = w;
-					resume_copy = (nn != 0);
-					//flush_gunzip_window();
-					w = 0;
-					return 1;
-				}
-			} while (nn);
-			resume_copy = 0;
+		/* get length of block to copy */
+		e = t->e & 0xf;
+		NEEDBITS(e);
+		nn = t->v + ((unsigned) bb & mask_bits[e]);
+		DUMPBITS(e);
+
+		/* decode distance of block to copy */
+		while (1) {
+			LOOKUP(td, bd);
+			if (t->b <= k)
+				break;
+			NEEDBITS(k + 8);
 		}
-	}
+		if (!(t->e & HUFT_BASE))
+			abort_unzip(PASS_STATE_ONLY);
+		DUMPBITS(t->b);
+		e = t->e & 0xf;
+		NEEDBITS(e);
+		dd = w - t->v - ((unsigned) bb & mask_bits[e]);
+		DUMPBITS(e);
 
+		/* do the copy */
+ do_copy:
+		do {
+			/* Was: nn -= (e = (e = GUNZIP_WSIZE - ((dd &= GUNZIP_WSIZE - 1) > w ? dd : w)) > nn ? nn : e); */
+			/* Who wrote THAT?? rewritten as: */
+			unsigned delta;
+
+			dd &= GUNZIP_WSIZE - 1;
+			e = GUNZIP_WSIZE - (dd > w ? dd : w);
+			delta = w > dd ? w - dd : dd - w;
+			if (e > nn) e = nn;
+			nn -= e;
+
+			/* copy to new buffer to prevent possible overwrite */
+			if (delta >= e) {
+				memcpy(window + w, window + dd, e);
+				w += e;
+				dd += e;
+			} else {
+				/* do it slow to avoid memcpy() overlap */
+				/* !NOMEMCPY */
+				do {
+					window[w++] = window[dd++];
+				} while (--e);
+			}
+			if (w == GUNZIP_WSIZE) {
+				gunzip_outbuf_count = w;
+				gunzip_bb = bb;
+				gunzip_bk = k;
+				inflate_codes_nn = nn;
+				inflate_codes_dd = dd;
+				resume_copy = (nn != 0);
+				//flush_gunzip_window();
+				return 1;
+			}
+		} while (nn);
+		resume_copy = 0;
+	}
+ eob:
 	/* restore the globals from the locals */
 	gunzip_outbuf_count = w;	/* restore global gunzip_window pointer */
 	gunzip_bb = bb;			/* restore global bit buffer */
 	gunzip_bk = k;
-
-	/* normally just after call to inflate_codes, but save code by putting it here */
-	/* free the decoding tables (tl and td), return */
-	huft_free_all(PASS_STATE_ONLY);
-
-	/* done */
 	return 0;
 }
-#undef ml
-#undef md
-#undef bb
-#undef k
-#undef w
-#undef tl
-#undef td
-#undef bl
-#undef bd
-#undef nn
-#undef dd
+#undef LOOKUP
+#undef DUMPBITS
+#undef NEEDBITS
 
 
 /* called once from inflate_block */
-static void inflate_stored_setup(STATE_PARAM int my_n, int my_b, int my_k)
+static void inflate_stored_setup(STATE_PARAM int my_n, bitbuf_t my_b, int my_k)
 {
 	inflate_stored_n = my_n;
-	inflate_stored_b = my_b;
-	inflate_stored_k = my_k;
-	/* initialize gunzip_window position */
-	inflate_stored_w = gunzip_outbuf_count;
+	gunzip_bb = my_b;
+	gunzip_bk = my_k;
 }
 /* called once from inflate_get_next_window */
 static int inflate_stored(STATE_PARAM_ONLY)
 {
+	unsigned w = gunzip_outbuf_count; /* gunzip_window position */
+
 	/* read and output the compressed data */
-	while (inflate_stored_n--) {
-		inflate_stored_b = fill_bitbuffer(PASS_STATE inflate_stored_b, &inflate_stored_k, 8);
-		gunzip_window[inflate_stored_w++] = (unsigned char) inflate_stored_b;
-		if (inflate_stored_w == GUNZIP_WSIZE) {
-			gunzip_outbuf_count = inflate_stored_w;
+	while (inflate_stored_n) {
+		unsigned cnt;
+
+		if (gunzip_bk >= 8) {
+			/* bytes already in the bit buffer go first */
+			gunzip_window[w++] = (unsigned char) gunzip_bb;
+			gunzip_bb >>= 8;
+			gunzip_bk -= 8;
+			inflate_stored_n--;
+		} else {
+			/* bit buffer is empty (stored data is byte aligned):
+			 * copy straight from the input buffer */
+			gunzip_bb = 0;
+			if (bytebuffer_offset >= bytebuffer_size)
+				refill_bytebuffer(PASS_STATE_ONLY);
+			cnt = bytebuffer_size - bytebuffer_offset;
+			if (cnt > inflate_stored_n)
+				cnt = inflate_stored_n;
+			if (cnt > GUNZIP_WSIZE - w)
+				cnt = GUNZIP_WSIZE - w;
+			memcpy(gunzip_window + w, &bytebuffer[bytebuffer_offset], cnt);
+			bytebuffer_offset += cnt;
+			inflate_stored_n -= cnt;
+			w += cnt;
+		}
+		if (w == GUNZIP_WSIZE) {
+			gunzip_outbuf_count = w;
 			//flush_gunzip_window();
-			inflate_stored_w = 0;
-			inflate_stored_b >>= 8;
-			inflate_stored_k -= 8;
 			return 1; /* We have a block */
 		}
-		inflate_stored_b >>= 8;
-		inflate_stored_k -= 8;
 	}
 
-	/* restore the globals from the locals */
-	gunzip_outbuf_count = inflate_stored_w;		/* restore global gunzip_window pointer */
-	gunzip_bb = inflate_stored_b;	/* restore global bit buffer */
-	gunzip_bk = inflate_stored_k;
+	gunzip_outbuf_count = w;	/* restore global gunzip_window pointer */
 	return 0; /* Finished */
 }
 
@@ -678,9 +750,9 @@ static int inflate_stored(STATE_PARAM_ONLY)
 /* One callsite in inflate_get_next_window */
 static int inflate_block(STATE_PARAM smallint *e)
 {
-	unsigned ll[286 + 30];  /* literal/length and distance code lengths */
+	unsigned ll[N_MAX + 30]; /* literal/length and distance code lengths */
 	unsigned t;     /* block type */
-	unsigned b;     /* bit buffer */
+	bitbuf_t b;     /* bit buffer */
 	unsigned k;     /* number of bits in bit buffer */
 
 	/* make local bit buffer */
@@ -704,8 +776,6 @@ static int inflate_block(STATE_PARAM smallint *e)
 	gunzip_bb = b;
 	gunzip_bk = k;
 
-	/* Do we see block type 1 often? Yes!
-	 * TODO: fix performance problem (see below) */
 	//bb_error_msg("blktype %d", t);
 
 	/* inflate that block type */
@@ -713,7 +783,7 @@ static int inflate_block(STATE_PARAM smallint *e)
 	case 0: /* Inflate stored */
 	{
 		unsigned n;	/* number of bytes in block */
-		unsigned b_stored;	/* bit buffer */
+		bitbuf_t b_stored;	/* bit buffer */
 		unsigned k_stored;	/* number of bits in bit buffer */
 
 		/* make local copies of globals */
@@ -744,52 +814,47 @@ static int inflate_block(STATE_PARAM smallint *e)
 	}
 	case 1:
 	/* Inflate fixed
-	 * decompress an inflated type 1 (fixed Huffman codes) block. We should
-	 * either replace this with a custom decoder, or at least precompute the
-	 * Huffman tables. TODO */
+	 * decompress an inflated type 1 (fixed Huffman codes) block.
+	 * The tables are built once and kept until a dynamic block
+	 * overwrites them. */
 	{
 		int i;                  /* temporary variable */
 		unsigned bl;            /* lookup bits for tl */
 		unsigned bd;            /* lookup bits for td */
-		/* gcc 4.2.1 is too dumb to reuse stackspace. Moved up... */
-		//unsigned ll[288];     /* length list for huft_build */
-
-		/* set up literal table */
-		for (i = 0; i < 144; i++)
-			ll[i] = 8;
-		for (; i < 256; i++)
-			ll[i] = 9;
-		for (; i < 280; i++)
-			ll[i] = 7;
-		for (; i < 288; i++) /* make a complete, but wrong code set */
-			ll[i] = 8;
-		bl = 7;
-		huft_build(ll, 288, 257, cplens, cplext, &inflate_codes_tl, &bl);
-		/* huft_build() never return nonzero - we use known data */
 
-		/* set up distance table */
-		for (i = 0; i < 30; i++) /* make an incomplete code set */
-			ll[i] = 5;
+		bl = LBITS;
 		bd = 5;
-		huft_build(ll, 30, 0, cpdist, cpdext, &inflate_codes_td, &bd);
+		if (!fixed_tables) {
+			/* set up literal table */
+			for (i = 0; i < 144; i++)
+				ll[i] = 8;
+			for (; i < 256; i++)
+				ll[i] = 9;
+			for (; i < 280; i++)
+				ll[i] = 7;
+			for (; i < 288; i++) /* make a complete, but wrong code set */
+				ll[i] = 8;
+			huft_build(ll, 288, 257, cplens, cplext, inflate_codes_tl, &bl);
+			/* huft_build() never return nonzero - we use known data */
+
+			/* set up distance table */
+			for (i = 0; i < 30; i++) /* make an incomplete code set */
+				ll[i] = 5;
+			huft_build(ll, 30, 0, cpdist, cpdext, inflate_codes_td, &bd);
+			fixed_tables = 1;
+		}
 
 		/* set up data for inflate_codes() */
 		inflate_codes_setup(PASS_STATE bl, bd);
 
-		/* huft_free code moved into inflate_codes */
-
 		return -2;
 	}
 	case 2: /* Inflate dynamic */
 	{
-		enum { dbits = 6 };     /* bits in base distance lookup table */
-		enum { lbits = 9 };     /* bits in base literal/length lookup table */
-
-		huft_t *td;             /* distance code table */
+		const huft_t *td;       /* code lengths table entry */
 		unsigned i;             /* temporary variables */
 		unsigned j;
 		unsigned l;             /* last length */
-		unsigned m;             /* mask for bit lengths table */
 		unsigned n;             /* number of lengths to get */
 		unsigned bl;            /* lookup bits for tl */
 		unsigned bd;            /* lookup bits for td */
@@ -797,8 +862,7 @@ static int inflate_block(STATE_PARAM smallint *e)
 		unsigned nl;            /* number of literal/length codes */
 		unsigned nd;            /* number of distance codes */
 
-		//unsigned ll[286 + 30];/* literal/length and distance code lengths */
-		unsigned b_dynamic;     /* bit buffer */
+		bitbuf_t b_dynamic;     /* bit buffer */
 		unsigned k_dynamic;     /* number of bits in bit buffer */
 
 		/* make local bit buffer */
@@ -835,23 +899,24 @@ static int inflate_block(STATE_PARAM smallint *e)
 			ll[border[j]] = 0;
 
 		/* build decoding table for trees - single level, 7 bit lookup */
+		fixed_tables = 0;
 		bl = 7;
-		i = huft_build(ll, 19, 19, NULL, NULL, &inflate_codes_tl, &bl);
+		i = huft_build(ll, 19, 19, NULL, NULL, inflate_codes_tl, &bl);
 		if (i != 0) {
 			abort_unzip(PASS_STATE_ONLY); //return i;	/* incomplete code set */
 		}
 
 		/* read in literal and distance code lengths */
 		n = nl + nd;
-		m = mask_bits[bl];
 		i = l = 0;
 		while ((unsigned) i < n) {
-			b_dynamic = fill_bitbuffer(PASS_STATE b_dynamic, &k_dynamic, (unsigned)bl);
-			td = inflate_codes_tl + ((unsigned) b_dynamic & m);
+			td = huft_decode(PASS_STATE inflate_codes_tl, bl, &b_dynamic, &k_dynamic);
+			if (td->e == HUFT_BAD)
+				abort_unzip(PASS_STATE_ONLY);
 			j = td->b;
 			b_dynamic >>= j;
 			k_dynamic -= j;
-			j = td->v.n;
+			j = td->v;
 			if (j < 16) {	/* length of code in bits (0..15) */
 				ll[i++] = l = j;	/* save last length in l */
 			} else if (j == 16) {	/* repeat last length 3 to 6 times */
@@ -892,29 +957,27 @@ static int inflate_block(STATE_PARAM smallint *e)
 			}
 		}
 
-		/* free decoding table for trees */
-		huft_free(inflate_codes_tl);
-
 		/* restore the global bit buffer */
 		gunzip_bb = b_dynamic;
 		gunzip_bk = k_dynamic;
 
-		/* build the decoding tables for literal/length and distance codes */
-		bl = lbits;
+		/* a block without end-of-block code can't be decoded */
+		if (ll[256] == 0)
+			abort_unzip(PASS_STATE_ONLY);
 
-		i = huft_build(ll, nl, 257, cplens, cplext, &inflate_codes_tl, &bl);
+		/* build the decoding tables for literal/length and distance codes */
+		bl = LBITS;
+		i = huft_build(ll, nl, 257, cplens, cplext, inflate_codes_tl, &bl);
 		if (i != 0)
 			abort_unzip(PASS_STATE_ONLY);
-		bd = dbits;
-		i = huft_build(ll + nl, nd, 0, cpdist, cpdext, &inflate_codes_td, &bd);
+		bd = DBITS;
+		i = huft_build(ll + nl, nd, 0, cpdist, cpdext, inflate_codes_td, &bd);
 		if (i != 0)
 			abort_unzip(PASS_STATE_ONLY);
 
 		/* set up data for inflate_codes() */
 		inflate_codes_setup(PASS_STATE bl, bd);
 
-		/* huft_free code moved into inflate_codes */
-
 		return -2;
 	}
 	default:
@@ -929,6 +992,73 @@ static void calculate_gunzip_crc(STATE_PARAM_ONLY)
 	gunzip_bytes_out += gunzip_outbuf_count;
 }
 
+#if ENABLE_FEATURE_GUNZIP_INDEX
+/* Called at deflate block boundaries: the decoder can be restarted
+ * here given the bit position and the last 32k of output */
+static void add_index_point(STATE_PARAM_ONLY)
+{
+	uint64_t hdr[2];
+	off_t out = out_base + gunzip_bytes_out + gunzip_outbuf_count;
+	off_t in;
+	unsigned w;
+
+	if (out < gz_idx->next_point)
+		return;
+	gz_idx->next_point = out + gz_idx->span;
+
+	in = xlseek(gunzip_src_fd, 0, SEEK_CUR) - (bytebuffer_size - bytebuffer_offset);
+	hdr[0] = SWAP_LE64((uint64_t)out);
+	hdr[1] = SWAP_LE64((uint64_t)in * 8 - gunzip_bk);
+	xwrite(gz_idx->build_fd, hdr, sizeof(hdr));
+	/* gunzip_window is circular: oldest data is after the current position */
+	w = gunzip_outbuf_count;
+	xwrite(gz_idx->build_fd, gunzip_window + w, GUNZIP_WSIZE - w);
+	xwrite(gz_idx->build_fd, gunzip_window, w);
+}
+
+/* Write out the part of gunzip_window inside the requested range */
+static ssize_t write_index_range(STATE_PARAM int out)
+{
+	unsigned char *p = gunzip_window;
+	size_t cnt = gunzip_outbuf_count;
+	ssize_t nwrote;
+
+	if (gz_idx->skip) {
+		size_t d = cnt;
+		if (d > gz_idx->skip)
+			d = gz_idx->skip;
+		gz_idx->skip -= d;
+		p += d;
+		cnt -= d;
+	}
+	if (gz_idx->limit >= 0 && cnt > gz_idx->limit)
+		cnt = gz_idx->limit;
+	if (cnt == 0)
+		return 0;
+
+	if (gz_idx->pwrite_pos < 0) {
+		nwrote = full_write(out, p, cnt);
+	} else {
+		nwrote = 0;
+		while ((size_t)nwrote < cnt) {
+			ssize_t r = pwrite(out, p + nwrote, cnt - nwrote, gz_idx->pwrite_pos + nwrote);
+			if (r <= 0)
+				goto err;
+			nwrote += r;
+		}
+		gz_idx->pwrite_pos += nwrote;
+	}
+	if ((size_t)nwrote != cnt) {
+ err:
+		bb_perror_msg("write");
+		return -1;
+	}
+	if (gz_idx->limit >= 0)
+		gz_idx->limit -= cnt;
+	return nwrote;
+}
+#endif
+
 /* One callsite in inflate_unzip_internal */
 static int inflate_get_next_window(STATE_PARAM_ONLY)
 {
@@ -944,6 +1074,10 @@ static int inflate_get_next_window(STATE_PARAM_ONLY)
 				/* NB: need_another_block is still set */
 				return 0; /* Last block */
 			}
+#if ENABLE_FEATURE_GUNZIP_INDEX
+			if (gz_idx && gz_idx->build_fd >= 0)
+				add_index_point(PASS_STATE_ONLY);
+#endif
 			method = inflate_block(PASS_STATE &end_reached);
 			need_another_block = 0;
 		}
@@ -1000,26 +1134,55 @@ inflate_unzip_internal(STATE_PARAM int in, int out)
 		goto ret;
 	}
 
+#if ENABLE_FEATURE_GUNZIP_INDEX
+	if (resumed) {
+		/* Start in the middle of a deflate stream: restore
+		 * the window and the bits of a partially used byte */
+		unsigned k = 0;
+		unsigned bits = gz_idx->start_bit & 7;
+
+		memcpy(gunzip_window, gz_idx->window, GUNZIP_WSIZE);
+		gunzip_bb = fill_bitbuffer(PASS_STATE 0, &k, bits) >> bits;
+		gunzip_bk = k - bits;
+	}
+#endif
+
 	while (1) {
 		int r = inflate_get_next_window(PASS_STATE_ONLY);
-		nwrote = full_write(out, gunzip_window, gunzip_outbuf_count);
-		if (nwrote != (ssize_t)gunzip_outbuf_count) {
-			bb_perror_msg("write");
+#if ENABLE_FEATURE_GUNZIP_INDEX
+		if (gz_idx)
+			nwrote = write_index_range(PASS_STATE out);
+		else
+#endif
+			nwrote = transformer_write(aux_data, out, gunzip_window, gunzip_outbuf_count);
+		if (nwrote < 0) {
 			n = -1;
 			goto ret;
 		}
 		IF_DESKTOP(n += nwrote;)
 		if (r == 0) break;
+#if ENABLE_FEATURE_GUNZIP_INDEX
+		/* Requested range is done. Index building needs the rest */
+		if (gz_idx && gz_idx->limit == 0 && gz_idx->build_fd < 0)
+			goto ret;
+#endif
 	}
 
 	/* Store unused bytes in a global buffer so calling applets can access it */
 	if (gunzip_bk >= 8) {
 		/* Undo too much lookahead. The next read will be byte aligned
-		 * so we can discard unused bits in the last meaningful byte. */
-		bytebuffer_offset--;
-		bytebuffer[bytebuffer_offset] = gunzip_bb & 0xff;
-		gunzip_bb >>= 8;
-		gunzip_bk -= 8;
+		 * so we can discard unused bits in the last meaningful byte.
+		 * The bit buffer may hold several whole bytes. */
+		unsigned i = gunzip_bk >> 3;
+		bitbuf_t b = gunzip_bb >> (gunzip_bk & 7);
+
+		bytebuffer_offset -= i;
+		for (i = 0; i < (unsigned)(gunzip_bk >> 3); i++) {
+			bytebuffer[bytebuffer_offset + i] = (unsigned char) b;
+			b >>= 8;
+		}
+		gunzip_bb = 0;
+		gunzip_bk = 0;
 	}
  ret:
 	/* Cleanup */
@@ -1042,6 +1205,7 @@ inflate_unzip(transformer_aux_data_t *aux, int in, int out)
 	ALLOC_STATE;
 
 	to_read = aux->bytes_in;
+	aux_data = aux;
 //	bytebuffer_max = 0x8000;
 	bytebuffer_offset = 4;
 	bytebuffer = xmalloc(bytebuffer_max);
@@ -1213,10 +1377,25 @@ unpack_gz_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd)
 
 	ALLOC_STATE;
 	to_read = -1;
+	aux_data = aux;
 //	bytebuffer_max = 0x8000;
 	bytebuffer = xmalloc(bytebuffer_max);
 	gunzip_src_fd = src_fd;
 
+#if ENABLE_FEATURE_GUNZIP_INDEX
+	gz_idx = aux ? aux->gz_index : NULL;
+	if (gz_idx) {
+		gz_idx->next_point = gz_idx->span;
+		if (gz_idx->start_bit > 0) {
+			/* Restart from a checkpoint, past the member header */
+			xlseek(src_fd, gz_idx->start_bit >> 3, SEEK_SET);
+			out_base = gz_idx->start_out;
+			gz_idx->next_point += out_base;
+			resumed = 1;
+			goto inflate;
+		}
+	}
+#endif
  again:
 	if (!check_header_gzip(PASS_STATE aux)) {
 		bb_error_msg("corrupted data");
@@ -1224,12 +1403,21 @@ unpack_gz_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd)
 		goto ret;
 	}
 
+ IF_FEATURE_GUNZIP_INDEX(inflate:)
 	n = inflate_unzip_internal(PASS_STATE src_fd, dst_fd);
 	if (n < 0) {
 		total = -1;
 		goto ret;
 	}
 	total += n;
+#if ENABLE_FEATURE_GUNZIP_INDEX
+	if (gz_idx) {
+		out_base += gunzip_bytes_out;
+		gz_idx->out_total = out_base;
+		if (gz_idx->limit == 0 && gz_idx->build_fd < 0)
+			goto ret;
+	}
+#endif
 
 	if (!top_up(PASS_STATE 8)) {
 		bb_error_msg("corrupted data");
@@ -1239,7 +1427,8 @@ unpack_gz_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd)
 
 	/* Validate decompression - crc */
 	v32 = buffer_read_le_u32(PASS_STATE_ONLY);
-	if ((~gunzip_crc) != v32) {
+	/* (a member we started in the middle of can't be checked) */
+	if ((~gunzip_crc) != v32 IF_FEATURE_GUNZIP_INDEX(&& !resumed)) {
 		bb_error_msg("crc error");
 		total = -1;
 		goto ret;
@@ -1247,10 +1436,11 @@ unpack_gz_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd)
 
 	/* Validate decompression - size */
 	v32 = buffer_read_le_u32(PASS_STATE_ONLY);
-	if ((uint32_t)gunzip_bytes_out != v32) {
+	if ((uint32_t)gunzip_bytes_out != v32 IF_FEATURE_GUNZIP_INDEX(&& !resumed)) {
 		bb_error_msg("incorrect length");
 		total = -1;
 	}
+	IF_FEATURE_GUNZIP_INDEX(resumed = 0;)
 
 	if (!top_up(PASS_STATE 2))
 		goto ret; /* EOF */
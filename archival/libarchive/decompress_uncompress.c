@@ -274,7 +274,8 @@ unpack_Z_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd)
 						}
 
 						if (outpos >= OBUFSIZ) {
-							xwrite(dst_fd, outbuf, outpos);
+							if (transformer_write(aux, dst_fd, outbuf, outpos) != (ssize_t)outpos)
+								goto err;
 							IF_DESKTOP(total_written += outpos;)
 							outpos = 0;
 						}
@@ -301,7 +302,8 @@ unpack_Z_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd)
 	} while (rsize > 0);
 
 	if (outpos > 0) {
-		xwrite(dst_fd, outbuf, outpos);
+		if (transformer_write(aux, dst_fd, outbuf, outpos) != (ssize_t)outpos)
+			goto err;
 		IF_DESKTOP(total_written += outpos;)
 	}
 
@@ -20,6 +20,11 @@
 /* Skip check (rather than fail) of unsupported hash functions */
 #define XZ_DEC_ANY_CHECK  1
 
+#if ENABLE_FEATURE_UNXZ_PARALLEL
+/* Blocks can be decoded by child processes */
+# define XZ_DEC_BLOCK_SKIP 1
+#endif
+
 /* We use our own crc32 function */
 #define XZ_INTERNAL_CRC32 0
 static uint32_t xz_crc32(const uint8_t *buf, size_t size, uint32_t crc)
@@ -37,23 +42,109 @@ static uint32_t xz_crc32(const uint8_t *buf, size_t size, uint32_t crc)
 #include "unxz/xz_dec_lzma2.c"
 #include "unxz/xz_dec_stream.c"
 
-IF_DESKTOP(long long) int FAST_FUNC
-unpack_xz_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd)
+/* Bigger than BUFSIZ: fewer read/write syscalls */
+enum {
+	IN_BUFSIZE = 64 * 1024,
+	OUT_BUFSIZE = 64 * 1024,
+};
+
+#if ENABLE_FEATURE_UNXZ_PARALLEL
+/* Parallel decompression of multi-block streams.
+ *
+ * "xz -T N" splits input into blocks and stores compressed and
+ * uncompressed sizes in every Block Header. Block Headers are decoded
+ * by the parent, which also checks the Index against the sizes.
+ * If the sizes are known, the parent buffers the whole block and
+ * forks a child to decode it. The child inherits the decoder state
+ * right after the Block Header, decodes the block, verifies its Check
+ * and sends the data back through a pipe. The parent writes out data
+ * from children in order. Blocks without sizes are decoded by the parent.
+ */
+
+/* Don't buffer blocks bigger than this, decode them in the parent */
+#define MAX_BLOCK_BUFFER (256 * 1024 * 1024)
+
+struct xz_job {
+	pid_t pid;
+	int fd;
+};
+
+/* Make sure at least 'need' bytes of input are buffered after in_pos */
+static int buffer_input(struct xz_buf *b, unsigned char **membuf, size_t *alloc,
+		size_t need, int src_fd)
+{
+	if (*alloc - b->in_pos < need) {
+		b->in_size -= b->in_pos;
+		memmove(*membuf, *membuf + b->in_pos, b->in_size);
+		b->in_pos = 0;
+		if (*alloc < need) {
+			*alloc = need;
+			*membuf = xrealloc(*membuf, need);
+		}
+		b->in = *membuf;
+	}
+	while (b->in_size - b->in_pos < need) {
+		int rd = safe_read(src_fd, *membuf + b->in_size,
+				MIN(*alloc - b->in_size, INT_MAX));
+		if (rd <= 0)
+			return 0;
+		b->in_size += rd;
+	}
+	return 1;
+}
+
+/* Child: decode the rest of the block, exit code tells if it's good */
+static void NORETURN decode_block(struct xz_dec *s, struct xz_buf *b, int fd)
+{
+	enum xz_ret r;
+
+	do {
+		b->out_pos = 0;
+		r = xz_dec_run(s, b);
+		xwrite(fd, b->out, b->out_pos);
+	} while (r == XZ_OK && s->sequence != SEQ_BLOCK_START);
+	_exit(r == XZ_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static IF_DESKTOP(long long) int collect_block(struct xz_job *job, int dst_fd)
+{
+	off_t n = bb_copyfd_eof(job->fd, dst_fd);
+
+	close(job->fd);
+	if (wait4pid(job->pid) != 0) {
+		bb_error_msg("corrupted data");
+		return -1;
+	}
+	if (n < 0)
+		return -1;
+	return n;
+}
+#endif
+
+static IF_DESKTOP(long long) int
+unpack_xz(transformer_aux_data_t *aux, int src_fd, int dst_fd, unsigned nprocs UNUSED_PARAM)
 {
 	enum xz_ret xz_result;
 	struct xz_buf iobuf;
 	struct xz_dec *state;
 	unsigned char *membuf;
+	size_t in_alloc;
 	IF_DESKTOP(long long) int total = 0;
+#if ENABLE_FEATURE_UNXZ_PARALLEL
+	struct xz_job *jobs = xmalloc(nprocs * sizeof(jobs[0]));
+	unsigned first = 0;
+	unsigned njobs = 0;
+#endif
 
 	if (!global_crc32_table)
 		global_crc32_table = crc32_filltable(NULL, /*endian:*/ 0);
 
 	memset(&iobuf, 0, sizeof(iobuf));
-	membuf = xmalloc(2 * BUFSIZ);
+	in_alloc = IN_BUFSIZE;
+	membuf = xmalloc(IN_BUFSIZE);
 	iobuf.in = membuf;
-	iobuf.out = membuf + BUFSIZ;
-	iobuf.out_size = BUFSIZ;
+	iobuf.out = xmalloc(OUT_BUFSIZE);
+	iobuf.out_size = OUT_BUFSIZE;
 
 	if (!aux || aux->check_signature == 0) {
 		/* Preload XZ file signature */
@@ -67,7 +158,7 @@ unpack_xz_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd)
 	xz_result = X_OK;
 	while (1) {
 		if (iobuf.in_pos == iobuf.in_size) {
-			int rd = safe_read(src_fd, membuf, BUFSIZ);
+			int rd = safe_read(src_fd, membuf, in_alloc);
 			if (rd < 0) {
 				bb_error_msg(bb_msg_read_error);
 				total = -1;
@@ -90,13 +181,79 @@ unpack_xz_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd)
 			 * files bad-0pad-empty.xz and bad-0catpad-empty.xz.
 			 */
 			do {
-				if (membuf[iobuf.in_pos] != 0) {
+				if (iobuf.in[iobuf.in_pos] != 0) {
 					xz_dec_reset(state);
 					goto do_run;
 				}
 				iobuf.in_pos++;
 			} while (iobuf.in_pos < iobuf.in_size);
 		}
+#if ENABLE_FEATURE_UNXZ_PARALLEL
+		if (nprocs > 1
+		 && state->sequence == SEQ_BLOCK_START
+		 && iobuf.in_pos < iobuf.in_size
+		 && iobuf.in[iobuf.in_pos] != 0 /* not Index */
+		) {
+			size_t in_size;
+			size_t hdr_size = ((size_t)iobuf.in[iobuf.in_pos] + 1) * 4;
+			vli_type len;
+
+			if (!buffer_input(&iobuf, &membuf, &in_alloc, hdr_size, src_fd))
+				goto do_run; /* let decoder complain */
+			/* Decode just the Block Header */
+			in_size = iobuf.in_size;
+			iobuf.in_size = iobuf.in_pos + hdr_size;
+			xz_result = xz_dec_run(state, &iobuf);
+			iobuf.in_size = in_size;
+			if (xz_result != XZ_OK)
+				goto check_result;
+
+			len = xz_dec_block_size(state);
+			if (len != 0 && len <= MAX_BLOCK_BUFFER
+			 && buffer_input(&iobuf, &membuf, &in_alloc, len, src_fd)
+			) {
+				struct fd_pair pipe_fds;
+				struct xz_job *job;
+
+				if (njobs == nprocs) {
+					IF_DESKTOP(long long) int n = collect_block(&jobs[first], dst_fd);
+					first = (first + 1) % nprocs;
+					njobs--;
+					if (n < 0) {
+						total = -1;
+						break;
+					}
+					IF_DESKTOP(total += n;)
+				}
+				xpiped_pair(pipe_fds);
+				job = &jobs[(first + njobs) % nprocs];
+				job->fd = pipe_fds.rd;
+				job->pid = xfork();
+				if (job->pid == 0) {
+					close(pipe_fds.rd);
+					iobuf.in_size = iobuf.in_pos + len;
+					decode_block(state, &iobuf, pipe_fds.wr);
+				}
+				close(pipe_fds.wr);
+				njobs++;
+				xz_dec_skip_block(state);
+				iobuf.in_pos += len;
+				continue;
+			}
+			/* No sizes, or no input: decode it here */
+		}
+		/* Write out what children have decoded before going on */
+		while (njobs != 0) {
+			IF_DESKTOP(long long) int n = collect_block(&jobs[first], dst_fd);
+			first = (first + 1) % nprocs;
+			njobs--;
+			if (n < 0) {
+				total = -1;
+				goto out;
+			}
+			IF_DESKTOP(total += n;)
+		}
+#endif
  do_run:
 //		bb_error_msg(">in pos:%d size:%d out pos:%d size:%d",
 //				iobuf.in_pos, iobuf.in_size, iobuf.out_pos, iobuf.out_size);
@@ -104,7 +261,10 @@ unpack_xz_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd)
 //		bb_error_msg("<in pos:%d size:%d out pos:%d size:%d r:%d",
 //				iobuf.in_pos, iobuf.in_size, iobuf.out_pos, iobuf.out_size, xz_result);
 		if (iobuf.out_pos) {
-			xwrite(dst_fd, iobuf.out, iobuf.out_pos);
+			if (transformer_write(aux, dst_fd, iobuf.out, iobuf.out_pos) != (ssize_t)iobuf.out_pos) {
+				total = -1;
+				break;
+			}
 			IF_DESKTOP(total += iobuf.out_pos;)
 			iobuf.out_pos = 0;
 		}
@@ -117,6 +277,9 @@ unpack_xz_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd)
 			 */
 			continue;
 		}
+#if ENABLE_FEATURE_UNXZ_PARALLEL
+ check_result:
+#endif
 		if (xz_result != XZ_OK && xz_result != XZ_UNSUPPORTED_CHECK) {
 			bb_error_msg("corrupted data");
 			total = -1;
@@ -124,8 +287,34 @@ unpack_xz_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd)
 		}
 	}
 
+#if ENABLE_FEATURE_UNXZ_PARALLEL
+ out:
+	while (njobs != 0) {
+		kill(jobs[first].pid, SIGKILL);
+		close(jobs[first].fd);
+		waitpid(jobs[first].pid, NULL, 0);
+		first = (first + 1) % nprocs;
+		njobs--;
+	}
+	free(jobs);
+#endif
 	xz_dec_end(state);
+	free(iobuf.out);
 	free(membuf);
 
 	return total;
 }
+
+IF_DESKTOP(long long) int FAST_FUNC
+unpack_xz_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd)
+{
+	return unpack_xz(aux, src_fd, dst_fd, 1);
+}
+
+#if ENABLE_FEATURE_UNXZ_PARALLEL
+IF_DESKTOP(long long) int FAST_FUNC
+unpack_xz_stream_parallel(transformer_aux_data_t *aux, int src_fd, int dst_fd, unsigned nprocs)
+{
+	return unpack_xz(aux, src_fd, dst_fd, nprocs);
+}
+#endif
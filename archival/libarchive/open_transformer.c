@@ -27,6 +27,51 @@ int FAST_FUNC check_signature16(transformer_aux_data_t *aux, int src_fd, unsigne
 	return 0;
 }
 
+ssize_t FAST_FUNC transformer_write(transformer_aux_data_t *aux, int dst_fd, const void *buf, size_t bufsize)
+{
+	ssize_t nwrote;
+
+	if (aux && aux->mem_output_size_max != 0) {
+		size_t pos = aux->mem_output_size;
+		size_t size;
+
+		/* Like xmalloc_read(): anything past the limit is dropped */
+		size = aux->mem_output_size_max - pos;
+		if (size > bufsize)
+			size = bufsize;
+		size += pos;
+		if (size + 1 > aux->mem_output_alloc) {
+			size_t alloc = aux->mem_output_alloc * 2;
+			char *p;
+
+			if (alloc < 16 * 1024)
+				alloc = 16 * 1024;
+			if (alloc < size + 1)
+				alloc = size + 1;
+			if (alloc > aux->mem_output_size_max + 1)
+				alloc = aux->mem_output_size_max + 1;
+			p = realloc(aux->mem_output_buf, alloc);
+			if (!p) {
+				bb_error_msg(bb_msg_memory_exhausted);
+				return -1;
+			}
+			aux->mem_output_buf = p;
+			aux->mem_output_alloc = alloc;
+		}
+		memcpy(aux->mem_output_buf + pos, buf, size - pos);
+		aux->mem_output_buf[size] = '\0';
+		aux->mem_output_size = size;
+		return bufsize;
+	}
+
+	nwrote = full_write(dst_fd, buf, bufsize);
+	if (nwrote != (ssize_t)bufsize) {
+		bb_perror_msg("write");
+		nwrote = -1;
+	}
+	return nwrote;
+}
+
 void check_errors_in_children(int signo)
 {
 	int status;
@@ -115,59 +160,71 @@ void FAST_FUNC open_transformer(int fd, const char *transform_prog)
 
 #if SEAMLESS_COMPRESSION
 
-/* Used by e.g. rpm which gives us a fd without filename,
- * thus we can't guess the format from filename's extension.
+typedef IF_DESKTOP(long long) int FAST_FUNC transformer_func_t(transformer_aux_data_t *aux, int src_fd, int dst_fd);
+
+/* Reads the signature at fd. If it is a known one, returns the unpacker
+ * (to be run without signature check: the signature is consumed)
+ * and, in *prog_p, the applet which does the same. Otherwise returns NULL.
+ * In both cases *offset_p is how to seek back to where fd was.
  */
-int FAST_FUNC setup_unzip_on_fd(int fd, int fail_if_not_compressed)
+static transformer_func_t *find_unpacker(int fd, int *offset_p, const char **prog_p)
 {
 	union {
 		uint8_t b[4];
 		uint16_t b16[2];
 		uint32_t b32[1];
 	} magic;
-	int offset = -2;
-	USE_FOR_MMU(IF_DESKTOP(long long) int FAST_FUNC (*xformer)(transformer_aux_data_t *aux, int src_fd, int dst_fd);)
-	USE_FOR_NOMMU(const char *xformer_prog;)
 
 	/* .gz and .bz2 both have 2-byte signature, and their
 	 * unpack_XXX_stream wants this header skipped. */
+	*offset_p = -2;
 	xread(fd, magic.b16, sizeof(magic.b16[0]));
 	if (ENABLE_FEATURE_SEAMLESS_GZ
 	 && magic.b16[0] == GZIP_MAGIC
 	) {
-		USE_FOR_MMU(xformer = unpack_gz_stream;)
-		USE_FOR_NOMMU(xformer_prog = "gunzip";)
-		goto found_magic;
+		*prog_p = "gunzip";
+		return unpack_gz_stream;
 	}
 	if (ENABLE_FEATURE_SEAMLESS_BZ2
 	 && magic.b16[0] == BZIP2_MAGIC
 	) {
-		USE_FOR_MMU(xformer = unpack_bz2_stream;)
-		USE_FOR_NOMMU(xformer_prog = "bunzip2";)
-		goto found_magic;
+		*prog_p = "bunzip2";
+		return unpack_bz2_stream;
 	}
 	if (ENABLE_FEATURE_SEAMLESS_XZ
 	 && magic.b16[0] == XZ_MAGIC1
 	) {
-		offset = -6;
+		*offset_p = -6;
 		xread(fd, magic.b32, sizeof(magic.b32[0]));
 		if (magic.b32[0] == XZ_MAGIC2) {
-			USE_FOR_MMU(xformer = unpack_xz_stream;)
-			USE_FOR_NOMMU(xformer_prog = "unxz";)
-			goto found_magic;
+			*prog_p = "unxz";
+			return unpack_xz_stream;
 		}
 	}
+	return NULL;
+}
 
-	/* No known magic seen */
-	if (fail_if_not_compressed)
-		bb_error_msg_and_die("no gzip"
-			IF_FEATURE_SEAMLESS_BZ2("/bzip2")
-			IF_FEATURE_SEAMLESS_XZ("/xz")
-			" magic");
-	xlseek(fd, offset, SEEK_CUR);
-	return 1;
+/* Used by e.g. rpm which gives us a fd without filename,
+ * thus we can't guess the format from filename's extension.
+ */
+int FAST_FUNC setup_unzip_on_fd(int fd, int fail_if_not_compressed)
+{
+	transformer_func_t *xformer;
+	const char *xformer_prog;
+	int offset;
+
+	xformer = find_unpacker(fd, &offset, &xformer_prog);
+	if (!xformer) {
+		/* No known magic seen */
+		if (fail_if_not_compressed)
+			bb_error_msg_and_die("no gzip"
+				IF_FEATURE_SEAMLESS_BZ2("/bzip2")
+				IF_FEATURE_SEAMLESS_XZ("/xz")
+				" magic");
+		xlseek(fd, offset, SEEK_CUR);
+		return 1;
+	}
 
- found_magic:
 # if BB_MMU
 	open_transformer_with_no_sig(fd, xformer);
 # else
@@ -180,6 +237,13 @@ int FAST_FUNC setup_unzip_on_fd(int fd, int fail_if_not_compressed)
 	return 0;
 }
 
+static int is_lzma_name(const char *fname)
+{
+	/* .lzma has no header/signature, can only detect it by extension */
+	char *sfx = strrchr(fname, '.');
+	return sfx && strcmp(sfx+1, "lzma") == 0;
+}
+
 int FAST_FUNC open_zipped(const char *fname, int fail_if_not_compressed)
 {
 	int fd;
@@ -188,13 +252,9 @@ int FAST_FUNC open_zipped(const char *fname, int fail_if_not_compressed)
 	if (fd < 0)
 		return fd;
 
-	if (ENABLE_FEATURE_SEAMLESS_LZMA) {
-		/* .lzma has no header/signature, can only detect it by extension */
-		char *sfx = strrchr(fname, '.');
-		if (sfx && strcmp(sfx+1, "lzma") == 0) {
-			open_transformer_with_sig(fd, unpack_lzma_stream, "unlzma");
-			return fd;
-		}
+	if (ENABLE_FEATURE_SEAMLESS_LZMA && is_lzma_name(fname)) {
+		open_transformer_with_sig(fd, unpack_lzma_stream, "unlzma");
+		return fd;
 	}
 	if ((ENABLE_FEATURE_SEAMLESS_GZ)
 	 || (ENABLE_FEATURE_SEAMLESS_BZ2)
@@ -206,6 +266,30 @@ int FAST_FUNC open_zipped(const char *fname, int fail_if_not_compressed)
 	return fd;
 }
 
+/* Run the unpacker in this process, with output going to memory:
+ * unlike open_zipped(), no child and no pipe copy.
+ * As with xmalloc_read(), output is truncated at *maxsz_p.
+ * Returns NULL if unpacking failed (the unpacker has said why).
+ */
+static void *xmalloc_unpack(int fd, transformer_func_t *xformer, size_t *maxsz_p)
+{
+	transformer_aux_data_t aux;
+
+	init_transformer_aux_data(&aux);
+	aux.mem_output_size_max = maxsz_p ? *maxsz_p : (INT_MAX - 4095);
+	if (xformer(&aux, fd, -1) < 0) {
+		free(aux.mem_output_buf);
+		return NULL;
+	}
+	if (!aux.mem_output_buf) /* empty */
+		aux.mem_output_buf = xzalloc(1);
+	else /* give back what geometric growth overshot */
+		aux.mem_output_buf = xrealloc(aux.mem_output_buf, aux.mem_output_size + 1);
+	if (maxsz_p)
+		*maxsz_p = aux.mem_output_size;
+	return aux.mem_output_buf;
+}
+
 #endif /* SEAMLESS_COMPRESSION */
 
 void* FAST_FUNC xmalloc_open_zipped_read_close(const char *fname, size_t *maxsz_p)
@@ -213,10 +297,36 @@ void* FAST_FUNC xmalloc_open_zipped_read_close(const char *fname, size_t *maxsz_
 	int fd;
 	char *image;
 
-	fd = open_zipped(fname, /*fail_if_not_compressed:*/ 0);
+	fd = open(fname, O_RDONLY);
 	if (fd < 0)
 		return NULL;
 
+#if SEAMLESS_COMPRESSION
+	{
+		transformer_func_t *xformer = NULL;
+
+		if (ENABLE_FEATURE_SEAMLESS_LZMA && is_lzma_name(fname)) {
+			xformer = unpack_lzma_stream;
+		} else
+		if ((ENABLE_FEATURE_SEAMLESS_GZ)
+		 || (ENABLE_FEATURE_SEAMLESS_BZ2)
+		 || (ENABLE_FEATURE_SEAMLESS_XZ)
+		) {
+			const char *xformer_prog;
+			int offset;
+
+			xformer = find_unpacker(fd, &offset, &xformer_prog);
+			if (!xformer)
+				xlseek(fd, offset, SEEK_CUR);
+		}
+		if (xformer) {
+			image = xmalloc_unpack(fd, xformer, maxsz_p);
+			close(fd);
+			return image;
+		}
+	}
+#endif
+
 	image = xmalloc_read(fd, maxsz_p);
 	if (!image)
 		bb_perror_msg("read error from '%s'", fname);
@@ -203,6 +203,30 @@ static enum xz_ret XZ_FUNC dec_vli(struct xz_dec *s,
 	return XZ_OK;
 }
 
+/*
+ * Update the hash and Block count, which are later used to validate
+ * the Index field, once the Block has been decoded.
+ */
+static void XZ_FUNC block_hash_update(struct xz_dec *s)
+{
+	s->block.hash.unpadded += s->block_header.size
+			+ s->block.compressed;
+
+#ifdef XZ_DEC_ANY_CHECK
+	s->block.hash.unpadded += check_sizes[s->check_type];
+#else
+	if (s->check_type == XZ_CHECK_CRC32)
+		s->block.hash.unpadded += 4;
+#endif
+
+	s->block.hash.uncompressed += s->block.uncompressed;
+	s->block.hash.crc32 = xz_crc32(
+			(const uint8_t *)&s->block.hash,
+			sizeof(s->block.hash), s->block.hash.crc32);
+
+	++s->block.count;
+}
+
 /*
  * Decode the Compressed Data field from a Block. Update and validate
  * the observed compressed and uncompressed sizes of the Block so that
@@ -256,27 +280,46 @@ static enum xz_ret XZ_FUNC dec_block(struct xz_dec *s, struct xz_buf *b)
 					!= s->block.uncompressed)
 			return XZ_DATA_ERROR;
 
-		s->block.hash.unpadded += s->block_header.size
-				+ s->block.compressed;
-
-#ifdef XZ_DEC_ANY_CHECK
-		s->block.hash.unpadded += check_sizes[s->check_type];
-#else
-		if (s->check_type == XZ_CHECK_CRC32)
-			s->block.hash.unpadded += 4;
-#endif
-
-		s->block.hash.uncompressed += s->block.uncompressed;
-		s->block.hash.crc32 = xz_crc32(
-				(const uint8_t *)&s->block.hash,
-				sizeof(s->block.hash), s->block.hash.crc32);
-
-		++s->block.count;
+		block_hash_update(s);
 	}
 
 	return ret;
 }
 
+#ifdef XZ_DEC_BLOCK_SKIP
+/*
+ * Return the size of the Compressed Data, Block Padding, and Check
+ * fields of the Block whose Block Header has just been decoded, or zero
+ * if the Block Header doesn't store the sizes.
+ */
+XZ_EXTERN vli_type XZ_FUNC xz_dec_block_size(struct xz_dec *s)
+{
+	if (s->sequence != SEQ_BLOCK_UNCOMPRESS
+			|| s->block.compressed != 0
+			|| s->block.uncompressed != 0
+			|| s->block_header.compressed == VLI_UNKNOWN
+			|| s->block_header.uncompressed == VLI_UNKNOWN)
+		return 0;
+
+	return ((s->block_header.compressed + 3) & ~(vli_type)3)
+			+ check_sizes[s->check_type];
+}
+
+/*
+ * Account for the Block as if it was decoded, with the sizes stored
+ * in its Block Header. This lets the caller decode the Block elsewhere
+ * (e.g. in another process) and skip xz_dec_block_size() bytes of
+ * input. The caller has to validate what is decoded there.
+ */
+XZ_EXTERN void XZ_FUNC xz_dec_skip_block(struct xz_dec *s)
+{
+	s->block.compressed = s->block_header.compressed;
+	s->block.uncompressed = s->block_header.uncompressed;
+	block_hash_update(s);
+	s->sequence = SEQ_BLOCK_START;
+}
+#endif
+
 /* Update the Index size and the CRC32 value. */
 static void XZ_FUNC index_update(struct xz_dec *s, const struct xz_buf *b)
 {
@@ -39,6 +39,15 @@
 //config:	  High levels (7,8,9) of lzop compression. These levels
 //config:	  are actually slower than gzip at equivalent compression ratios
 //config:	  and take up 3.2K of code.
+//config:
+//config:config FEATURE_LZOP_PARALLEL
+//config:	bool "Enable -p N: compress and decompress using N processes"
+//config:	default y
+//config:	depends on LZOP && !NOMMU
+//config:	help
+//config:	  Every lzop block carries its own sizes and checksums, so up to
+//config:	  N blocks are compressed or decompressed by child processes at
+//config:	  once. The output is the same as without -p.
 
 //applet:IF_LZOP(APPLET(lzop, BB_DIR_BIN, BB_SUID_DROP))
 //applet:IF_LZOP(APPLET_ODDNAME(lzopcat, lzop, BB_DIR_USR_BIN, BB_SUID_DROP, lzopcat))
@@ -46,7 +55,7 @@
 //kbuild:lib-$(CONFIG_LZOP) += lzop.o
 
 //usage:#define lzop_trivial_usage
-//usage:       "[-cfvd123456789CF] [FILE]..."
+//usage:       "[-cfvd123456789CF" IF_FEATURE_LZOP_PARALLEL(" -p N") "] [FILE]..."
 //usage:#define lzop_full_usage "\n\n"
 //usage:       "	-1..9	Compression level"
 //usage:     "\n	-d	Decompress"
@@ -55,20 +64,29 @@
 //usage:     "\n	-v	Verbose"
 //usage:     "\n	-F	Don't store or verify checksum"
 //usage:     "\n	-C	Also write checksum of compressed block"
+//usage:	IF_FEATURE_LZOP_PARALLEL(
+//usage:     "\n	-p N	Use N processes (0: one per CPU)"
+//usage:	)
 //usage:
 //usage:#define lzopcat_trivial_usage
-//usage:       "[-vCF] [FILE]..."
+//usage:       "[-vCF" IF_FEATURE_LZOP_PARALLEL(" -p N") "] [FILE]..."
 //usage:#define lzopcat_full_usage "\n\n"
 //usage:       "	-v	Verbose"
 //usage:     "\n	-F	Don't store or verify checksum"
+//usage:	IF_FEATURE_LZOP_PARALLEL(
+//usage:     "\n	-p N	Use N processes (0: one per CPU)"
+//usage:	)
 //usage:
 //usage:#define unlzop_trivial_usage
-//usage:       "[-cfvCF] [FILE]..."
+//usage:       "[-cfvCF" IF_FEATURE_LZOP_PARALLEL(" -p N") "] [FILE]..."
 //usage:#define unlzop_full_usage "\n\n"
 //usage:       "	-c	Write to stdout"
 //usage:     "\n	-f	Force"
 //usage:     "\n	-v	Verbose"
 //usage:     "\n	-F	Don't store or verify checksum"
+//usage:	IF_FEATURE_LZOP_PARALLEL(
+//usage:     "\n	-p N	Use N processes (0: one per CPU)"
+//usage:	)
 
 #include "libbb.h"
 #include "bb_archive.h"
@@ -442,6 +460,13 @@ struct globals {
 	/*const uint32_t *lzo_crc32_table;*/
 	chksum_t chksum_in;
 	chksum_t chksum_out;
+#if ENABLE_FEATURE_LZOP_PARALLEL
+	unsigned nprocs;	/* -p N */
+	unsigned first;		/* oldest running job */
+	unsigned njobs;
+	struct fd_pair *fds;
+	pid_t *pids;
+#endif
 } FIX_ALIASING;
 #define G (*(struct globals*)&bb_common_bufsiz1)
 #define INIT_G() do { } while (0)
@@ -456,7 +481,7 @@ struct globals {
 //#define LZOP_VERSION_STRING     "1.01"
 //#define LZOP_VERSION_DATE       "Apr 27th 2003"
 
-#define OPTION_STRING "cfvqdt123456789CF"
+#define OPTION_STRING "cfvqdt123456789CF" IF_FEATURE_LZOP_PARALLEL("p:")
 
 /* Note: must be kept in sync with archival/bbunzip.c */
 enum {
@@ -630,6 +655,61 @@ static int lzo_get_method(header_t *h)
 	return 0;
 }
 
+#if ENABLE_FEATURE_LZOP_PARALLEL
+/**********************************************************************/
+// parallel blocks
+/**********************************************************************/
+/* Blocks carry their own sizes and checksums and depend on no other
+ * block, so with -p N each one is handled by a child process. The child
+ * writes the block to a pipe, and the parent copies up to N pipes
+ * to stdout in the order blocks were started.
+ */
+static void collect_job(void)
+{
+	unsigned i = G.first;
+
+	if (bb_copyfd_eof(G.fds[i].rd, STDOUT_FILENO) < 0)
+		xfunc_die();
+	close(G.fds[i].rd);
+	if (wait4pid(G.pids[i]) != 0)
+		bb_error_msg_and_die("child process failed");
+	G.first = (i + 1) % G.nprocs;
+	G.njobs--;
+}
+
+/* Returns 0 in the child, whose stdout is now the pipe to parent */
+static pid_t start_job(void)
+{
+	struct fd_pair pipe_fds;
+	pid_t pid;
+	unsigned i;
+
+	if (G.njobs == G.nprocs)
+		collect_job();
+	xpiped_pair(pipe_fds);
+	pid = xfork();
+	if (pid == 0) {
+		close(pipe_fds.rd);
+		xmove_fd(pipe_fds.wr, STDOUT_FILENO);
+		return 0;
+	}
+	close(pipe_fds.wr);
+	i = (G.first + G.njobs) % G.nprocs;
+	G.pids[i] = pid;
+	G.fds[i] = pipe_fds;
+	G.njobs++;
+	return pid;
+}
+
+static void collect_all_jobs(void)
+{
+	while (G.njobs != 0)
+		collect_job();
+}
+#else
+# define collect_all_jobs() ((void)0)
+#endif
+
 /**********************************************************************/
 #define LZO_BLOCK_SIZE	(256 * 1024l)
 #define MAX_BLOCK_SIZE	(64 * 1024l * 1024l)	/* DO NOT CHANGE */
@@ -640,15 +720,87 @@ static int lzo_get_method(header_t *h)
 /**********************************************************************/
 // compress a file
 /**********************************************************************/
+/* Compress b1[0..src_len-1] using b2, write the block to stdout */
+static void lzo_compress_block(const header_t *h,
+		uint8_t *b1, unsigned src_len, uint8_t *b2, uint8_t *wrk_mem)
+{
+	int r = 0; /* LZO_E_OK */
+	unsigned dst_len = 0;
+	uint32_t d_adler32 = ADLER32_INIT_VALUE;
+	uint32_t d_crc32 = CRC32_INIT_VALUE;
+
+	/* write uncompressed block size */
+	write32(src_len);
+
+	/* compute checksum of uncompressed block */
+	if (h->flags & F_ADLER32_D)
+		d_adler32 = lzo_adler32(ADLER32_INIT_VALUE, b1, src_len);
+	if (h->flags & F_CRC32_D)
+		d_crc32 = lzo_crc32(CRC32_INIT_VALUE, b1, src_len);
+
+	/* compress. lzo1x_1 and lzo1x_1_15 take matches from whatever their
+	 * dictionary holds; start each block with an empty one, so that
+	 * the output does not depend on which process compressed the
+	 * previous block */
+	if (h->method == M_LZO1X_1) {
+		memset(wrk_mem, 0, LZO1X_1_MEM_COMPRESS);
+		r = lzo1x_1_compress(b1, src_len, b2, &dst_len, wrk_mem);
+	} else if (h->method == M_LZO1X_1_15) {
+		memset(wrk_mem, 0, LZO1X_1_15_MEM_COMPRESS);
+		r = lzo1x_1_15_compress(b1, src_len, b2, &dst_len, wrk_mem);
+	}
+#if ENABLE_LZOP_COMPR_HIGH
+	else if (h->method == M_LZO1X_999)
+		r = lzo1x_999_compress_level(b1, src_len, b2, &dst_len,
+					wrk_mem, h->level);
+#endif
+	else
+		bb_error_msg_and_die("internal error");
+
+	if (r != 0) /* not LZO_E_OK */
+		bb_error_msg_and_die("internal error - compression failed");
+
+	/* write compressed block size */
+	if (dst_len < src_len) {
+		/* optimize */
+		if (h->method == M_LZO1X_999) {
+			unsigned new_len = src_len;
+			r = lzo1x_optimize(b2, dst_len, b1, &new_len, NULL);
+			if (r != 0 /*LZO_E_OK*/ || new_len != src_len)
+				bb_error_msg_and_die("internal error - optimization failed");
+		}
+		write32(dst_len);
+	} else {
+		/* data actually expanded => store data uncompressed */
+		write32(src_len);
+	}
+
+	/* write checksum of uncompressed block */
+	if (h->flags & F_ADLER32_D)
+		write32(d_adler32);
+	if (h->flags & F_CRC32_D)
+		write32(d_crc32);
+
+	if (dst_len < src_len) {
+		/* write checksum of compressed block */
+		if (h->flags & F_ADLER32_C)
+			write32(lzo_adler32(ADLER32_INIT_VALUE, b2, dst_len));
+		if (h->flags & F_CRC32_C)
+			write32(lzo_crc32(CRC32_INIT_VALUE, b2, dst_len));
+		/* write compressed block data */
+		xwrite(1, b2, dst_len);
+	} else {
+		/* write uncompressed block data */
+		xwrite(1, b1, src_len);
+	}
+}
+
 static NOINLINE smallint lzo_compress(const header_t *h)
 {
 	unsigned block_size = LZO_BLOCK_SIZE;
-	int r = 0; /* LZO_E_OK */
 	uint8_t *const b1 = xzalloc(block_size);
 	uint8_t *const b2 = xzalloc(MAX_COMPRESSED_SIZE(block_size));
-	unsigned src_len = 0, dst_len = 0;
-	uint32_t d_adler32 = ADLER32_INIT_VALUE;
-	uint32_t d_crc32 = CRC32_INIT_VALUE;
+	unsigned src_len;
 	int l;
 	smallint ok = 1;
 	uint8_t *wrk_mem = NULL;
@@ -665,69 +817,25 @@ static NOINLINE smallint lzo_compress(const header_t *h)
 		l = full_read(0, b1, block_size);
 		src_len = (l > 0 ? l : 0);
 
-		/* write uncompressed block size */
-		write32(src_len);
-
 		/* exit if last block */
 		if (src_len == 0)
 			break;
 
-		/* compute checksum of uncompressed block */
-		if (h->flags & F_ADLER32_D)
-			d_adler32 = lzo_adler32(ADLER32_INIT_VALUE, b1, src_len);
-		if (h->flags & F_CRC32_D)
-			d_crc32 = lzo_crc32(CRC32_INIT_VALUE, b1, src_len);
-
-		/* compress */
-		if (h->method == M_LZO1X_1)
-			r = lzo1x_1_compress(b1, src_len, b2, &dst_len, wrk_mem);
-		else if (h->method == M_LZO1X_1_15)
-			r = lzo1x_1_15_compress(b1, src_len, b2, &dst_len, wrk_mem);
-#if ENABLE_LZOP_COMPR_HIGH
-		else if (h->method == M_LZO1X_999)
-			r = lzo1x_999_compress_level(b1, src_len, b2, &dst_len,
-						wrk_mem, h->level);
-#endif
-		else
-			bb_error_msg_and_die("internal error");
-
-		if (r != 0) /* not LZO_E_OK */
-			bb_error_msg_and_die("internal error - compression failed");
-
-		/* write compressed block size */
-		if (dst_len < src_len) {
-			/* optimize */
-			if (h->method == M_LZO1X_999) {
-				unsigned new_len = src_len;
-				r = lzo1x_optimize(b2, dst_len, b1, &new_len, NULL);
-				if (r != 0 /*LZO_E_OK*/ || new_len != src_len)
-					bb_error_msg_and_die("internal error - optimization failed");
+#if ENABLE_FEATURE_LZOP_PARALLEL
+		if (G.nprocs > 1) {
+			if (start_job() == 0) {
+				lzo_compress_block(h, b1, src_len, b2, wrk_mem);
+				_exit(EXIT_SUCCESS);
 			}
-			write32(dst_len);
-		} else {
-			/* data actually expanded => store data uncompressed */
-			write32(src_len);
-		}
-
-		/* write checksum of uncompressed block */
-		if (h->flags & F_ADLER32_D)
-			write32(d_adler32);
-		if (h->flags & F_CRC32_D)
-			write32(d_crc32);
-
-		if (dst_len < src_len) {
-			/* write checksum of compressed block */
-			if (h->flags & F_ADLER32_C)
-				write32(lzo_adler32(ADLER32_INIT_VALUE, b2, dst_len));
-			if (h->flags & F_CRC32_C)
-				write32(lzo_crc32(CRC32_INIT_VALUE, b2, dst_len));
-			/* write compressed block data */
-			xwrite(1, b2, dst_len);
-		} else {
-			/* write uncompressed block data */
-			xwrite(1, b1, src_len);
+			continue;
 		}
+#endif
+		lzo_compress_block(h, b1, src_len, b2, wrk_mem);
 	}
+	collect_all_jobs();
+
+	/* write zero uncompressed block size: end of data */
+	write32(0);
 
 	free(wrk_mem);
 	free(b1);
@@ -753,22 +861,76 @@ static FAST_FUNC void lzo_check(
 /**********************************************************************/
 // decompress a file
 /**********************************************************************/
+/* Decompress b1[0..src_len-1] (which lies at the end of b2) into b2,
+ * verify the block against checksums c (compressed) and d (uncompressed),
+ * write it to stdout.
+ */
+static void lzo_decompress_block(const header_t *h,
+		uint8_t *b1, uint32_t src_len, uint8_t *b2, uint32_t dst_len,
+		const chksum_t *c, const chksum_t *d)
+{
+	uint8_t *dst;
+	int r;
+
+	if (src_len < dst_len) {
+		unsigned n = dst_len;
+
+		if (!(option_mask32 & OPT_F)) {
+			/* verify checksum of compressed block */
+			if (h->flags & F_ADLER32_C)
+				lzo_check(ADLER32_INIT_VALUE,
+						b1, src_len,
+						lzo_adler32, c->f_adler32);
+			if (h->flags & F_CRC32_C)
+				lzo_check(CRC32_INIT_VALUE,
+						b1, src_len,
+						lzo_crc32, c->f_crc32);
+		}
+
+		/* decompress */
+//		if (option_mask32 & OPT_F)
+//			r = lzo1x_decompress(b1, src_len, b2, &n, NULL);
+//		else
+			r = lzo1x_decompress_safe(b1, src_len, b2, &n, NULL);
+
+		if (r != 0 /*LZO_E_OK*/ || dst_len != n) {
+			bb_error_msg_and_die("corrupted data");
+		}
+		dst = b2;
+	} else {
+		/* "stored" block => no decompression */
+		dst = b1;
+	}
+
+	if (!(option_mask32 & OPT_F)) {
+		/* verify checksum of uncompressed block */
+		if (h->flags & F_ADLER32_D)
+			lzo_check(ADLER32_INIT_VALUE,
+				dst, dst_len,
+				lzo_adler32, d->f_adler32);
+		if (h->flags & F_CRC32_D)
+			lzo_check(CRC32_INIT_VALUE,
+				dst, dst_len,
+				lzo_crc32, d->f_crc32);
+	}
+
+	/* write uncompressed block data */
+	xwrite(1, dst, dst_len);
+}
+
 static NOINLINE smallint lzo_decompress(const header_t *h)
 {
 	unsigned block_size = LZO_BLOCK_SIZE;
-	int r;
 	uint32_t src_len, dst_len;
-	uint32_t c_adler32 = ADLER32_INIT_VALUE;
-	uint32_t d_adler32 = ADLER32_INIT_VALUE;
-	uint32_t c_crc32 = CRC32_INIT_VALUE, d_crc32 = CRC32_INIT_VALUE;
+	chksum_t c, d;
 	smallint ok = 1;
 	uint8_t *b1;
 	uint32_t mcs_block_size = MAX_COMPRESSED_SIZE(block_size);
 	uint8_t *b2 = NULL;
 
+	init_chksum(&c);
+	init_chksum(&d);
 	for (;;) {
-		uint8_t *dst;
-
 		/* read uncompressed block size */
 		dst_len = read32();
 
@@ -800,16 +962,16 @@ static NOINLINE smallint lzo_decompress(const header_t *h)
 
 		/* read checksum of uncompressed block */
 		if (h->flags & F_ADLER32_D)
-			d_adler32 = read32();
+			d.f_adler32 = read32();
 		if (h->flags & F_CRC32_D)
-			d_crc32 = read32();
+			d.f_crc32 = read32();
 
 		/* read checksum of compressed block */
 		if (src_len < dst_len) {
 			if (h->flags & F_ADLER32_C)
-				c_adler32 = read32();
+				c.f_adler32 = read32();
 			if (h->flags & F_CRC32_C)
-				c_crc32 = read32();
+				c.f_crc32 = read32();
 		}
 
 		if (b2 == NULL)
@@ -818,51 +980,18 @@ static NOINLINE smallint lzo_decompress(const header_t *h)
 		b1 = b2 + mcs_block_size - src_len;
 		xread(0, b1, src_len);
 
-		if (src_len < dst_len) {
-			unsigned d = dst_len;
-
-			if (!(option_mask32 & OPT_F)) {
-				/* verify checksum of compressed block */
-				if (h->flags & F_ADLER32_C)
-					lzo_check(ADLER32_INIT_VALUE,
-							b1, src_len,
-							lzo_adler32, c_adler32);
-				if (h->flags & F_CRC32_C)
-					lzo_check(CRC32_INIT_VALUE,
-							b1, src_len,
-							lzo_crc32, c_crc32);
-			}
-
-			/* decompress */
-//			if (option_mask32 & OPT_F)
-//				r = lzo1x_decompress(b1, src_len, b2, &d, NULL);
-//			else
-				r = lzo1x_decompress_safe(b1, src_len, b2, &d, NULL);
-
-			if (r != 0 /*LZO_E_OK*/ || dst_len != d) {
-				bb_error_msg_and_die("corrupted data");
+#if ENABLE_FEATURE_LZOP_PARALLEL
+		if (G.nprocs > 1) {
+			if (start_job() == 0) {
+				lzo_decompress_block(h, b1, src_len, b2, dst_len, &c, &d);
+				_exit(EXIT_SUCCESS);
 			}
-			dst = b2;
-		} else {
-			/* "stored" block => no decompression */
-			dst = b1;
+			continue;
 		}
-
-		if (!(option_mask32 & OPT_F)) {
-			/* verify checksum of uncompressed block */
-			if (h->flags & F_ADLER32_D)
-				lzo_check(ADLER32_INIT_VALUE,
-					dst, dst_len,
-					lzo_adler32, d_adler32);
-			if (h->flags & F_CRC32_D)
-				lzo_check(CRC32_INIT_VALUE,
-					dst, dst_len,
-					lzo_crc32, d_crc32);
-		}
-
-		/* write uncompressed block data */
-		xwrite(1, dst, dst_len);
+#endif
+		lzo_decompress_block(h, b1, src_len, b2, dst_len, &c, &d);
 	}
+	collect_all_jobs();
 
 	free(b2);
 	return ok;
@@ -1109,7 +1238,11 @@ static IF_DESKTOP(long long) int FAST_FUNC pack_lzop(transformer_aux_data_t *aux
 int lzop_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int lzop_main(int argc UNUSED_PARAM, char **argv)
 {
-	getopt32(argv, OPTION_STRING);
+#if ENABLE_FEATURE_LZOP_PARALLEL
+	const char *nprocs = "1";
+#endif
+
+	getopt32(argv, OPTION_STRING IF_FEATURE_LZOP_PARALLEL(, &nprocs));
 	argv += optind;
 	/* lzopcat? */
 	if (applet_name[4] == 'c')
@@ -1118,6 +1251,14 @@ int lzop_main(int argc UNUSED_PARAM, char **argv)
 	if (applet_name[4] == 'o')
 		option_mask32 |= OPT_DECOMPRESS;
 
+#if ENABLE_FEATURE_LZOP_PARALLEL
+	G.nprocs = xatou_range(nprocs, 0, 1024);
+	if (G.nprocs == 0)
+		G.nprocs = get_cpu_count();
+	G.fds = xmalloc(G.nprocs * sizeof(G.fds[0]));
+	G.pids = xmalloc(G.nprocs * sizeof(G.pids[0]));
+#endif
+
 	global_crc32_table = crc32_filltable(NULL, 0);
 	return bbunpack(argv, pack_lzop, make_new_name_lzop, /*unused:*/ NULL);
 }
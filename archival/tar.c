@@ -57,6 +57,18 @@
 //config:	  If you enable this option you'll be able to create
 //config:	  tar archives using the `-c' option.
 //config:
+//config:config FEATURE_TAR_CREATE_READAHEAD
+//config:	bool "Read ahead of files being archived"
+//config:	default y
+//config:	depends on FEATURE_TAR_CREATE && !NOMMU
+//config:	depends on FEATURE_SEAMLESS_GZ || FEATURE_SEAMLESS_BZ2
+//config:	help
+//config:	  When creating a compressed archive (-z, -j), run a helper
+//config:	  process which walks the tree a few files ahead of tar and
+//config:	  starts reading them, so that archiving many small files does
+//config:	  not wait for the disk one file at a time while the compressor
+//config:	  sits idle.
+//config:
 //config:config FEATURE_TAR_AUTODETECT
 //config:	bool "Autodetect compressed tarballs"
 //config:	default y
@@ -116,6 +128,15 @@
 //config:	  the contents of each extracted file to the standard input of an
 //config:	  external program.
 //config:
+//config:config FEATURE_TAR_PARALLEL_EXTRACT
+//config:	bool "Support for extracting with several processes"
+//config:	default y
+//config:	depends on TAR && FEATURE_TAR_LONG_OPTIONS && !NOMMU
+//config:	help
+//config:	  Adds --jobs=N. Regular files are then written by N worker
+//config:	  processes while tar reads on, which helps with tarballs
+//config:	  of many small files on slow storage.
+//config:
 //config:config FEATURE_TAR_UNAME_GNAME
 //config:	bool "Enable use of user and group names"
 //config:	default y
@@ -190,6 +211,9 @@ typedef struct TarBallInfo {
 	unsigned optFlags;              /* all command line flags */
 
 	const llist_t *excludeList;     /* List of files to not include */
+#if ENABLE_FEATURE_TAR_CREATE_READAHEAD
+	int readaheadFd;                /* We write a byte here per file done */
+#endif
 	HardLinkInfo *hlInfoHead;       /* Hard Link Tracking Information */
 	HardLinkInfo *hlInfo;           /* Hard Link Info for the current file */
 //TODO: save only st_dev + st_ino
@@ -611,6 +635,13 @@ static int FAST_FUNC writeFileToTarball(const char *fileName, struct stat *statb
 	if (exclude_file(tbInfo->excludeList, header_name))
 		return SKIP;
 
+#if ENABLE_FEATURE_TAR_CREATE_READAHEAD
+	/* Let read-ahead go one file further. Nonblocking: if it
+	 * lags so far behind that the pipe is full, it doesn't matter */
+	if (tbInfo->readaheadFd >= 0 && S_ISREG(statbuf->st_mode))
+		safe_write(tbInfo->readaheadFd, "", 1);
+#endif
+
 #if !ENABLE_FEATURE_TAR_GNU_EXTENSIONS
 	if (strlen(header_name) >= NAME_SIZE) {
 		bb_error_msg("names longer than "NAME_SIZE_STR" chars not supported");
@@ -671,6 +702,9 @@ static int FAST_FUNC writeFileToTarball(const char *fileName, struct stat *statb
 static void NOINLINE vfork_compressor(int tar_fd, int gzip)
 {
 	pid_t gzipPid;
+# if BB_MMU && !defined(BUILD_INDIVIDUAL)
+	int applet_no;
+# endif
 # if ENABLE_FEATURE_SEAMLESS_GZ && ENABLE_FEATURE_SEAMLESS_BZ2
 	const char *zip_exec = (gzip == 1) ? "gzip" : "bzip2";
 # elif ENABLE_FEATURE_SEAMLESS_GZ
@@ -691,6 +725,29 @@ static void NOINLINE vfork_compressor(int tar_fd, int gzip)
 
 	signal(SIGPIPE, SIG_IGN); /* we only want EPIPE on errors */
 
+# if BB_MMU && !defined(BUILD_INDIVIDUAL)
+	/* If gzip/bzip2 is one of our applets, there is no need
+	 * to exec anything: run its main() in a forked child */
+	applet_no = find_applet_by_name(zip_exec);
+	if (applet_no >= 0) {
+		fflush_all();
+		if (xfork() == 0) {
+			char *argv[3];
+
+			close(gzipDataPipe.wr);
+			xmove_fd(gzipDataPipe.rd, 0);
+			xmove_fd(tar_fd, 1);
+			argv[0] = (char*)zip_exec;
+			argv[1] = (char*)"-f";
+			argv[2] = NULL;
+			run_applet_no_and_exit(applet_no, argv);
+		}
+		xmove_fd(gzipDataPipe.wr, tar_fd);
+		close(gzipDataPipe.rd);
+		return;
+	}
+# endif
+
 # if defined(__GNUC__) && __GNUC__
 	/* Avoid vfork clobbering */
 	(void) &zip_exec;
@@ -739,6 +796,90 @@ static void NOINLINE vfork_compressor(int tar_fd, int gzip)
 }
 #endif /* ENABLE_FEATURE_SEAMLESS_GZ || ENABLE_FEATURE_SEAMLESS_BZ2 */
 
+#if ENABLE_FEATURE_TAR_CREATE_READAHEAD
+/* Archiving many small files is bound by the latency of each open()
+ * and read(), which we wait for one after another. A helper process
+ * walks the same tree a bit ahead of us and asks the kernel to start
+ * reading each file (POSIX_FADV_WILLNEED does not wait for the data),
+ * so that when we get there, it is already in page cache.
+ * We send it a byte per file we reach, so it is never more than
+ * READAHEAD_FILES files ahead.
+ */
+enum {
+	READAHEAD_FILES = 64,
+	READAHEAD_BYTES = 256 * 1024, /* per file, enough for small files */
+};
+
+struct readahead_info {
+	const llist_t *excludeList;
+	int credit_fd;
+	unsigned credits;
+};
+
+static int FAST_FUNC readaheadFile(const char *fileName, struct stat *statbuf,
+			void *userData, int depth UNUSED_PARAM)
+{
+	struct readahead_info *ra = userData;
+	const char *name = fileName;
+	int fd;
+
+	/* Roughly what strip_unsafe_prefix() does, but silently */
+	while (*name == '/')
+		name++;
+	if (exclude_file(ra->excludeList, name))
+		return SKIP;
+	if (!S_ISREG(statbuf->st_mode))
+		return TRUE;
+
+	if (ra->credits == 0) {
+		char buf[READAHEAD_FILES];
+		int n = safe_read(ra->credit_fd, buf, sizeof(buf));
+		if (n <= 0)
+			_exit(EXIT_SUCCESS); /* tar is done */
+		ra->credits = n;
+	}
+	ra->credits--;
+
+	fd = open(fileName, O_RDONLY | O_NONBLOCK);
+	if (fd >= 0) {
+		posix_fadvise(fd, 0, READAHEAD_BYTES, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+	return TRUE;
+}
+
+static pid_t start_readahead(struct TarBallInfo *tbInfo,
+		int recurseFlags, const llist_t *include)
+{
+	struct fd_pair credit_pipe;
+	pid_t pid;
+
+	xpiped_pair(credit_pipe);
+	pid = xfork();
+	if (pid == 0) {
+		struct readahead_info ra;
+
+		close(credit_pipe.wr);
+		close(tbInfo->tarFd); /* else compressor won't see EOF */
+		ra.excludeList = tbInfo->excludeList;
+		ra.credit_fd = credit_pipe.rd;
+		ra.credits = READAHEAD_FILES;
+		while (include) {
+			recursive_action(include->data, recurseFlags | ACTION_QUIET,
+					readaheadFile, readaheadFile, &ra, 0);
+			include = include->link;
+		}
+		_exit(EXIT_SUCCESS);
+	}
+	close(credit_pipe.rd);
+	ndelay_on(credit_pipe.wr);
+	/* It exits when it's done, we don't care */
+	signal(SIGPIPE, SIG_IGN);
+	tbInfo->readaheadFd = credit_pipe.wr;
+	return pid;
+}
+#endif
+
 
 /* gcc 4.2.1 inlines it, making code bigger */
 static NOINLINE int writeTarFile(int tar_fd, int verboseFlag,
@@ -748,6 +889,9 @@ static NOINLINE int writeTarFile(int tar_fd, int verboseFlag,
 {
 	int errorFlag = FALSE;
 	struct TarBallInfo tbInfo;
+#if ENABLE_FEATURE_TAR_CREATE_READAHEAD
+	pid_t readaheadPid = 0;
+#endif
 
 	tbInfo.hlInfoHead = NULL;
 	tbInfo.tarFd = tar_fd;
@@ -764,6 +908,12 @@ static NOINLINE int writeTarFile(int tar_fd, int verboseFlag,
 #endif
 
 	tbInfo.excludeList = exclude;
+#if ENABLE_FEATURE_TAR_CREATE_READAHEAD
+	/* Only worth a process if the compressor would wait for the disk */
+	tbInfo.readaheadFd = -1;
+	if (gzip)
+		readaheadPid = start_readahead(&tbInfo, recurseFlags, include);
+#endif
 
 	/* Read the directory/files and iterate over them one at a time */
 	while (include) {
@@ -774,6 +924,14 @@ static NOINLINE int writeTarFile(int tar_fd, int verboseFlag,
 		}
 		include = include->link;
 	}
+#if ENABLE_FEATURE_TAR_CREATE_READAHEAD
+	/* Reap it now, so that waitpid(-1) below gets the compressor */
+	if (readaheadPid) {
+		close(tbInfo.readaheadFd);
+		kill(readaheadPid, SIGKILL);
+		wait4pid(readaheadPid);
+	}
+#endif
 	/* Write two empty blocks to the end of the archive */
 	memset(block_buf, 0, 2*TAR_BLOCK_SIZE);
 	xwrite(tbInfo.tarFd, block_buf, 2*TAR_BLOCK_SIZE);
@@ -892,6 +1050,9 @@ static llist_t *append_file_list_to_list(llist_t *list)
 //usage:	IF_FEATURE_TAR_SELINUX(
 //usage:     "\n	p	Store SELinux contexts"
 //usage:	)
+//usage:	IF_FEATURE_TAR_PARALLEL_EXTRACT(
+//usage:     "\n	jobs N	Extract files using N processes (0: one per CPU)"
+//usage:	)
 //usage:
 //usage:#define tar_example_usage
 //usage:       "$ zcat /tmp/tarball.tar.gz | tar -xf -\n"
@@ -927,6 +1088,7 @@ enum {
 	OPTBIT_NUMERIC_OWNER,
 	OPTBIT_NOPRESERVE_PERM,
 	OPTBIT_OVERWRITE,
+	IF_FEATURE_TAR_PARALLEL_EXTRACT(OPTBIT_JOBS,)
 #endif
 	OPT_TEST         = 1 << 0, // t
 	OPT_EXTRACT      = 1 << 1, // x
@@ -952,6 +1114,7 @@ enum {
 	OPT_NUMERIC_OWNER   = IF_FEATURE_TAR_LONG_OPTIONS((1 << OPTBIT_NUMERIC_OWNER  )) + 0, // numeric-owner
 	OPT_NOPRESERVE_PERM = IF_FEATURE_TAR_LONG_OPTIONS((1 << OPTBIT_NOPRESERVE_PERM)) + 0, // no-same-permissions
 	OPT_OVERWRITE       = IF_FEATURE_TAR_LONG_OPTIONS((1 << OPTBIT_OVERWRITE      )) + 0, // overwrite
+	OPT_JOBS            = IF_FEATURE_TAR_PARALLEL_EXTRACT((1 << OPTBIT_JOBS       )) + 0, // jobs
 
 	OPT_ANY_COMPRESS = (OPT_BZIP2 | OPT_LZMA | OPT_GZIP | OPT_XZ | OPT_COMPRESS),
 };
@@ -1005,6 +1168,10 @@ static const char tar_longopts[] ALIGN1 =
 	"no-same-permissions\0" No_argument       "\xfd"
 	/* on unpack, open with O_TRUNC and !O_EXCL */
 	"overwrite\0"           No_argument       "\xfe"
+# if ENABLE_FEATURE_TAR_PARALLEL_EXTRACT
+	/* write files using N processes */
+	"jobs\0"                Required_argument "\xf9"
+# endif
 	/* --exclude takes next bit position in option mask, */
 	/* therefore we have to put it _after_ --no-same-permissions */
 # if ENABLE_FEATURE_TAR_FROM
@@ -1024,6 +1191,10 @@ int tar_main(int argc UNUSED_PARAM, char **argv)
 #if ENABLE_FEATURE_TAR_LONG_OPTIONS && ENABLE_FEATURE_TAR_FROM
 	llist_t *excludes = NULL;
 #endif
+#if ENABLE_FEATURE_TAR_PARALLEL_EXTRACT
+	const char *jobs_str = "1";
+	unsigned jobs;
+#endif
 
 	/* Initialise default values */
 	tar_handle = init_handle();
@@ -1090,6 +1261,7 @@ int tar_main(int argc UNUSED_PARAM, char **argv)
 		IF_FEATURE_TAR_FROM(, &(tar_handle->accept)) // T
 		IF_FEATURE_TAR_FROM(, &(tar_handle->reject)) // X
 		IF_FEATURE_TAR_TO_COMMAND(, &(tar_handle->tar__to_command)) // --to-command
+		IF_FEATURE_TAR_PARALLEL_EXTRACT(, &jobs_str) // --jobs
 #if ENABLE_FEATURE_TAR_LONG_OPTIONS && ENABLE_FEATURE_TAR_FROM
 		, &excludes // --exclude
 #endif
@@ -1257,9 +1429,25 @@ int tar_main(int argc UNUSED_PARAM, char **argv)
 	 */
 	bb_got_signal = EXIT_FAILURE;
 
+#if ENABLE_FEATURE_TAR_PARALLEL_EXTRACT
+	jobs = xatou_range(jobs_str, 0, 1024);
+	if (jobs == 0)
+		jobs = get_cpu_count();
+	if (jobs > 1 && tar_handle->action_data == data_extract_all)
+		start_extract_workers(tar_handle, jobs);
+#endif
+
 	while (get_header_tar(tar_handle) == EXIT_SUCCESS)
 		bb_got_signal = EXIT_SUCCESS; /* saw at least one header, good */
 
+#if ENABLE_FEATURE_TAR_PARALLEL_EXTRACT
+	if (tar_handle->tar__pool
+	 && finish_extract_workers(tar_handle) != EXIT_SUCCESS
+	) {
+		bb_got_signal = EXIT_FAILURE;
+	}
+#endif
+
 	/* Check that every file that should have been extracted was */
 	while (tar_handle->accept) {
 		if (!find_list_entry(tar_handle->reject, tar_handle->accept->data)
@@ -26,12 +26,21 @@
 //config:	  (with no options) is to extract the archive into the
 //config:	  current directory. Use the `-d' option to extract to a
 //config:	  directory of your choice.
+//config:
+//config:config FEATURE_UNZIP_PARALLEL
+//config:	bool "Support for extracting with several processes"
+//config:	default y
+//config:	depends on UNZIP && !NOMMU
+//config:	help
+//config:	  Adds -w N. Entries are then taken from the central directory
+//config:	  and inflated by N worker processes, each reading the archive
+//config:	  through its own file descriptor.
 
 //applet:IF_UNZIP(APPLET(unzip, BB_DIR_USR_BIN, BB_SUID_DROP))
 //kbuild:lib-$(CONFIG_UNZIP) += unzip.o
 
 //usage:#define unzip_trivial_usage
-//usage:       "[-lnopq] FILE[.zip] [FILE]... [-x FILE...] [-d DIR]"
+//usage:       "[-lnopq" IF_FEATURE_UNZIP_PARALLEL("] [-w N") "] FILE[.zip] [FILE]... [-x FILE...] [-d DIR]"
 //usage:#define unzip_full_usage "\n\n"
 //usage:       "Extract FILEs from ZIP archive\n"
 //usage:     "\n	-l	List contents (with -q for short form)"
@@ -39,6 +48,9 @@
 //usage:     "\n	-o	Overwrite"
 //usage:     "\n	-p	Print to stdout"
 //usage:     "\n	-q	Quiet"
+//usage:	IF_FEATURE_UNZIP_PARALLEL(
+//usage:     "\n	-w N	Extract using N processes (0: one per CPU)"
+//usage:	)
 //usage:     "\n	-x FILE	Exclude FILEs"
 //usage:     "\n	-d DIR	Extract into DIR"
 
@@ -51,6 +63,9 @@
 #define ENABLE_DESKTOP 1
 #endif
 
+/* Whole central directory is read for -l/-v (DESKTOP only) and -w */
+#define READ_WHOLE_CDF (ENABLE_DESKTOP || ENABLE_FEATURE_UNZIP_PARALLEL)
+
 enum {
 #if BB_BIG_ENDIAN
 	ZIP_FILEHEADER_MAGIC = 0x504b0304,
@@ -143,10 +158,8 @@ struct BUG_cdf_header_must_be_42_bytes {
 	(cdf_header).formatted.file_name_length = SWAP_LE16((cdf_header).formatted.file_name_length); \
 	(cdf_header).formatted.extra_field_length = SWAP_LE16((cdf_header).formatted.extra_field_length); \
 	(cdf_header).formatted.file_comment_length = SWAP_LE16((cdf_header).formatted.file_comment_length); \
-	IF_DESKTOP( \
 	(cdf_header).formatted.version_made_by = SWAP_LE16((cdf_header).formatted.version_made_by); \
 	(cdf_header).formatted.external_file_attributes = SWAP_LE32((cdf_header).formatted.external_file_attributes); \
-	) \
 } while (0)
 
 #define CDE_HEADER_LEN 16
@@ -178,7 +191,7 @@ struct BUG_cde_header_must_be_16_bytes {
 enum { zip_fd = 3 };
 
 
-#if ENABLE_DESKTOP
+#if READ_WHOLE_CDF
 
 /* Seen in the wild:
  * Self-extracting PRO2K3XP_32.exe contains 19078464 byte zip archive,
@@ -236,6 +249,7 @@ static uint32_t find_cdf_offset(void)
 	return cde_header.formatted.cdf_offset;
 };
 
+# if ENABLE_DESKTOP
 static uint32_t read_next_cdf(uint32_t cdf_offset, cdf_header_t *cdf_ptr)
 {
 	off_t org;
@@ -258,6 +272,51 @@ static uint32_t read_next_cdf(uint32_t cdf_offset, cdf_header_t *cdf_ptr)
 	xlseek(zip_fd, org, SEEK_SET);
 	return cdf_offset;
 };
+# endif
+
+/* Reads the whole central directory (and whatever follows it) */
+static uint8_t *read_cdf(uint32_t cdf_offset, unsigned *len)
+{
+	uint8_t *buf;
+	off_t end;
+
+	end = xlseek(zip_fd, 0, SEEK_END);
+	*len = end - cdf_offset;
+	buf = xmalloc(*len);
+	xlseek(zip_fd, cdf_offset, SEEK_SET);
+	xread(zip_fd, buf, *len);
+	xlseek(zip_fd, 0, SEEK_SET);
+	return buf;
+}
+
+/* Parses central directory entry at buf[pos]. Its fields, from version
+ * needed to extra field length, are laid out as in local file header,
+ * so zip_header is filled too. Returns entry's size, or 0 if there is
+ * no (complete) entry at pos - normally, this means we reached CDE.
+ */
+static unsigned parse_cdf_entry(const uint8_t *buf, unsigned len, unsigned pos,
+		cdf_header_t *cdf_header, zip_header_t *zip_header)
+{
+	uint32_t magic;
+	unsigned size;
+
+	if (len - pos < 4 + CDF_HEADER_LEN)
+		return 0;
+	move_from_unaligned32(magic, buf + pos);
+	if (magic != ZIP_CDF_MAGIC)
+		return 0;
+	memcpy(cdf_header->raw, buf + pos + 4, CDF_HEADER_LEN);
+	memcpy(zip_header->raw, buf + pos + 4 + 2, ZIP_HEADER_LEN);
+	FIX_ENDIANNESS_CDF(*cdf_header);
+	FIX_ENDIANNESS_ZIP(*zip_header);
+	size = 4 + CDF_HEADER_LEN
+		+ cdf_header->formatted.file_name_length
+		+ cdf_header->formatted.extra_field_length
+		+ cdf_header->formatted.file_comment_length;
+	if (len - pos < size)
+		return 0;
+	return size;
+}
 #endif
 
 static void unzip_skip(off_t skip)
@@ -304,6 +363,106 @@ static void unzip_extract(zip_header_t *zip_header, int dst_fd)
 	}
 }
 
+#if ENABLE_FEATURE_UNZIP_PARALLEL
+/* Extracts an entry we know from the central directory */
+static void unzip_extract_at(zip_header_t *zip_header, uint32_t local_offset,
+		const char *dst_fn, mode_t file_mode)
+{
+	zip_header_t local_header;
+	uint32_t magic;
+	int dst_fd;
+
+	xlseek(zip_fd, SWAP_LE32(local_offset), SEEK_SET);
+	xread(zip_fd, &magic, 4);
+	if (magic != ZIP_FILEHEADER_MAGIC)
+		bb_error_msg_and_die("invalid zip magic %08X", (int)magic);
+	/* Name and extra field here can differ from CDF's */
+	xread(zip_fd, local_header.raw, ZIP_HEADER_LEN);
+	FIX_ENDIANNESS_ZIP(local_header);
+	unzip_skip(local_header.formatted.filename_len + local_header.formatted.extra_len);
+
+	dst_fd = xopen3(dst_fn, O_WRONLY | O_CREAT | O_TRUNC, file_mode);
+	unzip_extract(zip_header, dst_fd);
+	close(dst_fd);
+}
+
+static mode_t cdf_file_mode(cdf_header_t *cdf_header)
+{
+	/* Without DESKTOP, serial unzip doesn't use modes from CDF either */
+	if (ENABLE_DESKTOP && (cdf_header->formatted.version_made_by >> 8) == 3) {
+		/* This archive is created on Unix */
+		return cdf_header->formatted.external_file_attributes >> 16;
+	}
+	return 0666;
+}
+
+/* Workers read positions of CDF entries to extract from a pipe
+ * shared by all of them. Writes of 4 bytes are atomic, so every read
+ * gets a whole position, and an idle worker takes the next entry.
+ */
+static void NORETURN unzip_worker(int job_fd, const uint8_t *cdf_buf, unsigned cdf_len)
+{
+	uint32_t pos;
+
+	while (safe_read(job_fd, &pos, sizeof(pos)) == sizeof(pos)) {
+		cdf_header_t cdf_header;
+		zip_header_t zip_header;
+		char *dst_fn;
+
+		parse_cdf_entry(cdf_buf, cdf_len, pos, &cdf_header, &zip_header);
+		dst_fn = xstrndup((char*)cdf_buf + pos + 4 + CDF_HEADER_LEN,
+				cdf_header.formatted.file_name_length);
+		unzip_extract_at(&zip_header,
+				cdf_header.formatted.relative_offset_of_local_header,
+				dst_fn, cdf_file_mode(&cdf_header));
+		free(dst_fn);
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+/* zip_fds[i] is worker i's own open of the archive: file positions
+ * of dup'ed fds would be shared */
+static int start_unzip_workers(int *zip_fds,
+		const uint8_t *cdf_buf, unsigned cdf_len,
+		pid_t *pids, unsigned nprocs)
+{
+	struct fd_pair job_pipe;
+	unsigned i;
+
+	xpiped_pair(job_pipe);
+	for (i = 0; i < nprocs; i++) {
+		pids[i] = xfork();
+		if (pids[i] == 0) {
+			unsigned j;
+
+			close(job_pipe.wr);
+			for (j = i + 1; j < nprocs; j++)
+				close(zip_fds[j]);
+			xmove_fd(zip_fds[i], zip_fd);
+			unzip_worker(job_pipe.rd, cdf_buf, cdf_len);
+		}
+		close(zip_fds[i]);
+	}
+	close(job_pipe.rd);
+	/* A worker which failed has said why, we just need to exit */
+	signal(SIGPIPE, SIG_IGN);
+	return job_pipe.wr;
+}
+
+static int finish_unzip_workers(int job_fd, pid_t *pids, unsigned nprocs)
+{
+	int exitcode = EXIT_SUCCESS;
+	unsigned i;
+
+	close(job_fd);
+	for (i = 0; i < nprocs; i++) {
+		if (wait4pid(pids[i]) != 0)
+			exitcode = EXIT_FAILURE;
+	}
+	return exitcode;
+}
+#endif
+
 static void my_fgets80(char *buf80)
 {
 	fflush_all();
@@ -325,6 +484,21 @@ int unzip_main(int argc, char **argv)
 	smallint x_opt_seen;
 #if ENABLE_DESKTOP
 	uint32_t cdf_offset;
+#endif
+#if READ_WHOLE_CDF
+	uint8_t *cdf_buf = NULL;
+	unsigned cdf_len = 0;
+	unsigned cdf_pos = 0;
+	uint32_t cdf_entry = cdf_entry; /* for compiler */
+	cdf_header_t cdf_header;
+#endif
+#if ENABLE_FEATURE_UNZIP_PARALLEL
+	const char *nprocs_str = "1";
+	unsigned nprocs;
+	int job_fd = -1;
+	int *zip_fds = NULL;
+	pid_t *pids = NULL;
+	smallint renamed;
 #endif
 	unsigned long total_usize;
 	unsigned long total_size;
@@ -382,7 +556,7 @@ int unzip_main(int argc, char **argv)
 
 	x_opt_seen = 0;
 	/* '-' makes getopt return 1 for non-options */
-	while ((opt = getopt(argc, argv, "-d:lnopqxv")) != -1) {
+	while ((opt = getopt(argc, argv, "-d:lnopqxv" IF_FEATURE_UNZIP_PARALLEL("w:"))) != -1) {
 		switch (opt) {
 		case 'd':  /* Extract to base directory */
 			base_dir = optarg;
@@ -416,6 +590,12 @@ int unzip_main(int argc, char **argv)
 			x_opt_seen = 1;
 			break;
 
+#if ENABLE_FEATURE_UNZIP_PARALLEL
+		case 'w': /* Extract using N processes */
+			nprocs_str = optarg;
+			break;
+#endif
+
 		case 1:
 			if (!src_fn) {
 				/* The zip file */
@@ -483,10 +663,49 @@ int unzip_main(int argc, char **argv)
 		xmove_fd(src_fd, zip_fd);
 	}
 
+#if ENABLE_FEATURE_UNZIP_PARALLEL
+	nprocs = xatou_range(nprocs_str, 0, 1024);
+	if (nprocs == 0)
+		nprocs = get_cpu_count();
+#endif
+#if READ_WHOLE_CDF
+	/* Listing, and parallel extraction, are driven by central directory:
+	 * listing never reads local headers, and workers can extract
+	 * any entry without waiting for the ones before it */
+	if (!LONE_DASH(src_fn)
+	 && dst_fd != STDOUT_FILENO
+	 && ((ENABLE_DESKTOP && listing) IF_FEATURE_UNZIP_PARALLEL(|| (!listing && nprocs > 1)))
+	) {
+		uint32_t offset = find_cdf_offset();
+		if (offset != BAD_CDF_OFFSET)
+			cdf_buf = read_cdf(offset, &cdf_len);
+		else
+			xlseek(zip_fd, 0, SEEK_SET);
+	}
+#endif
+#if ENABLE_FEATURE_UNZIP_PARALLEL
+	if (cdf_buf && !listing && nprocs > 1) {
+		/* Open the archive for workers before chdir:
+		 * src_fn may be relative */
+		zip_fds = xmalloc(nprocs * sizeof(zip_fds[0]));
+		for (i = 0; i < (int)nprocs; i++)
+			zip_fds[i] = xopen(src_fn, O_RDONLY);
+	}
+#endif
+
 	/* Change dir if necessary */
 	if (base_dir)
 		xchdir(base_dir);
 
+#if ENABLE_FEATURE_UNZIP_PARALLEL
+	/* Fork workers only after chdir worked: they inherit the cwd */
+	if (zip_fds) {
+		pids = xmalloc(nprocs * sizeof(pids[0]));
+		job_fd = start_unzip_workers(zip_fds, cdf_buf, cdf_len, pids, nprocs);
+		free(zip_fds);
+	}
+#endif
+
 	if (quiet <= 1) { /* not -qq */
 		if (quiet == 0)
 			printf("Archive:  %s\n", src_fn);
@@ -529,9 +748,39 @@ int unzip_main(int argc, char **argv)
 	while (1) {
 		uint32_t magic;
 		mode_t dir_mode = 0777;
-#if ENABLE_DESKTOP
+#if READ_WHOLE_CDF
 		mode_t file_mode = 0666;
 #endif
+#if ENABLE_FEATURE_UNZIP_PARALLEL
+		renamed = 0;
+#endif
+
+#if READ_WHOLE_CDF
+		if (cdf_buf) {
+			unsigned size = parse_cdf_entry(cdf_buf, cdf_len, cdf_pos, &cdf_header, &zip_header);
+			if (size == 0)
+				break;
+			if ((zip_header.formatted.method != 0) && (zip_header.formatted.method != 8)) {
+				bb_error_msg_and_die("unsupported method %d", zip_header.formatted.method);
+			}
+			if (zip_header.formatted.zip_flags & SWAP_LE16(0x0001)) {
+				/* 0x0001 - encrypted */
+				bb_error_msg_and_die("zip flag 1 (encryption) is not supported");
+			}
+#if ENABLE_DESKTOP
+			if ((cdf_header.formatted.version_made_by >> 8) == 3) {
+				/* This archive is created on Unix */
+				dir_mode = file_mode = (cdf_header.formatted.external_file_attributes >> 16);
+			}
+#endif
+			free(dst_fn);
+			dst_fn = xstrndup((char*)cdf_buf + cdf_pos + 4 + CDF_HEADER_LEN,
+					cdf_header.formatted.file_name_length);
+			cdf_entry = cdf_pos;
+			cdf_pos += size;
+			goto got_header;
+		}
+#endif
 
 		/* Check magic number */
 		xread(zip_fd, &magic, 4);
@@ -566,7 +815,6 @@ int unzip_main(int argc, char **argv)
 		}
 
 		if (cdf_offset != BAD_CDF_OFFSET) {
-			cdf_header_t cdf_header;
 			cdf_offset = read_next_cdf(cdf_offset, &cdf_header);
 			/*
 			 * Note: cdf_offset can become BAD_CDF_OFFSET after the above call.
@@ -599,6 +847,9 @@ int unzip_main(int argc, char **argv)
 
 		/* Skip extra header bytes */
 		unzip_skip(zip_header.formatted.extra_len);
+#if READ_WHOLE_CDF
+ got_header:
+#endif
 
 		/* Filter zip entries */
 		if (find_list_entry(zreject, dst_fn)
@@ -694,6 +945,20 @@ int unzip_main(int argc, char **argv)
 			overwrite = O_ALWAYS;
 		case 'y': /* Open file and fall into unzip */
 			unzip_create_leading_dirs(dst_fn);
+#if ENABLE_FEATURE_UNZIP_PARALLEL
+			if (cdf_buf) {
+				if (!quiet) {
+					printf("  inflating: %s\n", dst_fn);
+				}
+				if (renamed) /* workers only know names from CDF */
+					unzip_extract_at(&zip_header,
+						cdf_header.formatted.relative_offset_of_local_header,
+						dst_fn, file_mode);
+				else
+					xwrite(job_fd, &cdf_entry, sizeof(cdf_entry));
+				break;
+			}
+#endif
 #if ENABLE_DESKTOP
 			dst_fd = xopen3(dst_fn, O_WRONLY | O_CREAT | O_TRUNC, file_mode);
 #else
@@ -714,6 +979,10 @@ int unzip_main(int argc, char **argv)
 			overwrite = O_NEVER;
 		case 'n':
 			/* Skip entry data */
+#if READ_WHOLE_CDF
+			if (cdf_buf) /* we aren't reading them */
+				break;
+#endif
 			unzip_skip(zip_header.formatted.cmpsize);
 			break;
 
@@ -724,6 +993,7 @@ int unzip_main(int argc, char **argv)
 			free(dst_fn);
 			dst_fn = xstrdup(key_buf);
 			chomp(dst_fn);
+			IF_FEATURE_UNZIP_PARALLEL(renamed = 1;)
 			goto check_file;
 
 		default:
@@ -755,5 +1025,9 @@ int unzip_main(int argc, char **argv)
 		}
 	}
 
+#if ENABLE_FEATURE_UNZIP_PARALLEL
+	if (job_fd >= 0)
+		return finish_unzip_workers(job_fd, pids, nprocs);
+#endif
 	return 0;
 }
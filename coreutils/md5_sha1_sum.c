@@ -7,7 +7,7 @@
  */
 
 //usage:#define md5sum_trivial_usage
-//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")"[FILE]..."
+//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")IF_FEATURE_MD5_SHA1_SUM_PARALLEL("[-j N] ")"[FILE]..."
 //usage:#define md5sum_full_usage "\n\n"
 //usage:       "Print" IF_FEATURE_MD5_SHA1_SUM_CHECK(" or check") " MD5 checksums"
 //usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK( "\n"
@@ -15,6 +15,9 @@
 //usage:     "\n	-s	Don't output anything, status code shows success"
 //usage:     "\n	-w	Warn about improperly formatted checksum lines"
 //usage:	)
+//usage:	IF_FEATURE_MD5_SHA1_SUM_PARALLEL( IF_NOT_FEATURE_MD5_SHA1_SUM_CHECK("\n")
+//usage:     "\n	-j N	Hash N files at once (0: one per CPU)"
+//usage:	)
 //usage:
 //usage:#define md5sum_example_usage
 //usage:       "$ md5sum < busybox\n"
@@ -27,7 +30,7 @@
 //usage:       "^D\n"
 //usage:
 //usage:#define sha1sum_trivial_usage
-//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")"[FILE]..."
+//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")IF_FEATURE_MD5_SHA1_SUM_PARALLEL("[-j N] ")"[FILE]..."
 //usage:#define sha1sum_full_usage "\n\n"
 //usage:       "Print" IF_FEATURE_MD5_SHA1_SUM_CHECK(" or check") " SHA1 checksums"
 //usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK( "\n"
@@ -35,9 +38,12 @@
 //usage:     "\n	-s	Don't output anything, status code shows success"
 //usage:     "\n	-w	Warn about improperly formatted checksum lines"
 //usage:	)
+//usage:	IF_FEATURE_MD5_SHA1_SUM_PARALLEL( IF_NOT_FEATURE_MD5_SHA1_SUM_CHECK("\n")
+//usage:     "\n	-j N	Hash N files at once (0: one per CPU)"
+//usage:	)
 //usage:
 //usage:#define sha256sum_trivial_usage
-//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")"[FILE]..."
+//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")IF_FEATURE_MD5_SHA1_SUM_PARALLEL("[-j N] ")"[FILE]..."
 //usage:#define sha256sum_full_usage "\n\n"
 //usage:       "Print" IF_FEATURE_MD5_SHA1_SUM_CHECK(" or check") " SHA256 checksums"
 //usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK( "\n"
@@ -45,9 +51,12 @@
 //usage:     "\n	-s	Don't output anything, status code shows success"
 //usage:     "\n	-w	Warn about improperly formatted checksum lines"
 //usage:	)
+//usage:	IF_FEATURE_MD5_SHA1_SUM_PARALLEL( IF_NOT_FEATURE_MD5_SHA1_SUM_CHECK("\n")
+//usage:     "\n	-j N	Hash N files at once (0: one per CPU)"
+//usage:	)
 //usage:
 //usage:#define sha512sum_trivial_usage
-//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")"[FILE]..."
+//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")IF_FEATURE_MD5_SHA1_SUM_PARALLEL("[-j N] ")"[FILE]..."
 //usage:#define sha512sum_full_usage "\n\n"
 //usage:       "Print" IF_FEATURE_MD5_SHA1_SUM_CHECK(" or check") " SHA512 checksums"
 //usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK( "\n"
@@ -55,9 +64,12 @@
 //usage:     "\n	-s	Don't output anything, status code shows success"
 //usage:     "\n	-w	Warn about improperly formatted checksum lines"
 //usage:	)
+//usage:	IF_FEATURE_MD5_SHA1_SUM_PARALLEL( IF_NOT_FEATURE_MD5_SHA1_SUM_CHECK("\n")
+//usage:     "\n	-j N	Hash N files at once (0: one per CPU)"
+//usage:	)
 //usage:
 //usage:#define sha3sum_trivial_usage
-//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")"[FILE]..."
+//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")IF_FEATURE_MD5_SHA1_SUM_PARALLEL("[-j N] ")"[FILE]..."
 //usage:#define sha3sum_full_usage "\n\n"
 //usage:       "Print" IF_FEATURE_MD5_SHA1_SUM_CHECK(" or check") " SHA3-512 checksums"
 //usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK( "\n"
@@ -65,6 +77,9 @@
 //usage:     "\n	-s	Don't output anything, status code shows success"
 //usage:     "\n	-w	Warn about improperly formatted checksum lines"
 //usage:	)
+//usage:	IF_FEATURE_MD5_SHA1_SUM_PARALLEL( IF_NOT_FEATURE_MD5_SHA1_SUM_CHECK("\n")
+//usage:     "\n	-j N	Hash N files at once (0: one per CPU)"
+//usage:	)
 
 #include "libbb.h"
 
@@ -82,6 +97,10 @@ enum {
 #define FLAG_SILENT  1
 #define FLAG_CHECK   2
 #define FLAG_WARN    4
+#define FLAG_JOBS    (ENABLE_FEATURE_MD5_SHA1_SUM_CHECK ? 0x20 : 1)
+
+/* Larger reads mean fewer syscalls on big files */
+#define HASH_BUFSIZE (64 * 1024)
 
 /* This might be useful elsewhere */
 static unsigned char *hash_bin_to_hex(unsigned char *hash_value,
@@ -112,6 +131,10 @@ static uint8_t *hash_file(const char *filename)
 	if (src_fd < 0) {
 		return NULL;
 	}
+#if defined(POSIX_FADV_SEQUENTIAL)
+	/* Ask for more aggressive readahead. Fails harmlessly on pipes */
+	posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
 	hash_algo = applet_name[3];
 
@@ -146,8 +169,8 @@ static uint8_t *hash_file(const char *filename)
 	}
 
 	{
-		RESERVE_CONFIG_UBUFFER(in_buf, 4096);
-		while ((count = safe_read(src_fd, in_buf, 4096)) > 0) {
+		RESERVE_CONFIG_UBUFFER(in_buf, HASH_BUFSIZE);
+		while ((count = safe_read(src_fd, in_buf, HASH_BUFSIZE)) > 0) {
 			update(&context, in_buf, count);
 		}
 		hash_value = NULL;
@@ -167,15 +190,165 @@ static uint8_t *hash_file(const char *filename)
 	return hash_value;
 }
 
+#if ENABLE_FEATURE_MD5_SHA1_SUM_PARALLEL
+/* Hashing is done by nproc children. Child K hashes files
+ * K, K+nproc, K+2*nproc... and sends back one fixed-size record
+ * per file, so the parent gets results in the original order
+ * by reading the pipes round-robin.
+ */
+enum { RESULT_SIZE = 1 + 64*2 + 1 }; /* '+' or '-', hex hash, NUL */
+
+typedef struct hash_workers {
+	unsigned nproc;
+	unsigned next;
+	int *fd;
+	pid_t *pid;
+} hash_workers_t;
+
+static void hash_worker(int out_fd, char **names, unsigned i, unsigned count, unsigned step)
+{
+	for (; i < count; i += step) {
+		char rec[RESULT_SIZE];
+		uint8_t *hash_value = NULL;
+
+		memset(rec, 0, RESULT_SIZE);
+		/* NULL names are improperly formatted -c lines */
+		if (names[i])
+			hash_value = hash_file(names[i]);
+		rec[0] = '-';
+		if (hash_value) {
+			rec[0] = '+';
+			strcpy(rec + 1, (char*)hash_value);
+			free(hash_value);
+		}
+		xwrite(out_fd, rec, RESULT_SIZE);
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+static void start_workers(hash_workers_t *hw, char **names, unsigned count)
+{
+	unsigned k;
+
+	if (hw->nproc > count)
+		hw->nproc = count;
+	hw->next = 0;
+	hw->fd = xmalloc(hw->nproc * sizeof(hw->fd[0]));
+	hw->pid = xmalloc(hw->nproc * sizeof(hw->pid[0]));
+	/* Children must not flush our pending output once more */
+	fflush_all();
+	for (k = 0; k < hw->nproc; k++) {
+		struct fd_pair result_pipe;
+
+		xpiped_pair(result_pipe);
+		hw->pid[k] = xfork();
+		if (hw->pid[k] == 0) {
+			unsigned j;
+
+			close(result_pipe.rd);
+			for (j = 0; j < k; j++)
+				close(hw->fd[j]);
+			hash_worker(result_pipe.wr, names, k, count, hw->nproc);
+		}
+		close(result_pipe.wr);
+		hw->fd[k] = result_pipe.rd;
+	}
+}
+
+/* Returns hash of the next file in order, NULL if it failed */
+static uint8_t *next_hash(hash_workers_t *hw)
+{
+	char rec[RESULT_SIZE];
+
+	if (full_read(hw->fd[hw->next], rec, RESULT_SIZE) != RESULT_SIZE)
+		bb_error_msg_and_die("child process failed");
+	if (++hw->next == hw->nproc)
+		hw->next = 0;
+	if (rec[0] != '+')
+		return NULL;
+	return (uint8_t*)xstrdup(rec + 1);
+}
+
+static void stop_workers(hash_workers_t *hw)
+{
+	unsigned k;
+
+	for (k = 0; k < hw->nproc; k++) {
+		close(hw->fd[k]);
+		wait4pid(hw->pid[k]);
+	}
+	free(hw->fd);
+	free(hw->pid);
+}
+#endif
+
+/* Splits "HASH  FILENAME" line, returns FILENAME or NULL */
+static char *split_sum_line(char *line)
+{
+	char *filename_ptr;
+
+	filename_ptr = strstr(line, "  ");
+	/* handle format for binary checksums */
+	if (filename_ptr == NULL) {
+		filename_ptr = strstr(line, " *");
+	}
+	if (filename_ptr) {
+		*filename_ptr = '\0';
+		filename_ptr += 2;
+	}
+	return filename_ptr;
+}
+
+/* Returns 1 if the line did not check out. Frees hash_value */
+static int check_sum(const char *sum, const char *filename_ptr,
+		uint8_t *hash_value, unsigned flags)
+{
+	if (filename_ptr == NULL) {
+		if (flags & FLAG_WARN) {
+			bb_error_msg("invalid format");
+		}
+		return 1;
+	}
+	if (hash_value && (strcmp((char*)hash_value, sum) == 0)) {
+		if (!(flags & FLAG_SILENT))
+			printf("%s: OK\n", filename_ptr);
+		free(hash_value);
+		return 0;
+	}
+	if (!(flags & FLAG_SILENT))
+		printf("%s: FAILED\n", filename_ptr);
+	/* possible free(NULL) */
+	free(hash_value);
+	return 1;
+}
+
+static int print_sum(const char *filename, uint8_t *hash_value)
+{
+	if (hash_value == NULL)
+		return EXIT_FAILURE;
+	printf("%s  %s\n", hash_value, filename);
+	free(hash_value);
+	return EXIT_SUCCESS;
+}
+
 int md5_sha1_sum_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int md5_sha1_sum_main(int argc UNUSED_PARAM, char **argv)
 {
 	int return_value = EXIT_SUCCESS;
 	unsigned flags;
+#if ENABLE_FEATURE_MD5_SHA1_SUM_PARALLEL
+	hash_workers_t hw;
+	unsigned nproc = 1;
+	char *jobs_str;
+#endif
 
-	if (ENABLE_FEATURE_MD5_SHA1_SUM_CHECK) {
+	if (ENABLE_FEATURE_MD5_SHA1_SUM_CHECK || ENABLE_FEATURE_MD5_SHA1_SUM_PARALLEL) {
 		/* -b "binary", -t "text" are ignored (shaNNNsum compat) */
-		flags = getopt32(argv, "scwbt");
+		flags = getopt32(argv,
+			IF_FEATURE_MD5_SHA1_SUM_CHECK("scwbt")
+			IF_FEATURE_MD5_SHA1_SUM_PARALLEL("j:")
+			IF_FEATURE_MD5_SHA1_SUM_PARALLEL(, &jobs_str)
+		);
 		argv += optind;
 		//argc -= optind;
 	} else {
@@ -194,6 +367,30 @@ int md5_sha1_sum_main(int argc UNUSED_PARAM, char **argv)
 		}
 	}
 
+#if ENABLE_FEATURE_MD5_SHA1_SUM_PARALLEL
+	if (flags & FLAG_JOBS) {
+		nproc = xatou_range(jobs_str, 0, 1024);
+		if (nproc == 0) {
+			nproc = get_cpu_count();
+			if (nproc == 0) /* non-SMP kernel */
+				nproc = 1;
+		}
+	}
+	if (nproc > 1 && !(ENABLE_FEATURE_MD5_SHA1_SUM_CHECK && (flags & FLAG_CHECK))) {
+		unsigned count = 0;
+
+		while (argv[count])
+			count++;
+		hw.nproc = nproc;
+		start_workers(&hw, argv, count);
+		do {
+			return_value |= print_sum(*argv, next_hash(&hw));
+		} while (*++argv);
+		stop_workers(&hw);
+		return return_value;
+	}
+#endif
+
 	do {
 		if (ENABLE_FEATURE_MD5_SHA1_SUM_CHECK && (flags & FLAG_CHECK)) {
 			FILE *pre_computed_stream;
@@ -203,56 +400,51 @@ int md5_sha1_sum_main(int argc UNUSED_PARAM, char **argv)
 
 			pre_computed_stream = xfopen_stdin(*argv);
 
+#if ENABLE_FEATURE_MD5_SHA1_SUM_PARALLEL
+			if (nproc > 1) {
+				/* Workers need the whole list up front */
+				char **lines = NULL;
+				char **names;
+				int i;
+
+				while ((line = xmalloc_fgetline(pre_computed_stream)) != NULL) {
+					lines = xrealloc_vector(lines, 6, count_total);
+					lines[count_total++] = line;
+				}
+				names = xmalloc(count_total * sizeof(names[0]));
+				for (i = 0; i < count_total; i++)
+					names[i] = split_sum_line(lines[i]);
+				hw.nproc = nproc;
+				start_workers(&hw, names, count_total);
+				for (i = 0; i < count_total; i++) {
+					count_failed += check_sum(lines[i], names[i], next_hash(&hw), flags);
+					free(lines[i]);
+				}
+				stop_workers(&hw);
+				free(names);
+				free(lines);
+			} else
+#endif
 			while ((line = xmalloc_fgetline(pre_computed_stream)) != NULL) {
-				uint8_t *hash_value;
 				char *filename_ptr;
 
 				count_total++;
-				filename_ptr = strstr(line, "  ");
-				/* handle format for binary checksums */
-				if (filename_ptr == NULL) {
-					filename_ptr = strstr(line, " *");
-				}
-				if (filename_ptr == NULL) {
-					if (flags & FLAG_WARN) {
-						bb_error_msg("invalid format");
-					}
-					count_failed++;
-					return_value = EXIT_FAILURE;
-					free(line);
-					continue;
-				}
-				*filename_ptr = '\0';
-				filename_ptr += 2;
-
-				hash_value = hash_file(filename_ptr);
-
-				if (hash_value && (strcmp((char*)hash_value, line) == 0)) {
-					if (!(flags & FLAG_SILENT))
-						printf("%s: OK\n", filename_ptr);
-				} else {
-					if (!(flags & FLAG_SILENT))
-						printf("%s: FAILED\n", filename_ptr);
-					count_failed++;
-					return_value = EXIT_FAILURE;
-				}
-				/* possible free(NULL) */
-				free(hash_value);
+				filename_ptr = split_sum_line(line);
+				count_failed += check_sum(line, filename_ptr,
+						filename_ptr ? hash_file(filename_ptr) : NULL,
+						flags);
 				free(line);
 			}
-			if (count_failed && !(flags & FLAG_SILENT)) {
-				bb_error_msg("WARNING: %d of %d computed checksums did NOT match",
-						count_failed, count_total);
+			if (count_failed) {
+				return_value = EXIT_FAILURE;
+				if (!(flags & FLAG_SILENT)) {
+					bb_error_msg("WARNING: %d of %d computed checksums did NOT match",
+							count_failed, count_total);
+				}
 			}
 			fclose_if_not_stdin(pre_computed_stream);
 		} else {
-			uint8_t *hash_value = hash_file(*argv);
-			if (hash_value == NULL) {
-				return_value = EXIT_FAILURE;
-			} else {
-				printf("%s  %s\n", hash_value, *argv);
-				free(hash_value);
-			}
+			return_value |= print_sum(*argv, hash_file(*argv));
 		}
 	} while (*++argv);
 
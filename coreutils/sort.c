@@ -41,7 +41,19 @@
 //usage:     "\n	-u	Suppress duplicate lines"
 //usage:	IF_FEATURE_SORT_BIG(
 //usage:     "\n	-z	Lines are terminated by NUL, not newline"
-//usage:     "\n	-mST	Ignored for GNU compatibility")
+//usage:	IF_FEATURE_SORT_EXTERNAL(
+//usage:     "\n	-S SIZE	Use at most SIZE of memory (K by default; b,K,M,G,%),"
+//usage:     "\n		sort larger inputs in temporary files"
+//usage:     "\n	-T DIR	Directory for temporary files"
+//usage:	IF_LONG_OPTS(
+//usage:     "\n	--parallel=N	Sort using N processes"
+//usage:	)
+//usage:     "\n	-m	Ignored for GNU compatibility"
+//usage:	)
+//usage:	IF_NOT_FEATURE_SORT_EXTERNAL(
+//usage:     "\n	-mST	Ignored for GNU compatibility"
+//usage:	)
+//usage:	)
 //usage:
 //usage:#define sort_example_usage
 //usage:       "$ echo -e \"e\\nf\\nb\\nd\\nc\\na\" | sort\n"
@@ -60,6 +72,9 @@
 //usage:       ""
 
 #include "libbb.h"
+#if ENABLE_FEATURE_SORT_EXTERNAL
+# include <sys/sysinfo.h>
+#endif
 
 /* This is a NOEXEC applet. Be very careful! */
 
@@ -70,7 +85,8 @@
 */
 
 /* These are sort types */
-static const char OPT_STR[] ALIGN1 = "ngMucszbrdfimS:T:o:k:t:";
+static const char OPT_STR[] ALIGN1 = "ngMucszbrdfimS:T:o:k:t:"
+	IF_FEATURE_SORT_EXTERNAL("\xff:");
 enum {
 	FLAG_n  = 1,            /* Numeric sort */
 	FLAG_g  = 2,            /* Sort using strtod() */
@@ -87,11 +103,12 @@ enum {
 	FLAG_f  = 0x400,        /* Force uppercase */
 	FLAG_i  = 0x800,        /* Ignore !isprint() */
 	FLAG_m  = 0x1000,       /* ignored: merge already sorted files; do not sort */
-	FLAG_S  = 0x2000,       /* ignored: -S, --buffer-size=SIZE */
-	FLAG_T  = 0x4000,       /* ignored: -T, --temporary-directory=DIR */
+	FLAG_S  = 0x2000,       /* -S, --buffer-size=SIZE (ignored without FEATURE_SORT_EXTERNAL) */
+	FLAG_T  = 0x4000,       /* -T, --temporary-directory=DIR (ditto) */
 	FLAG_o  = 0x8000,
 	FLAG_k  = 0x10000,
 	FLAG_t  = 0x20000,
+	FLAG_parallel = 0x40000, /* --parallel=N */
 	FLAG_bb = 0x80000000,   /* Ignore trailing blanks  */
 };
 
@@ -322,15 +339,545 @@ static unsigned str2u(char **str)
 }
 #endif
 
+#if ENABLE_FEATURE_SORT_KEY_CACHE
+/* compare_keys() extracts (and for -n/-g/-M, parses) both keys
+ * on every one of O(n log n) comparisons. Instead, extract every key
+ * of every line once, into one array per key, and sort line indexes.
+ * Numeric keys become integers which compare in the same order,
+ * so they (and bytewise string keys) can be radix sorted.
+ */
+union key_val {
+	char *str;
+	uint64_t num;
+};
+
+static char **kc_lines;
+static union key_val **kc_vals; /* [key][line] */
+
+/* Map double to integer with the same ordering */
+static uint64_t double2key(double d)
+{
+	union {
+		double d;
+		uint64_t u;
+	} v;
+
+	if (d == 0) /* -0 == 0 */
+		d = 0;
+	v.d = d;
+	if (v.u >> 63)
+		return ~v.u;
+	return v.u | ((uint64_t)1 << 63);
+}
+
+static uint64_t num_key(char *str, int flags)
+{
+	switch (flags & 7) {
+	case FLAG_g: {
+		char *end;
+		double d = strtod(str, &end);
+		/* not numbers < NaN < -infinity < numbers < +infinity,
+		 * and 0, 1 are never returned by double2key for non-NaNs */
+		if (str == end)
+			return 0;
+		if (d != d)
+			return 1;
+		return double2key(d);
+	}
+	case FLAG_M: {
+		struct tm thyme;
+		if (!strptime(str, "%b", &thyme))
+			return 0;
+		return thyme.tm_mon + 1;
+	}
+	default: /* FLAG_n */
+		return double2key(atof(str));
+	}
+}
+
+static int compare_cached(const void *xarg, const void *yarg)
+{
+	unsigned x = *(unsigned*)xarg;
+	unsigned y = *(unsigned*)yarg;
+	int flags = option_mask32, retval = 0;
+	struct sort_key *key;
+	union key_val **vals = kc_vals;
+
+	for (key = key_list; !retval && key; key = key->next_key, vals++) {
+		union key_val *v = *vals;
+
+		flags = key->flags ? key->flags : option_mask32;
+		if (flags & 7)
+			retval = (v[x].num > v[y].num) - (v[x].num < v[y].num);
+		else
+# if ENABLE_LOCALE_SUPPORT
+			retval = strcoll(v[x].str, v[y].str);
+# else
+			retval = strcmp(v[x].str, v[y].str);
+# endif
+	}
+	if (!retval && !(option_mask32 & FLAG_s))
+		retval = strcmp(kc_lines[x], kc_lines[y]);
+	if (flags & FLAG_r)
+		retval = -retval;
+	/* Ties keep input order: makes -s really stable */
+	if (!retval)
+		retval = (x > y) - (x < y);
+	return retval;
+}
+
+/* Stable LSD radix sort of idx[] by 64-bit keys */
+static void radix_sort_num(unsigned *idx, unsigned *aux, unsigned n, union key_val *v)
+{
+	unsigned shift;
+
+	for (shift = 0; shift < 64; shift += 8) {
+		unsigned count[256];
+		unsigned i, sum;
+
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[(uint8_t)(v[idx[i]].num >> shift)]++;
+		/* This byte is the same in all keys? */
+		if (count[(uint8_t)(v[idx[0]].num >> shift)] == n)
+			continue;
+		for (i = sum = 0; i < 256; i++) {
+			unsigned c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+			aux[count[(uint8_t)(v[idx[i]].num >> shift)]++] = idx[i];
+		memcpy(idx, aux, n * sizeof(idx[0]));
+	}
+}
+
+/* Stable MSD radix sort of idx[] by string keys, from byte depth on */
+static void radix_sort_str(unsigned *idx, unsigned *aux, unsigned n, union key_val *v, unsigned depth)
+{
+	while (n > 1) {
+		unsigned count[256];
+		unsigned start[256];
+		unsigned i, sum, big;
+
+		if (n < 32) {
+			/* Insertion sort, stable */
+			for (i = 1; i < n; i++) {
+				unsigned t = idx[i];
+				unsigned j = i;
+				while (j && strcmp(v[idx[j-1]].str + depth, v[t].str + depth) > 0) {
+					idx[j] = idx[j-1];
+					j--;
+				}
+				idx[j] = t;
+			}
+			return;
+		}
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[(uint8_t)v[idx[i]].str[depth]]++;
+		for (i = sum = 0; i < 256; i++) {
+			start[i] = sum;
+			sum += count[i];
+		}
+		if (count[(uint8_t)v[idx[0]].str[depth]] != n) {
+			unsigned pos[256];
+			memcpy(pos, start, sizeof(pos));
+			for (i = 0; i < n; i++)
+				aux[pos[(uint8_t)v[idx[i]].str[depth]]++] = idx[i];
+			memcpy(idx, aux, n * sizeof(idx[0]));
+		}
+		/* Bucket 0: keys ended, they are equal. Recurse into all buckets
+		 * but the biggest one, loop on that: recursion depth is log(n) */
+		big = 1;
+		for (i = 2; i < 256; i++)
+			if (count[i] > count[big])
+				big = i;
+		for (i = 1; i < 256; i++)
+			if (i != big && count[i] > 1)
+				radix_sort_str(idx + start[i], aux, count[i], v, depth + 1);
+		idx += start[big];
+		n = count[big];
+		depth++;
+	}
+}
+
+static int radix_usable(int flags)
+{
+	/* Only one key, compared bytewise or as a number */
+	if (key_list->next_key)
+		return 0;
+	if (flags & 7)
+		return 1;
+# if ENABLE_LOCALE_SUPPORT
+	{
+		const char *collate = setlocale(LC_COLLATE, NULL);
+		if (!collate || (strcmp(collate, "C") != 0 && strcmp(collate, "POSIX") != 0))
+			return 0;
+	}
+# endif
+	return 1;
+}
+
+static void sort_with_key_cache(char **lines, unsigned count)
+{
+	struct sort_key *key;
+	unsigned nkeys, k, i;
+	unsigned *idx;
+	char **sorted;
+	int flags;
+
+	nkeys = 0;
+	for (key = key_list; key; key = key->next_key)
+		nkeys++;
+	kc_lines = lines;
+	kc_vals = xmalloc(nkeys * sizeof(kc_vals[0]));
+	for (key = key_list, k = 0; key; key = key->next_key, k++) {
+		union key_val *v = kc_vals[k] = xmalloc(count * sizeof(v[0]));
+
+		flags = key->flags ? key->flags : option_mask32;
+		for (i = 0; i < count; i++) {
+			char *str = get_key(lines[i], key, flags);
+			if (flags & 7) {
+				v[i].num = num_key(str, flags);
+				if (str != lines[i])
+					free(str);
+			} else {
+				v[i].str = str;
+			}
+		}
+	}
+	idx = xmalloc(count * sizeof(idx[0]));
+	for (i = 0; i < count; i++)
+		idx[i] = i;
+
+	flags = key_list->flags ? key_list->flags : option_mask32;
+	if (radix_usable(flags)) {
+		unsigned *aux = xmalloc(count * sizeof(aux[0]));
+		union key_val *v = kc_vals[0];
+		unsigned j;
+
+		if (flags & 7)
+			radix_sort_num(idx, aux, count, v);
+		else
+			radix_sort_str(idx, aux, count, v, 0);
+		free(aux);
+		/* idx[] is sorted by the key, ties in input order.
+		 * -r: reverse, but keep ties in input order */
+		if (flags & FLAG_r) {
+			for (i = 0, j = count - 1; i < j; i++, j--) {
+				unsigned t = idx[i];
+				idx[i] = idx[j];
+				idx[j] = t;
+			}
+		}
+		/* Find runs of equal keys */
+		for (i = 0; i < count; i = j) {
+			for (j = i + 1; j < count; j++) {
+				if ((flags & 7)
+				 ? v[idx[j]].num != v[idx[i]].num
+				 : strcmp(v[idx[j]].str, v[idx[i]].str) != 0
+				) {
+					break;
+				}
+			}
+			/* Fallback comparison (or input order for -s) */
+			if (j - i > 1)
+				qsort(idx + i, j - i, sizeof(idx[0]), compare_cached);
+		}
+	} else {
+		qsort(idx, count, sizeof(idx[0]), compare_cached);
+	}
+
+	for (key = key_list, k = 0; key; key = key->next_key, k++) {
+		flags = key->flags ? key->flags : option_mask32;
+		if (!(flags & 7)) {
+			for (i = 0; i < count; i++)
+				if (kc_vals[k][i].str != lines[i])
+					free(kc_vals[k][i].str);
+		}
+		free(kc_vals[k]);
+	}
+	free(kc_vals);
+
+	sorted = xmalloc(count * sizeof(sorted[0]));
+	for (i = 0; i < count; i++)
+		sorted[i] = lines[idx[i]];
+	memcpy(lines, sorted, count * sizeof(lines[0]));
+	free(sorted);
+	free(idx);
+}
+#endif
+
+static void sort_lines(char **lines, int count)
+{
+#if ENABLE_FEATURE_SORT_KEY_CACHE
+	if (count > 1) {
+		sort_with_key_cache(lines, count);
+		return;
+	}
+#endif
+	qsort(lines, count, sizeof(lines[0]), compare_keys);
+}
+
+#if ENABLE_FEATURE_SORT_EXTERNAL
+/* Input which does not fit into -S SIZE is sorted in pieces ("runs"),
+ * which are written to unlinked temporary files and merged at the end.
+ * Whenever NMERGE runs of the same level pile up, they are merged
+ * into one run of the next level, which bounds the number of open files.
+ */
+enum { NMERGE = 16 };
+
+struct sort_run {
+	FILE *fp;
+	char *line;         /* current line while merging */
+	int fd;
+	unsigned level;
+# if BB_MMU
+	pid_t pid;          /* child which is still sorting this run */
+	char **lines;       /* lines it works on, freed when it is done */
+	int count;
+# endif
+};
+
+static struct sort_run *runs;
+static unsigned nruns;
+static const char *tmp_dir;
+static unsigned nproc;
+
+static unsigned long long parse_size(const char *str)
+{
+	static const struct suffix_mult sort_suffixes[] = {
+		{ "b", 1 },
+		{ "K", 1024 },
+		{ "k", 1024 },
+		{ "M", 1024*1024 },
+		{ "G", 1024*1024*1024 },
+		{ "", 0 }
+	};
+	unsigned len = strlen(str);
+
+	if (len && str[len - 1] == '%') {
+		struct sysinfo info;
+		char *num = xstrndup(str, len - 1);
+		unsigned percent = xatou_range(num, 0, 100);
+
+		free(num);
+		sysinfo(&info);
+		return (unsigned long long)info.totalram * info.mem_unit / 100 * percent;
+	}
+	/* GNU compat: bare number is in kilobytes */
+	if (len && isdigit(str[len - 1]))
+		return xatoull(str) * 1024;
+	return xatoull_sfx(str, sort_suffixes);
+}
+
+/* Returns fd to write the run to, *read_fd is used to merge it later */
+static int make_tmp_file(int *read_fd)
+{
+	char *name = concat_path_file(tmp_dir, "sortXXXXXX");
+	int fd = xmkstemp(name);
+
+	*read_fd = xopen(name, O_RDONLY);
+	unlink(name);
+	free(name);
+	return fd;
+}
+
+static void write_lines(int fd, char **lines, int count)
+{
+	FILE *fp = xfdopen_for_write(fd);
+	int eol = (option_mask32 & FLAG_z) ? '\0' : '\n';
+	int i;
+
+	for (i = 0; i < count; i++) {
+		fputs(lines[i], fp);
+		putc(eol, fp);
+	}
+	if (fclose(fp))
+		bb_perror_msg_and_die("can't write temporary file");
+}
+
+static void free_lines(char **lines, int count)
+{
+	while (--count >= 0)
+		free(lines[count]);
+}
+
+static void finish_run(struct sort_run *run)
+{
+# if BB_MMU
+	if (run->pid) {
+		if (wait4pid(run->pid) != 0)
+			xfunc_die(); /* child has already complained */
+		run->pid = 0;
+		free_lines(run->lines, run->count);
+		free(run->lines);
+	}
+# endif
+}
+
+/* Is line of run a smaller than line of run b? Ties keep input order */
+static int run_less(struct sort_run *r, unsigned a, unsigned b)
+{
+	int retval = compare_keys(&r[a].line, &r[b].line);
+	return retval < 0 || (retval == 0 && a < b);
+}
+
+static void sift_down(struct sort_run *r, unsigned *heap, unsigned hn, unsigned i)
+{
+	for (;;) {
+		unsigned min = i;
+		unsigned child = 2*i + 1;
+		unsigned t;
+
+		if (child < hn && run_less(r, heap[child], heap[min]))
+			min = child;
+		if (child + 1 < hn && run_less(r, heap[child + 1], heap[min]))
+			min = child + 1;
+		if (min == i)
+			break;
+		t = heap[i];
+		heap[i] = heap[min];
+		heap[min] = t;
+		i = min;
+	}
+}
+
+/* K-way merge of n runs into fp. Closes the runs */
+static void merge_runs(struct sort_run *r, unsigned n, FILE *fp, int unique)
+{
+	int eol = (option_mask32 & FLAG_z) ? '\0' : '\n';
+	unsigned *heap = xmalloc(n * sizeof(heap[0]));
+	unsigned hn = 0;
+	unsigned i;
+	char *last = NULL;
+
+	for (i = 0; i < n; i++) {
+		finish_run(&r[i]);
+		r[i].fp = xfdopen_for_read(r[i].fd);
+		r[i].line = GET_LINE(r[i].fp);
+		if (r[i].line)
+			heap[hn++] = i;
+	}
+	i = hn / 2;
+	while (i != 0)
+		sift_down(r, heap, hn, --i);
+
+	while (hn) {
+		struct sort_run *run = &r[heap[0]];
+		char *line = run->line;
+
+		if (last) {
+			unsigned opts = option_mask32;
+			/* same as in sort_main: drop lines which only share the key */
+			option_mask32 |= FLAG_s;
+			if (compare_keys(&last, &line) == 0) {
+				free(line);
+				line = NULL;
+			}
+			option_mask32 = opts;
+		}
+		if (line) {
+			fputs(line, fp);
+			putc(eol, fp);
+			if (unique) {
+				free(last);
+				last = line;
+			} else {
+				free(line);
+			}
+		}
+		run->line = GET_LINE(run->fp);
+		if (!run->line)
+			heap[0] = heap[--hn];
+		sift_down(r, heap, hn, 0);
+	}
+	free(last);
+	free(heap);
+	for (i = 0; i < n; i++)
+		fclose(r[i].fp);
+}
+
+/* Merge trailing NMERGE runs of the same level into one */
+static void merge_levels(void)
+{
+	while (nruns >= NMERGE) {
+		struct sort_run *r = &runs[nruns - NMERGE];
+		struct sort_run merged;
+		FILE *fp;
+		unsigned i;
+
+		for (i = 1; i < NMERGE; i++)
+			if (r[i].level != r[0].level)
+				return;
+		memset(&merged, 0, sizeof(merged));
+		merged.level = r[0].level + 1;
+		fp = xfdopen_for_write(make_tmp_file(&merged.fd));
+		merge_runs(r, NMERGE, fp, 0);
+		if (fclose(fp))
+			bb_perror_msg_and_die("can't write temporary file");
+		nruns -= NMERGE;
+		runs[nruns++] = merged;
+	}
+}
+
+/* Sort lines into a new run. Takes ownership of the strings,
+ * but not of the array */
+static void spill_run(char **lines, int count)
+{
+	struct sort_run *run;
+	int fd;
+
+	runs = xrealloc_vector(runs, 4, nruns);
+	run = &runs[nruns++];
+	memset(run, 0, sizeof(*run));
+	fd = make_tmp_file(&run->fd);
+# if BB_MMU
+	if (nproc > 1) {
+		unsigned busy = 0;
+		unsigned i;
+
+		/* Keep at most nproc children sorting */
+		for (i = nruns - 1; i != 0;) {
+			if (runs[--i].pid && ++busy >= nproc)
+				finish_run(&runs[i]);
+		}
+		run->pid = xfork();
+		if (run->pid == 0) {
+			sort_lines(lines, count);
+			write_lines(fd, lines, count);
+			_exit(EXIT_SUCCESS);
+		}
+		close(fd);
+		run->lines = xmalloc(count * sizeof(lines[0]));
+		memcpy(run->lines, lines, count * sizeof(lines[0]));
+		run->count = count;
+		merge_levels();
+		return;
+	}
+# endif
+	sort_lines(lines, count);
+	write_lines(fd, lines, count);
+	free_lines(lines, count);
+	merge_levels();
+}
+#endif
+
 int sort_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int sort_main(int argc UNUSED_PARAM, char **argv)
 {
 	char *line, **lines;
-	char *str_ignored, *str_o, *str_t;
+	char *str_S, *str_T, *str_o, *str_t;
 	llist_t *lst_k = NULL;
 	int i, flag;
 	int linecount;
 	unsigned opts;
+#if ENABLE_FEATURE_SORT_EXTERNAL
+	char *str_parallel;
+	unsigned long long run_size = 0;
+	unsigned long long mem_used = 0;
+#endif
 
 	xfunc_error_retval = 2;
 
@@ -338,7 +885,16 @@ int sort_main(int argc UNUSED_PARAM, char **argv)
 	/* -o and -t can be given at most once */
 	opt_complementary = "o--o:t--t:" /* -t, -o: at most one of each */
 			"k::"; /* -k takes list */
-	opts = getopt32(argv, OPT_STR, &str_ignored, &str_ignored, &str_o, &lst_k, &str_t);
+#if ENABLE_FEATURE_SORT_EXTERNAL && ENABLE_LONG_OPTS
+	applet_long_options =
+		"buffer-size\0"         Required_argument "S"
+		"temporary-directory\0" Required_argument "T"
+		"parallel\0"            Required_argument "\xff"
+		;
+#endif
+	opts = getopt32(argv, OPT_STR, &str_S, &str_T, &str_o, &lst_k, &str_t
+			IF_FEATURE_SORT_EXTERNAL(, &str_parallel)
+	);
 	/* global b strips leading and trailing spaces */
 	if (opts & FLAG_b)
 		option_mask32 |= FLAG_bb;
@@ -399,6 +955,27 @@ int sort_main(int argc UNUSED_PARAM, char **argv)
 			}
 		}
 	}
+	/* if no key, perform alphabetic sort */
+	if (!key_list)
+		add_key()->range[0] = 1;
+#endif
+#if ENABLE_FEATURE_SORT_EXTERNAL
+	tmp_dir = (opts & FLAG_T) ? str_T : getenv("TMPDIR");
+	if (!tmp_dir || !tmp_dir[0])
+		tmp_dir = "/tmp";
+	nproc = 1;
+# if BB_MMU
+	if (opts & FLAG_parallel) {
+		nproc = xatou_range(str_parallel, 1, 1024);
+	}
+# endif
+	/* -c is not affected by -S */
+	if ((opts & (FLAG_S | FLAG_c)) == FLAG_S) {
+		/* Each of nproc runs in flight gets its share */
+		run_size = parse_size(str_S) / nproc;
+		if (run_size == 0)
+			run_size = 1;
+	}
 #endif
 
 	/* Open input files and read data */
@@ -417,14 +994,43 @@ int sort_main(int argc UNUSED_PARAM, char **argv)
 				break;
 			lines = xrealloc_vector(lines, 6, linecount);
 			lines[linecount++] = line;
+#if ENABLE_FEATURE_SORT_EXTERNAL
+			if (run_size) {
+				/* string, pointer to it, malloc overhead */
+				mem_used += strlen(line) + 1 + 3 * sizeof(char*);
+				if (mem_used >= run_size) {
+					spill_run(lines, linecount);
+					free(lines);
+					lines = NULL;
+					linecount = 0;
+					mem_used = 0;
+				}
+			}
+#endif
 		}
 		fclose_if_not_stdin(fp);
 	} while (*++argv);
 
+#if ENABLE_FEATURE_SORT_EXTERNAL
+	/* Let nproc processes sort what we have, then merge */
+	if (nproc > 1 && !(option_mask32 & FLAG_c) && linecount >= 0x1000) {
+		int per_proc = (linecount + nproc - 1) / nproc;
+		for (i = 0; i < linecount; i += per_proc)
+			spill_run(lines + i, MIN(per_proc, linecount - i));
+		linecount = 0;
+	}
+	if (nruns) {
+		if (linecount)
+			spill_run(lines, linecount);
+		free(lines);
+		if (option_mask32 & FLAG_o)
+			xmove_fd(xopen3(str_o, O_WRONLY|O_CREAT|O_TRUNC, 0666), STDOUT_FILENO);
+		merge_runs(runs, nruns, stdout, option_mask32 & FLAG_u);
+		fflush_stdout_and_exit(EXIT_SUCCESS);
+	}
+#endif
+
 #if ENABLE_FEATURE_SORT_BIG
-	/* if no key, perform alphabetic sort */
-	if (!key_list)
-		add_key()->range[0] = 1;
 	/* handle -c */
 	if (option_mask32 & FLAG_c) {
 		int j = (option_mask32 & FLAG_u) ? -1 : 0;
@@ -438,7 +1044,7 @@ int sort_main(int argc UNUSED_PARAM, char **argv)
 	}
 #endif
 	/* Perform the actual sort */
-	qsort(lines, linecount, sizeof(lines[0]), compare_keys);
+	sort_lines(lines, linecount);
 	/* handle -u */
 	if (option_mask32 & FLAG_u) {
 		flag = 0;
@@ -56,6 +56,16 @@
 //config:	  Print the specified number of leading (-B) and/or trailing (-A)
 //config:	  context surrounding our matching lines.
 //config:	  Print the specified number of context lines (-C).
+//config:
+//config:config FEATURE_GREP_FIXED_MULTI
+//config:	bool "Fast grep -F with many patterns"
+//config:	default y
+//config:	depends on GREP
+//config:	help
+//config:	  With more than one -F pattern, search for all of them
+//config:	  at once using an Aho-Corasick automaton, instead of
+//config:	  searching each line for every pattern in turn.
+//config:	  Uses up to 100 bytes of memory per byte of patterns.
 
 #include "libbb.h"
 #include "xregex.h"
@@ -200,6 +210,9 @@ struct globals {
 	/* globals used internally */
 	llist_t *pattern_head;   /* growable list of patterns to match */
 	const char *cur_file;    /* the current file we are reading */
+#if ENABLE_FEATURE_GREP_FIXED_MULTI
+	struct grep_ac *fixed_ac; /* all -F patterns, if more than one */
+#endif
 } FIX_ALIASING;
 #define G (*(struct globals*)&bb_common_bufsiz1)
 #define INIT_G() do { \
@@ -233,6 +246,7 @@ struct globals {
 #define last_line_printed (G.last_line_printed   )
 #define pattern_head      (G.pattern_head        )
 #define cur_file          (G.cur_file            )
+#define fixed_ac          (G.fixed_ac            )
 
 
 typedef struct grep_list_data_t {
@@ -248,6 +262,8 @@ typedef struct grep_list_data_t {
 #define ALLOCATED 1
 #define COMPILED 2
 	int flg_mem_alocated_compiled;
+	/* a string every matching line contains, or NULL */
+	char *literal;
 } grep_list_data_t;
 
 #if !ENABLE_EXTRA_COMPAT
@@ -307,6 +323,437 @@ static ssize_t FAST_FUNC bb_getline(char **line_ptr, size_t *line_alloc_len, FIL
 }
 #endif
 
+#if ENABLE_FEATURE_GREP_FIXED_MULTI
+/* Aho-Corasick automaton: a trie of all patterns, where each node
+ * also knows the longest proper suffix of its string which is
+ * a trie node too ("fail" link), and the nearest such suffix
+ * which is a whole pattern ("out" link). Lines are then scanned once,
+ * regardless of the number of patterns.
+ * Trie edges are kept in a hash table, except those from the root.
+ */
+struct ac_node {
+	unsigned parent;
+	unsigned fail;
+	unsigned out;
+	unsigned len;      /* depth in trie */
+	int pat;           /* index of the first pattern ending here, or -1 */
+	unsigned char c;   /* edge label from parent */
+};
+
+struct ac_edge {
+	uint64_t key;      /* (from << 8) + c */
+	unsigned to;       /* 0: empty slot (root is nobody's child) */
+};
+
+struct grep_ac {
+	struct ac_node *node;
+	struct ac_edge *edge;
+	unsigned edge_mask;
+	unsigned nnodes;
+	grep_list_data_t **pat;
+	unsigned char fold[256];
+	unsigned root_next[256];
+};
+
+static unsigned ac_hash(uint64_t key, unsigned mask)
+{
+	return (unsigned)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+static unsigned ac_child(struct grep_ac *ac, unsigned from, unsigned c)
+{
+	uint64_t key;
+	unsigned h;
+
+	if (from == 0)
+		return ac->root_next[c];
+	key = ((uint64_t)from << 8) + c;
+	h = ac_hash(key, ac->edge_mask);
+	while (ac->edge[h].to) {
+		if (ac->edge[h].key == key)
+			return ac->edge[h].to;
+		h = (h + 1) & ac->edge_mask;
+	}
+	return 0;
+}
+
+static void ac_add_child(struct grep_ac *ac, unsigned from, unsigned c, unsigned to)
+{
+	uint64_t key;
+	unsigned h;
+
+	if (from == 0) {
+		ac->root_next[c] = to;
+		return;
+	}
+	key = ((uint64_t)from << 8) + c;
+	h = ac_hash(key, ac->edge_mask);
+	while (ac->edge[h].to)
+		h = (h + 1) & ac->edge_mask;
+	ac->edge[h].key = key;
+	ac->edge[h].to = to;
+}
+
+/* Returns NULL if automaton can't be used (empty pattern) */
+static struct grep_ac *build_fixed_ac(void)
+{
+	struct grep_ac *ac;
+	llist_t *cur;
+	unsigned total, npat, i, n, maxlen;
+	unsigned *by_depth, *depth_cnt;
+
+	total = npat = maxlen = 0;
+	for (cur = pattern_head; cur; cur = cur->link) {
+		unsigned len = strlen(((grep_list_data_t *)cur->data)->pattern);
+		if (len == 0)
+			return NULL;
+		total += len;
+		if (maxlen < len)
+			maxlen = len;
+		npat++;
+	}
+
+	ac = xzalloc(sizeof(*ac));
+	for (i = 0; i < 256; i++)
+		ac->fold[i] = (option_mask32 & OPT_i) ? tolower(i) : i;
+	ac->node = xzalloc((total + 1) * sizeof(ac->node[0]));
+	ac->node[0].pat = -1;
+	ac->nnodes = 1;
+	/* Keep hash table at most half full */
+	for (i = 2; i < total * 2; i <<= 1)
+		continue;
+	ac->edge_mask = i - 1;
+	ac->edge = xzalloc(i * sizeof(ac->edge[0]));
+	ac->pat = xmalloc(npat * sizeof(ac->pat[0]));
+
+	/* Build the trie */
+	for (cur = pattern_head, i = 0; cur; cur = cur->link, i++) {
+		const unsigned char *p = (void*)((grep_list_data_t *)cur->data)->pattern;
+		unsigned s = 0;
+
+		ac->pat[i] = (grep_list_data_t *)cur->data;
+		for (; *p; p++) {
+			unsigned c = ac->fold[*p];
+			unsigned t = ac_child(ac, s, c);
+			if (!t) {
+				t = ac->nnodes++;
+				ac->node[t].parent = s;
+				ac->node[t].c = c;
+				ac->node[t].len = ac->node[s].len + 1;
+				ac->node[t].pat = -1;
+				ac_add_child(ac, s, c, t);
+			}
+			s = t;
+		}
+		if (ac->node[s].pat < 0)
+			ac->node[s].pat = i;
+	}
+
+	/* Compute fail and out links in order of depth (breadth first):
+	 * shorter suffixes must be done first */
+	depth_cnt = xzalloc((maxlen + 2) * sizeof(depth_cnt[0]));
+	for (n = 1; n < ac->nnodes; n++)
+		depth_cnt[ac->node[n].len + 1]++;
+	for (i = 1; i <= maxlen + 1; i++)
+		depth_cnt[i] += depth_cnt[i - 1];
+	by_depth = xmalloc(ac->nnodes * sizeof(by_depth[0]));
+	for (n = 1; n < ac->nnodes; n++)
+		by_depth[depth_cnt[ac->node[n].len]++] = n;
+	free(depth_cnt);
+
+	for (i = 0; i < ac->nnodes - 1; i++) {
+		struct ac_node *node;
+		unsigned f;
+
+		n = by_depth[i];
+		node = &ac->node[n];
+		f = 0;
+		if (node->parent != 0) {
+			f = ac->node[node->parent].fail;
+			for (;;) {
+				unsigned t = ac_child(ac, f, node->c);
+				if (t) {
+					f = t;
+					break;
+				}
+				if (f == 0)
+					break;
+				f = ac->node[f].fail;
+			}
+		}
+		node->fail = f;
+		node->out = (ac->node[f].pat >= 0) ? f : ac->node[f].out;
+	}
+	free(by_depth);
+	return ac;
+}
+
+static int ac_word_bounded(const char *line, size_t len, size_t start, size_t end)
+{
+	char c = start ? line[start - 1] : ' ';
+	if (isalnum(c) || c == '_')
+		return 0;
+	c = (end < len) ? line[end] : '\0';
+	return !c || (!isalnum(c) && c != '_');
+}
+
+/* Returns the first (in pattern list order) matching pattern, or NULL.
+ * That's what the one-pattern-at-a-time loop finds too.
+ */
+static grep_list_data_t *ac_search(struct grep_ac *ac, const char *line, size_t len)
+{
+	unsigned s = 0;
+	int best = -1;
+	size_t i;
+
+	if (option_mask32 & OPT_x) {
+		for (i = 0; i < len; i++) {
+			s = ac_child(ac, s, ac->fold[(unsigned char)line[i]]);
+			if (!s)
+				return NULL;
+		}
+		best = ac->node[s].pat;
+		return best >= 0 ? ac->pat[best] : NULL;
+	}
+
+	for (i = 0; i < len; i++) {
+		unsigned c = ac->fold[(unsigned char)line[i]];
+		unsigned n;
+
+		for (;;) {
+			n = ac_child(ac, s, c);
+			if (n || s == 0)
+				break;
+			s = ac->node[s].fail;
+		}
+		s = n;
+		if (ac->node[s].pat < 0)
+			n = ac->node[s].out;
+		for (; n; n = ac->node[n].out) {
+			if ((option_mask32 & OPT_w)
+			 && !ac_word_bounded(line, len, i + 1 - ac->node[n].len, i + 1)
+			) {
+				continue;
+			}
+			if (best < 0 || ac->node[n].pat < best)
+				best = ac->node[n].pat;
+			/* Only -o prints the pattern, others just need a match */
+			if (!(option_mask32 & OPT_o))
+				return ac->pat[best];
+		}
+	}
+	return best >= 0 ? ac->pat[best] : NULL;
+}
+#endif
+
+/* Find the longest string which every match of regex RE must contain.
+ * Being conservative is fine: anything optional, repeated,
+ * grouped or alternated is not used.
+ */
+static char *required_literal(const char *re, int extended)
+{
+	char *best = NULL;
+	char *run = xmalloc(strlen(re) + 1);
+	unsigned best_len = 0;
+	unsigned run_len = 0;
+	unsigned depth = 0;
+	smallint last_was_char = 0;
+
+	for (;;) {
+		unsigned char c = *re++;
+		smallint quantifier = 0;
+		smallint literal = 0;
+
+		if (c == '\\') {
+			c = *re++;
+			if (!c)
+				break;
+			if (strchr(".[]*^$\\", c)) {
+				literal = 1;
+			} else if (extended) {
+				literal = (strchr("+?(){}|", c) != NULL);
+			} else if (c == '|') {
+				goto give_up;
+			} else if (c == '(') {
+				depth++;
+			} else if (c == ')') {
+				if (depth)
+					depth--;
+			} else if (c == '+' || c == '?') {
+				quantifier = 1;
+			} else if (c == '{') {
+				/* skip "m,n\}" */
+				while (*re && !(re[0] == '\\' && re[1] == '}'))
+					re++;
+				if (*re)
+					re += 2;
+				quantifier = 1;
+			}
+			/* else: \w, \<, \1... */
+		} else if (c == '[') {
+			/* skip bracket expression, "[]...]" and "[^]...]" included */
+			if (*re == '^')
+				re++;
+			if (*re == ']')
+				re++;
+			while (*re && *re != ']') {
+				if (re[0] == '[' && (re[1] == ':' || re[1] == '.' || re[1] == '=')) {
+					const char *e = strchr(re + 2, re[1]);
+					if (e && e[1] == ']')
+						re = e + 1;
+				}
+				re++;
+			}
+			if (*re)
+				re++;
+		} else if (c == '*') {
+			quantifier = 1;
+		} else if (extended && (c == '+' || c == '?')) {
+			quantifier = 1;
+		} else if (extended && c == '{') {
+			while (*re && *re != '}')
+				re++;
+			if (*re)
+				re++;
+			quantifier = 1;
+		} else if (extended && c == '|') {
+			goto give_up;
+		} else if (extended && c == '(') {
+			depth++;
+		} else if (extended && c == ')') {
+			if (depth)
+				depth--;
+		} else if (c && c != '.' && c != '^' && c != '$') {
+			literal = 1;
+		}
+
+		if (quantifier && last_was_char) {
+			/* x* or x{0,1}: x is optional. Drop all of a multibyte char */
+			while (run_len && (run[run_len - 1] & 0xc0) == 0x80)
+				run_len--;
+			if (run_len)
+				run_len--;
+		}
+		if (literal && depth == 0) {
+			run[run_len++] = c;
+			last_was_char = 1;
+			continue;
+		}
+		/* end of run */
+		if (run_len > best_len) {
+			free(best);
+			best = xstrndup(run, run_len);
+			best_len = run_len;
+		}
+		run_len = 0;
+		last_was_char = 0;
+		if (!c)
+			break;
+	}
+	free(run);
+	return best;
+ give_up:
+	free(run);
+	free(best);
+	return NULL;
+}
+
+#if !ENABLE_EXTRA_COMPAT
+/* Input is read in big blocks, lines are returned in place */
+struct line_buf {
+	int fd;
+	smallint eof;
+	char *buf;
+	size_t size;
+	size_t pos;   /* start of next line */
+	size_t end;   /* end of data */
+};
+
+static void fill_line_buf(struct line_buf *lb)
+{
+	ssize_t n;
+
+	memmove(lb->buf, lb->buf + lb->pos, lb->end - lb->pos);
+	lb->end -= lb->pos;
+	lb->pos = 0;
+	/* Keep room for one NUL */
+	if (lb->size - lb->end < 64 * 1024) {
+		lb->size = lb->size ? lb->size * 2 : 128 * 1024;
+		lb->buf = xrealloc(lb->buf, lb->size);
+	}
+	n = safe_read(lb->fd, lb->buf + lb->end, lb->size - 1 - lb->end);
+	if (n <= 0)
+		lb->eof = 1;
+	else
+		lb->end += n;
+}
+
+static unsigned count_lines(const char *p, const char *end)
+{
+	unsigned cnt = 0;
+
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		p++;
+		cnt++;
+	}
+	return cnt;
+}
+
+/* Returns next line (NUL terminated) or NULL on EOF.
+ * If LITERAL is given, lines without it are skipped,
+ * and only counted in *linenum.
+ */
+static char *next_line(struct line_buf *lb, size_t *len, const char *literal, int *linenum)
+{
+	for (;;) {
+		char *start = lb->buf + lb->pos;
+		size_t avail = lb->end - lb->pos;
+		char *nl;
+
+		if (literal && avail) {
+			char *cand = memmem(start, avail, literal, strlen(literal));
+			char *skip_to;
+
+			if (cand) /* skip to the start of its line */
+				skip_to = memrchr(start, '\n', cand - start);
+			else /* skip all complete lines */
+				skip_to = memrchr(start, '\n', avail);
+			if (skip_to) {
+				skip_to++;
+				*linenum += count_lines(start, skip_to);
+				lb->pos += skip_to - start;
+				start = skip_to;
+				avail = lb->end - lb->pos;
+			}
+			if (!cand) {
+				/* Incomplete last line: it may get the literal
+				 * from the next read. At EOF, it won't */
+				if (lb->eof)
+					return NULL;
+				goto fill;
+			}
+		}
+		nl = memchr(start, '\n', avail);
+		if (nl) {
+			*nl = '\0';
+			*len = nl - start;
+			lb->pos += *len + 1;
+			return start;
+		}
+		if (lb->eof) {
+			if (!avail)
+				return NULL;
+			start[avail] = '\0';
+			*len = avail;
+			lb->pos = lb->end;
+			return start;
+		}
+ fill:
+		fill_line_buf(lb);
+	}
+}
+#endif
+
 static int grep_file(FILE *file)
 {
 	smalluint found;
@@ -314,6 +761,9 @@ static int grep_file(FILE *file)
 	int nmatches = 0;
 #if !ENABLE_EXTRA_COMPAT
 	char *line;
+	size_t line_len;
+	struct line_buf lb;
+	const char *skip_literal = NULL;
 #else
 	char *line = NULL;
 	ssize_t line_len;
@@ -329,9 +779,21 @@ static int grep_file(FILE *file)
 	enum { print_n_lines_after = 0 };
 #endif
 
+#if !ENABLE_EXTRA_COMPAT
+	memset(&lb, 0, sizeof(lb));
+	lb.fd = fileno(file);
+	/* With one pattern, and no need to see non-matching lines,
+	 * jump straight to lines containing its literal part */
+	if (!invert_search
+	 && !pattern_head->link
+	 IF_FEATURE_GREP_CONTEXT(&& !lines_before && !lines_after)
+	) {
+		skip_literal = ((grep_list_data_t *)pattern_head->data)->literal;
+	}
+#endif
 	while (
 #if !ENABLE_EXTRA_COMPAT
-		(line = xmalloc_fgetline(file)) != NULL
+		(line = next_line(&lb, &line_len, skip_literal, &linenum)) != NULL
 #else
 		(line_len = bb_getline(&line, &line_alloc_len, file)) >= 0
 #endif
@@ -341,6 +803,12 @@ static int grep_file(FILE *file)
 
 		linenum++;
 		found = 0;
+#if ENABLE_FEATURE_GREP_FIXED_MULTI
+		if (fixed_ac) {
+			gl = ac_search(fixed_ac, line, line_len);
+			found = (gl != NULL);
+		} else
+#endif
 		while (pattern_ptr) {
 			gl = (grep_list_data_t *)pattern_ptr->data;
 			if (FGREP_FLAG) {
@@ -395,6 +863,9 @@ static int grep_file(FILE *file)
 #else
 				start_pos = 0;
 #endif
+				/* No literal part, no match */
+				if (gl->literal && !memmem(line, line_len, gl->literal, strlen(gl->literal)))
+					goto no_match;
 				match_at = line;
  opt_w_again:
 //bb_error_msg("'%s' start_pos:%d line_len:%d", match_at, start_pos, line_len);
@@ -445,6 +916,7 @@ static int grep_file(FILE *file)
 					}
 				}
 			}
+ no_match:
 			/* If it's non-inverted search, we can stop
 			 * at first match */
 			if (found && !invert_search)
@@ -459,7 +931,11 @@ static int grep_file(FILE *file)
 
 			/* quiet/print (non)matching file names only? */
 			if (option_mask32 & (OPT_q|OPT_l|OPT_L)) {
+#if !ENABLE_EXTRA_COMPAT
+				free(lb.buf);
+#else
 				free(line); /* we don't need line anymore */
+#endif
 				if (BE_QUIET) {
 					/* manpage says about -q:
 					 * "exit immediately with zero status
@@ -561,18 +1037,20 @@ static int grep_file(FILE *file)
 			} else if (lines_before) {
 				/* Add the line to the circular 'before' buffer */
 				free(before_buf[curpos]);
+#if !ENABLE_EXTRA_COMPAT
+				/* line is in the read buffer */
+				before_buf[curpos] = xstrdup(line);
+#else
 				before_buf[curpos] = line;
-				IF_EXTRA_COMPAT(before_buf_size[curpos] = line_len;)
-				curpos = (curpos + 1) % lines_before;
+				before_buf_size[curpos] = line_len;
 				/* avoid free(line) - we took the line */
 				line = NULL;
+#endif
+				curpos = (curpos + 1) % lines_before;
 			}
 		}
 
 #endif /* ENABLE_FEATURE_GREP_CONTEXT */
-#if !ENABLE_EXTRA_COMPAT
-		free(line);
-#endif
 		/* Did we print all context after last requested match? */
 		if ((option_mask32 & OPT_m)
 		 && !print_n_lines_after
@@ -581,6 +1059,9 @@ static int grep_file(FILE *file)
 			break;
 		}
 	} /* while (read line) */
+#if !ENABLE_EXTRA_COMPAT
+	free(lb.buf);
+#endif
 
 	/* special-case file post-processing for options where we don't print line
 	 * matches, just filenames and possibly match counts */
@@ -778,6 +1259,28 @@ int grep_main(int argc UNUSED_PARAM, char **argv)
 		llist_add_to(&pattern_head, pattern);
 	}
 
+#if ENABLE_FEATURE_GREP_FIXED_MULTI
+	if (FGREP_FLAG && pattern_head->link)
+		fixed_ac = build_fixed_ac();
+#endif
+	/* -i makes literals useless for memmem/strstr */
+	if (!(option_mask32 & OPT_i)) {
+		llist_t *cur;
+		for (cur = pattern_head; cur; cur = cur->link) {
+			grep_list_data_t *gl = (grep_list_data_t *)cur->data;
+			if (FGREP_FLAG)
+				gl->literal = gl->pattern[0] ? gl->pattern : NULL;
+			else
+				gl->literal = required_literal(gl->pattern,
+# if !ENABLE_EXTRA_COMPAT
+						reflags & REG_EXTENDED
+# else
+						reflags & RE_NO_BK_PARENS
+# endif
+				);
+		}
+	}
+
 	/* argv[0..(argc-1)] should be names of file to grep through. If
 	 * there is more than one file to grep, we will print the filenames. */
 	if (argv[0] && argv[1])
@@ -831,9 +1334,19 @@ int grep_main(int argc UNUSED_PARAM, char **argv)
 				free(gl->pattern);
 			if (gl->flg_mem_alocated_compiled & COMPILED)
 				regfree(&gl->compiled_regex);
+			if (gl->literal != gl->pattern)
+				free(gl->literal);
 			free(gl);
 			free(pattern_head_ptr);
 		}
+#if ENABLE_FEATURE_GREP_FIXED_MULTI
+		if (fixed_ac) {
+			free(fixed_ac->node);
+			free(fixed_ac->edge);
+			free(fixed_ac->pat);
+			free(fixed_ac);
+		}
+#endif
 	}
 	/* 0 = success, 1 = failed, 2 = error */
 	if (open_errors)
@@ -53,6 +53,15 @@
 //config:	  Support -0: input items are terminated by a NUL character
 //config:	  instead of whitespace, and the quotes and backslash
 //config:	  are not special.
+//config:
+//config:config FEATURE_XARGS_SUPPORT_PARALLEL
+//config:	bool "Enable -P N: run up to N commands in parallel"
+//config:	default y
+//config:	depends on XARGS
+//config:	help
+//config:	  Support -P N: run up to N command lines at once,
+//config:	  -P 0 runs one per CPU. With long options enabled,
+//config:	  --process-slot-var=VAR is also supported.
 
 //applet:IF_XARGS(APPLET_NOEXEC(xargs, xargs, BB_DIR_USR_BIN, BB_SUID_DROP, xargs))
 
@@ -80,6 +89,9 @@
 # ifndef ENABLE_FEATURE_XARGS_SUPPORT_ZERO_TERM
 #  define ENABLE_FEATURE_XARGS_SUPPORT_ZERO_TERM 1
 # endif
+# ifndef ENABLE_FEATURE_XARGS_SUPPORT_PARALLEL
+#  define ENABLE_FEATURE_XARGS_SUPPORT_PARALLEL 1
+# endif
 #endif
 
 
@@ -87,6 +99,13 @@ struct globals {
 	char **args;
 	const char *eof_str;
 	int idx;
+#if ENABLE_FEATURE_XARGS_SUPPORT_PARALLEL
+	unsigned max_procs;
+	unsigned running_procs;
+	pid_t *slot_pid;       /* [max_procs], 0: slot is free */
+	const char *slot_var;  /* --process-slot-var */
+	int exitcode;          /* 123 if some child failed, else 0 */
+#endif
 } FIX_ALIASING;
 #define G (*(struct globals*)&bb_common_bufsiz1)
 #define INIT_G() do { \
@@ -94,15 +113,10 @@ struct globals {
 } while (0)
 
 
-/*
- * This function has special algorithm.
- * Don't use fork and include to main!
- */
-static int xargs_exec(void)
+/* Convert child's status (or -1 if it could not be run)
+ * to xargs exit code */
+static int xargs_status(int status)
 {
-	int status;
-
-	status = spawn_and_wait(G.args);
 	if (status < 0) {
 		bb_simple_perror_msg(G.args[0]);
 		return errno == ENOENT ? 127 : 126;
@@ -121,6 +135,89 @@ static int xargs_exec(void)
 	return 0;
 }
 
+#if ENABLE_FEATURE_XARGS_SUPPORT_PARALLEL
+/* Wait for one child to finish (or just check, if !block)
+ * and free its slot. Returns -1 if there was nothing to reap,
+ * else xargs exit code for that child.
+ */
+static int reap_child(int block)
+{
+	int wstat;
+	unsigned i;
+	pid_t pid;
+
+	pid = safe_waitpid(-1, &wstat, block ? 0 : WNOHANG);
+	if (pid <= 0)
+		return -1;
+	for (i = 0; i < G.max_procs; i++) {
+		if (G.slot_pid[i] == pid) {
+			G.slot_pid[i] = 0;
+			G.running_procs--;
+			return xargs_status(WIFSIGNALED(wstat)
+				? 0x180 + WTERMSIG(wstat)
+				: WEXITSTATUS(wstat));
+		}
+	}
+	/* Not ours: sh -c 'sleep 1 & exec xargs ...' */
+	return 0;
+}
+
+/* Returns 0 or 123 if started the child, other codes mean "stop now" */
+static int xargs_exec_parallel(void)
+{
+	int status;
+	unsigned i;
+	pid_t pid;
+
+	/* Collect everyone who is done, wait for a free slot if none */
+	while ((status = reap_child(G.running_procs >= G.max_procs)) >= 0) {
+		if (status == 123)
+			G.exitcode = 123;
+		else if (status != 0)
+			return status;
+	}
+
+	for (i = 0; G.slot_pid[i]; i++)
+		continue;
+	if (G.slot_var)
+		xsetenv(G.slot_var, utoa(i));
+	pid = spawn(G.args);
+	if (pid < 0)
+		return xargs_status(-1);
+	G.slot_pid[i] = pid;
+	G.running_procs++;
+	return G.exitcode;
+}
+
+/* Wait for all running children, return the worst exit code */
+static int xargs_wait_all(int child_error)
+{
+	while (G.running_procs != 0) {
+		int status = reap_child(1);
+		if (status < 0)
+			break;
+		if (status == 123)
+			G.exitcode = 123;
+		else if (status != 0 && (child_error == 0 || child_error == 123))
+			child_error = status;
+	}
+	return child_error ? child_error : G.exitcode;
+}
+#endif
+
+/*
+ * This function has special algorithm.
+ * Don't use fork and include to main!
+ */
+static int xargs_exec(void)
+{
+#if ENABLE_FEATURE_XARGS_SUPPORT_PARALLEL
+	if (G.max_procs > 1)
+		return xargs_exec_parallel();
+#endif
+	return xargs_status(spawn_and_wait(G.args));
+}
+
 /* In POSIX/C locale isspace is only these chars: "\t\n\v\f\r" and space.
  * "\t\n\v\f\r" happen to have ASCII codes 9,10,11,12,13.
  */
@@ -363,6 +460,13 @@ static int xargs_ask_confirmation(void)
 //usage:	IF_FEATURE_XARGS_SUPPORT_TERMOPT(
 //usage:     "\n	-x	Exit if size is exceeded"
 //usage:	)
+//usage:	IF_FEATURE_XARGS_SUPPORT_PARALLEL(
+//usage:     "\n	-P N	Run up to N PROGs in parallel (0: one per CPU)"
+//usage:	IF_LONG_OPTS(
+//usage:     "\n	--process-slot-var=VAR"
+//usage:     "\n		Set VAR to slot number (0..N-1) in each PROG's environment"
+//usage:	)
+//usage:	)
 //usage:#define xargs_example_usage
 //usage:       "$ ls | xargs gzip\n"
 //usage:       "$ find . -name '*.c' -print | xargs rm\n"
@@ -378,6 +482,8 @@ enum {
 	IF_FEATURE_XARGS_SUPPORT_CONFIRMATION(OPTBIT_INTERACTIVE,)
 	IF_FEATURE_XARGS_SUPPORT_TERMOPT(     OPTBIT_TERMINATE  ,)
 	IF_FEATURE_XARGS_SUPPORT_ZERO_TERM(   OPTBIT_ZEROTERM   ,)
+	IF_FEATURE_XARGS_SUPPORT_PARALLEL(    OPTBIT_PARALLEL   ,)
+	IF_FEATURE_XARGS_SUPPORT_PARALLEL(    OPTBIT_SLOT_VAR   ,)
 
 	OPT_VERBOSE     = 1 << OPTBIT_VERBOSE    ,
 	OPT_NO_EMPTY    = 1 << OPTBIT_NO_EMPTY   ,
@@ -388,11 +494,14 @@ enum {
 	OPT_INTERACTIVE = IF_FEATURE_XARGS_SUPPORT_CONFIRMATION((1 << OPTBIT_INTERACTIVE)) + 0,
 	OPT_TERMINATE   = IF_FEATURE_XARGS_SUPPORT_TERMOPT(     (1 << OPTBIT_TERMINATE  )) + 0,
 	OPT_ZEROTERM    = IF_FEATURE_XARGS_SUPPORT_ZERO_TERM(   (1 << OPTBIT_ZEROTERM   )) + 0,
+	OPT_PARALLEL    = IF_FEATURE_XARGS_SUPPORT_PARALLEL(    (1 << OPTBIT_PARALLEL   )) + 0,
+	OPT_SLOT_VAR    = IF_FEATURE_XARGS_SUPPORT_PARALLEL(    (1 << OPTBIT_SLOT_VAR   )) + 0, /* long only */
 };
 #define OPTION_STR "+trn:s:e::E:" \
 	IF_FEATURE_XARGS_SUPPORT_CONFIRMATION("p") \
 	IF_FEATURE_XARGS_SUPPORT_TERMOPT(     "x") \
-	IF_FEATURE_XARGS_SUPPORT_ZERO_TERM(   "0")
+	IF_FEATURE_XARGS_SUPPORT_ZERO_TERM(   "0") \
+	IF_FEATURE_XARGS_SUPPORT_PARALLEL(    "P:")
 
 int xargs_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int xargs_main(int argc, char **argv)
@@ -401,6 +510,9 @@ int xargs_main(int argc, char **argv)
 	int child_error = 0;
 	char *max_args;
 	char *max_chars;
+#if ENABLE_FEATURE_XARGS_SUPPORT_PARALLEL
+	char *max_procs = (char*)"1";
+#endif
 	char *buf;
 	unsigned opt;
 	int n_max_chars;
@@ -413,13 +525,16 @@ int xargs_main(int argc, char **argv)
 
 	INIT_G();
 
-#if ENABLE_DESKTOP && ENABLE_LONG_OPTS
-	/* For example, Fedora's build system uses --no-run-if-empty */
+#if (ENABLE_DESKTOP || ENABLE_FEATURE_XARGS_SUPPORT_PARALLEL) && ENABLE_LONG_OPTS
 	applet_long_options =
-		"no-run-if-empty\0" No_argument "r"
+		/* For example, Fedora's build system uses --no-run-if-empty */
+		IF_DESKTOP("no-run-if-empty\0" No_argument "r")
+		IF_FEATURE_XARGS_SUPPORT_PARALLEL("process-slot-var\0" Required_argument "\xff")
 		;
 #endif
-	opt = getopt32(argv, OPTION_STR, &max_args, &max_chars, &G.eof_str, &G.eof_str);
+	opt = getopt32(argv, OPTION_STR, &max_args, &max_chars, &G.eof_str, &G.eof_str
+		IF_FEATURE_XARGS_SUPPORT_PARALLEL(, &max_procs, &G.slot_var)
+	);
 
 	/* -E ""? You may wonder why not just omit -E?
 	 * This is used for portability:
@@ -430,6 +545,20 @@ int xargs_main(int argc, char **argv)
 	if (opt & OPT_ZEROTERM)
 		IF_FEATURE_XARGS_SUPPORT_ZERO_TERM(read_args = process0_stdin);
 
+#if ENABLE_FEATURE_XARGS_SUPPORT_PARALLEL
+	G.max_procs = xatou_range(max_procs, 0, 64 * 1024);
+	if (G.max_procs == 0) {
+		G.max_procs = get_cpu_count();
+		if (G.max_procs == 0) /* non-SMP kernel */
+			G.max_procs = 1;
+	}
+	G.slot_pid = xzalloc(G.max_procs * sizeof(G.slot_pid[0]));
+	G.running_procs = 0;
+	G.exitcode = 0;
+	if (!(opt & OPT_SLOT_VAR))
+		G.slot_var = NULL; /* need to clear by hand because we are NOEXEC applet */
+#endif
+
 	argv += optind;
 	argc -= optind;
 	if (!argv[0]) {
@@ -538,7 +667,12 @@ int xargs_main(int argc, char **argv)
 		overlapping_strcpy(buf, rem);
 	} /* while */
 
+#if ENABLE_FEATURE_XARGS_SUPPORT_PARALLEL
+	child_error = xargs_wait_all(child_error);
+#endif
+
 	if (ENABLE_FEATURE_CLEAN_UP) {
+		IF_FEATURE_XARGS_SUPPORT_PARALLEL(free(G.slot_pid);)
 		free(G.args);
 		free(buf);
 	}
@@ -44,6 +44,7 @@ typedef struct file_header_t {
 } file_header_t;
 
 struct hardlinks_t;
+struct extract_pool;
 
 typedef struct archive_handle_t {
 	/* Flags. 1st since it is most used member */
@@ -92,6 +93,9 @@ typedef struct archive_handle_t {
 # if ENABLE_FEATURE_TAR_SELINUX
 	char* tar__sctx[2];
 # endif
+# if ENABLE_FEATURE_TAR_PARALLEL_EXTRACT
+	struct extract_pool *tar__pool;
+# endif
 #endif
 #if ENABLE_CPIO || ENABLE_RPM2CPIO || ENABLE_RPM
 	uoff_t cpio__blocks;
@@ -176,6 +180,11 @@ void data_skip(archive_handle_t *archive_handle) FAST_FUNC;
 void data_extract_all(archive_handle_t *archive_handle) FAST_FUNC;
 void data_extract_to_stdout(archive_handle_t *archive_handle) FAST_FUNC;
 void data_extract_to_command(archive_handle_t *archive_handle) FAST_FUNC;
+#if ENABLE_FEATURE_TAR_PARALLEL_EXTRACT
+void data_extract_parallel(archive_handle_t *archive_handle) FAST_FUNC;
+void start_extract_workers(archive_handle_t *archive_handle, unsigned nprocs) FAST_FUNC;
+int finish_extract_workers(archive_handle_t *archive_handle) FAST_FUNC;
+#endif
 
 void header_skip(const file_header_t *file_header) FAST_FUNC;
 void header_list(const file_header_t *file_header) FAST_FUNC;
@@ -205,6 +214,27 @@ int start_bunzip(bunzip_data **bdp, int in_fd, const void *inbuf, int len) FAST_
 int read_bunzip(bunzip_data *bd, char *outbuf, int len) FAST_FUNC;
 void dealloc_bunzip(bunzip_data *bd) FAST_FUNC;
 
+#if ENABLE_FEATURE_GUNZIP_INDEX
+/* Random access to gzip files, see gunzip --index.
+ * While building, every 'span' bytes of output a checkpoint is
+ * appended to build_fd: uncompressed offset (LE64), compressed
+ * offset in bits (LE64) and the GZ_INDEX_WINDOW bytes of output
+ * preceding it. Input must be a regular file. */
+enum { GZ_INDEX_WINDOW = 32 * 1024 };
+typedef struct gz_index_t {
+	int   build_fd;         /* >= 0: append checkpoints to this fd */
+	off_t span;
+	off_t start_bit;        /* > 0: resume at this compressed bit offset, */
+	off_t start_out;        /* which is this uncompressed offset, */
+	unsigned char *window;  /* after these GZ_INDEX_WINDOW bytes */
+	off_t skip;             /* discard this many bytes of output, */
+	off_t limit;            /* then write at most this many (< 0: all) */
+	off_t pwrite_pos;       /* >= 0: pwrite() output there, not write() */
+	off_t out_total;        /* set on exit: uncompressed size */
+	off_t next_point;       /* private to decompressor */
+} gz_index_t;
+#endif
+
 /* Meaning and direction (input/output) of the fields are transformer-specific */
 typedef struct transformer_aux_data_t {
 	smallint check_signature; /* most often referenced member */
@@ -212,17 +242,35 @@ typedef struct transformer_aux_data_t {
 	off_t    bytes_in;  /* used in unzip code only: needs to know packed size */
 	uint32_t crc32;
 	time_t   mtime;     /* gunzip code may set this on exit */
+#if ENABLE_FEATURE_GUNZIP_INDEX
+	gz_index_t *gz_index; /* gunzip only */
+#endif
+	/* If mem_output_size_max != 0, output goes not to dst_fd but
+	 * to malloced mem_output_buf (NUL terminated), and whatever does
+	 * not fit in mem_output_size_max is discarded */
+	size_t   mem_output_size_max;
+	size_t   mem_output_size;
+	size_t   mem_output_alloc;
+	char    *mem_output_buf;
 } transformer_aux_data_t;
 
 void init_transformer_aux_data(transformer_aux_data_t *aux) FAST_FUNC;
 int FAST_FUNC check_signature16(transformer_aux_data_t *aux, int src_fd, unsigned magic16) FAST_FUNC;
+/* Unpackers write their output with these: */
+ssize_t transformer_write(transformer_aux_data_t *aux, int dst_fd, const void *buf, size_t bufsize) FAST_FUNC;
 
 IF_DESKTOP(long long) int inflate_unzip(transformer_aux_data_t *aux, int src_fd, int dst_fd) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_Z_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_gz_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_bz2_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd) FAST_FUNC;
+#if ENABLE_FEATURE_BUNZIP2_PARALLEL
+IF_DESKTOP(long long) int unpack_bz2_stream_parallel(transformer_aux_data_t *aux, int src_fd, int dst_fd, unsigned nprocs) FAST_FUNC;
+#endif
 IF_DESKTOP(long long) int unpack_lzma_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_xz_stream(transformer_aux_data_t *aux, int src_fd, int dst_fd) FAST_FUNC;
+#if ENABLE_FEATURE_UNXZ_PARALLEL
+IF_DESKTOP(long long) int unpack_xz_stream_parallel(transformer_aux_data_t *aux, int src_fd, int dst_fd, unsigned nprocs) FAST_FUNC;
+#endif
 
 char* append_ext(char *filename, const char *expected_ext) FAST_FUNC;
 int bbunpack(char **argv,
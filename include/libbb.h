@@ -730,6 +730,41 @@ void *xrealloc(void *old, size_t size) FAST_FUNC;
 	xrealloc_vector_helper((vector), (sizeof((vector)[0]) << 8) + (shift), (idx))
 void* xrealloc_vector_helper(void *vector, unsigned sizeof_and_shift, int idx) FAST_FUNC;
 
+/* Region allocator (libbb/region.c): allocations are never moved,
+ * everything allocated after region_mark() is freed by region_release().
+ * Free space of the current chunk is [next, end): callers may build
+ * a string there and region_reserve() more room as needed.
+ * Zero-initialized region_t is an empty region. Functions return NULL
+ * if out of memory. */
+#define REGION_ALIGN(n) \
+	(((n) + sizeof(union { void *p; long long ll; double d; }) - 1) \
+	& ~(sizeof(union { void *p; long long ll; double d; }) - 1))
+typedef struct region {
+	char *next;
+	char *end;
+	struct region_chunk *chunk;
+	struct region_chunk *spare;
+	unsigned nspare;
+	/* For region_take_stats() */
+	unsigned long peak;
+	unsigned long released;
+	unsigned long stats_base;
+} region_t;
+typedef struct region_mark {
+	struct region_chunk *chunk;
+	char *next;
+} region_mark_t;
+static ALWAYS_INLINE void region_mark(region_t *r, region_mark_t *m)
+{
+	m->chunk = r->chunk;
+	m->next = r->next;
+}
+char *region_reserve(region_t *r, size_t size, size_t keep) FAST_FUNC;
+void *region_alloc(region_t *r, size_t size) FAST_FUNC;
+void *region_realloc(region_t *r, void *p, size_t oldsize, size_t size) FAST_FUNC;
+void region_release(region_t *r, const region_mark_t *m) FAST_FUNC;
+void region_take_stats(region_t *r, unsigned long *peak, unsigned long *total) FAST_FUNC;
+
 
 extern ssize_t safe_read(int fd, void *buf, size_t count) FAST_FUNC;
 extern ssize_t nonblock_immune_read(int fd, void *buf, size_t count, int loop_on_EINTR) FAST_FUNC;
@@ -8,6 +8,66 @@
  */
 
 #include "libbb.h"
+#if ENABLE_FEATURE_USE_SENDFILE
+# include <sys/sendfile.h>
+# include <sys/syscall.h>
+#endif
+
+#if ENABLE_FEATURE_USE_SENDFILE
+/* Kernel-side copy: data never enters our address space.
+ * Which call can be used depends on what the descriptors are:
+ * copy_file_range() wants two regular files (and may share extents
+ * or do server-side copy), splice() wants a pipe on at least one side,
+ * sendfile() wants an mmap-able source and takes anything as destination.
+ * When a call refuses (old kernel, cross-fs, O_APPEND, tty...)
+ * we step down the list, and the read/write loop is the last resort.
+ */
+enum {
+	OFFLOAD_NONE = 0,
+	OFFLOAD_SENDFILE,
+	OFFLOAD_SPLICE,
+	OFFLOAD_COPY_FILE_RANGE,
+};
+
+/* Limit a single call, otherwise ^C during copy of a huge file
+ * is noticeably delayed. Must be >= max(CONFIG_FEATURE_COPYBUF_KB)
+ * or else "copy until eof" would use needlessly short reads. */
+#define OFFLOAD_CHUNK (16 * 1024 * 1024)
+
+static int pick_offload(int src_fd, int dst_fd)
+{
+	struct stat src_st, dst_st;
+
+	if (dst_fd < 0
+	 || fstat(src_fd, &src_st) != 0
+	 || fstat(dst_fd, &dst_st) != 0
+	) {
+		return OFFLOAD_NONE;
+	}
+	if (S_ISFIFO(src_st.st_mode) || S_ISFIFO(dst_st.st_mode))
+		return OFFLOAD_SPLICE;
+	if (!S_ISREG(src_st.st_mode))
+		return OFFLOAD_NONE;
+#ifdef __NR_copy_file_range
+	if (S_ISREG(dst_st.st_mode))
+		return OFFLOAD_COPY_FILE_RANGE;
+#endif
+	return OFFLOAD_SENDFILE;
+}
+
+static ssize_t offload_copy(int method, int src_fd, int dst_fd, size_t len)
+{
+	if (len > OFFLOAD_CHUNK)
+		len = OFFLOAD_CHUNK;
+#ifdef __NR_copy_file_range
+	if (method == OFFLOAD_COPY_FILE_RANGE)
+		return syscall(__NR_copy_file_range, src_fd, NULL, dst_fd, NULL, len, 0);
+#endif
+	if (method == OFFLOAD_SPLICE)
+		return splice(src_fd, NULL, dst_fd, NULL, len, SPLICE_F_MOVE);
+	return sendfile(dst_fd, src_fd, NULL, len);
+}
+#endif
 
 /* Used by NOFORK applets (e.g. cat) - must not use xmalloc.
  * size < 0 means "ignore write errors", used by tar --to-command
@@ -18,6 +78,9 @@ static off_t bb_full_fd_action(int src_fd, int dst_fd, off_t size)
 	int status = -1;
 	off_t total = 0;
 	bool continue_on_write_error = 0;
+#if ENABLE_FEATURE_USE_SENDFILE
+	int offload;
+#endif
 #if CONFIG_FEATURE_COPYBUF_KB <= 4
 	char buffer[CONFIG_FEATURE_COPYBUF_KB * 1024];
 	enum { buffer_size = sizeof(buffer) };
@@ -31,6 +94,40 @@ static off_t bb_full_fd_action(int src_fd, int dst_fd, off_t size)
 		continue_on_write_error = 1;
 	}
 
+	if (src_fd < 0)
+		return -1;
+
+#if ENABLE_FEATURE_USE_SENDFILE
+	/* With offload we can't tell read errors from write errors,
+	 * so "ignore write errors" mode always goes through the buffer */
+	offload = continue_on_write_error ? OFFLOAD_NONE : pick_offload(src_fd, dst_fd);
+	while (offload != OFFLOAD_NONE) {
+		ssize_t rd = offload_copy(offload, src_fd, dst_fd,
+				(size == 0 || size > OFFLOAD_CHUNK) ? OFFLOAD_CHUNK : size);
+		if (rd > 0) {
+			total += rd;
+			if (size != 0) {
+				size -= rd;
+				if (size == 0)
+					return total;
+			}
+			continue;
+		}
+		if (rd < 0 && errno == EINTR)
+			continue;
+		/* rd == 0: probably eof, but e.g. copy_file_range() returns 0
+		 * for /proc and /sys files on some kernels. Let read() decide.
+		 * rd < 0: kernel refused, try the next method. Any real I/O
+		 * error will be hit (and reported) again by the loop below.
+		 */
+		if (rd < 0 && offload == OFFLOAD_COPY_FILE_RANGE) {
+			offload = OFFLOAD_SENDFILE;
+			continue;
+		}
+		break;
+	}
+#endif
+
 #if CONFIG_FEATURE_COPYBUF_KB > 4
 	if (size > 0 && size <= 4 * 1024)
 		goto use_small_buf;
@@ -48,9 +145,6 @@ static off_t bb_full_fd_action(int src_fd, int dst_fd, off_t size)
 	}
 #endif
 
-	if (src_fd < 0)
-		goto out;
-
 	if (!size) {
 		size = buffer_size;
 		status = 1; /* copy until eof */
@@ -90,7 +184,6 @@ static off_t bb_full_fd_action(int src_fd, int dst_fd, off_t size)
 			}
 		}
 	}
- out:
 
 #if CONFIG_FEATURE_COPYBUF_KB > 4
 	if (buffer_size != 4 * 1024)
@@ -20,14 +20,26 @@
 
 uint32_t *global_crc32_table;
 
+/* With CRC32_SMALL=0, tables allocated by crc32_filltable(NULL, endian)
+ * are 8 * 256 entries long: k-th 256-entry slice gives the CRC
+ * of a byte followed by k zero bytes. crc32_block_endianN() use it
+ * to process 8 bytes per step ("slice-by-8").
+ * Tables filled in caller-supplied memory are 256 entries long
+ * and are only good for byte-at-a-time CRC updates.
+ */
+#define CRC32_SLICES (CONFIG_CRC32_SMALL ? 1 : 8)
+
 uint32_t* FAST_FUNC crc32_filltable(uint32_t *crc_table, int endian)
 {
 	uint32_t polynomial = endian ? 0x04c11db7 : 0xedb88320;
 	uint32_t c;
 	int i, j;
+	int slices = 1;
 
-	if (!crc_table)
-		crc_table = xmalloc(256 * sizeof(uint32_t));
+	if (!crc_table) {
+		crc_table = xmalloc(CRC32_SLICES * 256 * sizeof(uint32_t));
+		slices = CRC32_SLICES;
+	}
 
 	for (i = 0; i < 256; i++) {
 		c = endian ? (i << 24) : i;
@@ -37,30 +49,69 @@ uint32_t* FAST_FUNC crc32_filltable(uint32_t *crc_table, int endian)
 			else
 				c = (c&1) ? ((c >> 1) ^ polynomial) : (c >> 1);
 		}
-		*crc_table++ = c;
+		crc_table[i] = c;
+	}
+	for (i = 256; i < slices * 256; i++) {
+		c = crc_table[i - 256];
+		if (endian)
+			crc_table[i] = (c << 8) ^ crc_table[c >> 24];
+		else
+			crc_table[i] = (c >> 8) ^ crc_table[(uint8_t)c];
 	}
 
-	return crc_table - 256;
+	return crc_table;
 }
 
 uint32_t FAST_FUNC crc32_block_endian1(uint32_t val, const void *buf, unsigned len, uint32_t *crc_table)
 {
-	const void *end = (uint8_t*)buf + len;
+	const uint8_t *p = buf;
+	const uint8_t *end = p + len;
 
-	while (buf != end) {
-		val = (val << 8) ^ crc_table[(val >> 24) ^ *(uint8_t*)buf];
-		buf = (uint8_t*)buf + 1;
+#if CRC32_SLICES == 8
+	while (end - p >= 8) {
+		val ^= ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+			| ((uint32_t)p[2] << 8) | p[3];
+		val = crc_table[7*256 + (val >> 24)]
+			^ crc_table[6*256 + (uint8_t)(val >> 16)]
+			^ crc_table[5*256 + (uint8_t)(val >> 8)]
+			^ crc_table[4*256 + (uint8_t)val]
+			^ crc_table[3*256 + p[4]]
+			^ crc_table[2*256 + p[5]]
+			^ crc_table[1*256 + p[6]]
+			^ crc_table[0*256 + p[7]];
+		p += 8;
+	}
+#endif
+	while (p != end) {
+		val = (val << 8) ^ crc_table[(val >> 24) ^ *p];
+		p++;
 	}
 	return val;
 }
 
 uint32_t FAST_FUNC crc32_block_endian0(uint32_t val, const void *buf, unsigned len, uint32_t *crc_table)
 {
-	const void *end = (uint8_t*)buf + len;
+	const uint8_t *p = buf;
+	const uint8_t *end = p + len;
 
-	while (buf != end) {
-		val = crc_table[(uint8_t)val ^ *(uint8_t*)buf] ^ (val >> 8);
-		buf = (uint8_t*)buf + 1;
+#if CRC32_SLICES == 8
+	while (end - p >= 8) {
+		val ^= p[0] | ((uint32_t)p[1] << 8)
+			| ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+		val = crc_table[7*256 + (uint8_t)val]
+			^ crc_table[6*256 + (uint8_t)(val >> 8)]
+			^ crc_table[5*256 + (uint8_t)(val >> 16)]
+			^ crc_table[4*256 + (val >> 24)]
+			^ crc_table[3*256 + p[4]]
+			^ crc_table[2*256 + p[5]]
+			^ crc_table[1*256 + p[6]]
+			^ crc_table[0*256 + p[7]];
+		p += 8;
+	}
+#endif
+	while (p != end) {
+		val = crc_table[(uint8_t)val ^ *p] ^ (val >> 8);
+		p++;
 	}
 	return val;
 }
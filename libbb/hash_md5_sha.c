@@ -9,6 +9,16 @@
 
 #include "libbb.h"
 
+#if (ENABLE_SHA1_HWACCEL || ENABLE_SHA256_HWACCEL) \
+ && (defined(__x86_64__) || defined(__i386__)) \
+ && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+# define SHA_NI 1
+# include <cpuid.h>
+# include <immintrin.h>
+#else
+# define SHA_NI 0
+#endif
+
 /* gcc 4.2.1 optimizes rotr64 better with inline than with macro
  * (for rotX32, there is no difference). Why? My guess is that
  * macro requires clever common subexpression elimination heuristics
@@ -746,6 +756,128 @@ static void FAST_FUNC sha512_process_block128(sha512_ctx_t *ctx)
 }
 
 
+#if SHA_NI
+/* x86 SHA extensions (Intel Goldmont+, Ice Lake+, AMD Zen+).
+ * Processing of one block is done in xmm registers; the message schedule
+ * and rounds are computed by sha1msg1/2, sha1rnds4, sha256msg1/2,
+ * sha256rnds2 instructions. Presence is detected at runtime.
+ */
+#define SHA_NI_FUNC __attribute__((target("sha,ssse3,sse4.1")))
+
+/* 1: have SHA-NI, -1: don't have, 0: not checked yet */
+static smallint have_sha_ni;
+
+static int check_sha_ni(void)
+{
+	unsigned eax, ebx, ecx, edx;
+
+	have_sha_ni = -1;
+	if (__get_cpuid_max(0, NULL) >= 7) {
+		__cpuid(1, eax, ebx, ecx, edx);
+		/* SSSE3 and SSE4.1 */
+		if ((ecx & ((1 << 9) | (1 << 19))) == ((1 << 9) | (1 << 19))) {
+			__cpuid_count(7, 0, eax, ebx, ecx, edx);
+			if (ebx & (1 << 29))
+				have_sha_ni = 1;
+		}
+	}
+	return have_sha_ni;
+}
+# define sha_ni_available() \
+	(have_sha_ni ? have_sha_ni > 0 : check_sha_ni() > 0)
+#endif
+
+#if SHA_NI && ENABLE_SHA1_HWACCEL
+static void FAST_FUNC SHA_NI_FUNC sha1_process_block64_shaNI(sha1_ctx_t *ctx)
+{
+	/* Reverses all 16 bytes: W[0] is in the top dword */
+	const __m128i MASK = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i W[4];
+	__m128i E[2];
+	__m128i ABCD, ABCD_SAVE, E0_SAVE, e;
+	unsigned g;
+
+	for (g = 0; g < 4; g++)
+		W[g] = _mm_shuffle_epi8(_mm_loadu_si128((void*)(ctx->wbuffer + g * 16)), MASK);
+	ABCD = _mm_shuffle_epi32(_mm_loadu_si128((void*)ctx->hash), 0x1B);
+	E[0] = _mm_set_epi32(ctx->hash[4], 0, 0, 0);
+	ABCD_SAVE = ABCD;
+	E0_SAVE = E[0];
+
+	/* 20 groups of 4 rounds. W[g % 4] is the message for group g,
+	 * it is computed from the previous ones while groups g-4..g-1 run */
+	for (g = 0; g < 20; g++) {
+		__m128i M = W[g & 3];
+
+		e = (g == 0) ? _mm_add_epi32(E[0], M) : _mm_sha1nexte_epu32(E[g & 1], M);
+		E[(g & 1) ^ 1] = ABCD;
+		/* Round function selector must be an immediate */
+		switch (g / 5) {
+		case 0: ABCD = _mm_sha1rnds4_epu32(ABCD, e, 0); break;
+		case 1: ABCD = _mm_sha1rnds4_epu32(ABCD, e, 1); break;
+		case 2: ABCD = _mm_sha1rnds4_epu32(ABCD, e, 2); break;
+		default: ABCD = _mm_sha1rnds4_epu32(ABCD, e, 3); break;
+		}
+		if (g >= 3 && g <= 18)
+			W[(g + 1) & 3] = _mm_sha1msg2_epu32(W[(g + 1) & 3], M);
+		if (g >= 2 && g <= 17)
+			W[(g + 2) & 3] = _mm_xor_si128(W[(g + 2) & 3], M);
+		if (g >= 1 && g <= 16)
+			W[(g + 3) & 3] = _mm_sha1msg1_epu32(W[(g + 3) & 3], M);
+	}
+
+	E[0] = _mm_sha1nexte_epu32(E[0], E0_SAVE);
+	ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+	_mm_storeu_si128((void*)ctx->hash, _mm_shuffle_epi32(ABCD, 0x1B));
+	ctx->hash[4] = _mm_extract_epi32(E[0], 3);
+}
+#endif
+
+#if SHA_NI && ENABLE_SHA256_HWACCEL
+static void FAST_FUNC SHA_NI_FUNC sha256_process_block64_shaNI(sha256_ctx_t *ctx)
+{
+	/* Byteswaps each dword */
+	const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i W[4];
+	__m128i STATE0, STATE1, ABEF_SAVE, CDGH_SAVE, TMP, M;
+	unsigned i;
+
+	for (i = 0; i < 4; i++)
+		W[i] = _mm_shuffle_epi8(_mm_loadu_si128((void*)(ctx->wbuffer + i * 16)), MASK);
+
+	/* Instructions want state as ABEF and CDGH */
+	TMP = _mm_shuffle_epi32(_mm_loadu_si128((void*)&ctx->hash[0]), 0xB1); /* CDAB */
+	STATE1 = _mm_shuffle_epi32(_mm_loadu_si128((void*)&ctx->hash[4]), 0x1B); /* EFGH */
+	STATE0 = _mm_alignr_epi8(TMP, STATE1, 8); /* ABEF */
+	STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0); /* CDGH */
+	ABEF_SAVE = STATE0;
+	CDGH_SAVE = STATE1;
+
+	/* 16 groups of 4 rounds, W[i % 4] holds message words 4*i..4*i+3 */
+	for (i = 0; i < 16; i++) {
+		if (i >= 4) {
+			TMP = _mm_alignr_epi8(W[(i + 3) & 3], W[(i + 2) & 3], 4);
+			TMP = _mm_add_epi32(_mm_sha256msg1_epu32(W[i & 3], W[(i + 1) & 3]), TMP);
+			W[i & 3] = _mm_sha256msg2_epu32(TMP, W[(i + 3) & 3]);
+		}
+		M = _mm_add_epi32(W[i & 3], _mm_set_epi32(
+				sha_K[i*4 + 3] >> 32, sha_K[i*4 + 2] >> 32,
+				sha_K[i*4 + 1] >> 32, sha_K[i*4 + 0] >> 32));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, M);
+		M = _mm_shuffle_epi32(M, 0x0E);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, M);
+	}
+
+	STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+	STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+	TMP = _mm_shuffle_epi32(STATE0, 0x1B); /* FEBA */
+	STATE1 = _mm_shuffle_epi32(STATE1, 0xB1); /* DCHG */
+	_mm_storeu_si128((void*)&ctx->hash[0], _mm_blend_epi16(TMP, STATE1, 0xF0)); /* DCBA */
+	_mm_storeu_si128((void*)&ctx->hash[4], _mm_alignr_epi8(STATE1, TMP, 8)); /* HGFE */
+}
+#endif
+
+
 void FAST_FUNC sha1_begin(sha1_ctx_t *ctx)
 {
 	ctx->hash[0] = 0x67452301;
@@ -755,6 +887,10 @@ void FAST_FUNC sha1_begin(sha1_ctx_t *ctx)
 	ctx->hash[4] = 0xc3d2e1f0;
 	ctx->total64 = 0;
 	ctx->process_block = sha1_process_block64;
+#if SHA_NI && ENABLE_SHA1_HWACCEL
+	if (sha_ni_available())
+		ctx->process_block = sha1_process_block64_shaNI;
+#endif
 }
 
 static const uint32_t init256[] = {
@@ -789,6 +925,10 @@ void FAST_FUNC sha256_begin(sha256_ctx_t *ctx)
 	memcpy(&ctx->total64, init256, sizeof(init256));
 	/*ctx->total64 = 0; - done by prepending two 32-bit zeros to init256 */
 	ctx->process_block = sha256_process_block64;
+#if SHA_NI && ENABLE_SHA256_HWACCEL
+	if (sha_ni_available())
+		ctx->process_block = sha256_process_block64_shaNI;
+#endif
 }
 
 /* Initialize structure containing state of computation.
@@ -858,7 +998,11 @@ void FAST_FUNC sha1_end(sha1_ctx_t *ctx, void *resbuf)
 	/* SHA stores total in BE, need to swap on LE arches: */
 	common64_end(ctx, /*swap_needed:*/ BB_LITTLE_ENDIAN);
 
-	hash_size = (ctx->process_block == sha1_process_block64) ? 5 : 8;
+	hash_size = (ctx->process_block == sha1_process_block64
+#if SHA_NI && ENABLE_SHA1_HWACCEL
+		|| ctx->process_block == sha1_process_block64_shaNI
+#endif
+		) ? 5 : 8;
 	/* This way we do not impose alignment constraints on resbuf: */
 	if (BB_LITTLE_ENDIAN) {
 		unsigned i;
@@ -0,0 +1,175 @@
+/* vi: set sw=4 ts=4: */
+/*
+ * Region (arena) allocator for short-lived, LIFO-ordered data,
+ * such as the words a shell builds while expanding one command.
+ *
+ * Memory is carved from chunks which are never reallocated, so data
+ * handed out stays put. Everything allocated after region_mark()
+ * is given back at once by region_release(). A few standard-sized
+ * chunks are kept around after release for reuse, unless the region
+ * becomes empty: an empty region holds no memory.
+ *
+ * Licensed under GPLv2 or later, see file LICENSE in this source tree.
+ */
+
+#include "libbb.h"
+
+struct region_chunk {
+	struct region_chunk *prev;
+	size_t size;
+	/* Bytes in use in all older chunks when this one was started */
+	unsigned long used_before;
+	union {
+		void *p;
+		long long ll;
+		double d;
+	} data[];
+};
+
+enum {
+	/* Size of a standard chunk, including malloc overhead (roughly) */
+	REGION_CHUNK = 4096 - sizeof(struct region_chunk) - 2 * sizeof(void*),
+	/* How many released standard chunks to keep for reuse */
+	REGION_SPARE = 8,
+};
+
+static unsigned long region_used(region_t *r)
+{
+	struct region_chunk *c = r->chunk;
+
+	if (!c)
+		return 0;
+	return c->used_before + (r->next - (char*)c->data);
+}
+
+/* Make at least 'size' bytes available at r->next.
+ * If they don't fit in the current chunk, a fresh one is started
+ * and 'keep' bytes at the old r->next are copied over to it.
+ * Returns the new r->next, or NULL if out of memory.
+ */
+char* FAST_FUNC region_reserve(region_t *r, size_t size, size_t keep)
+{
+	struct region_chunk *c;
+	char *old = r->next;
+
+	if (size <= (size_t)(r->end - old))
+		return old;
+
+	c = r->spare;
+	if (c && size <= c->size) {
+		r->spare = c->prev;
+		r->nspare--;
+	} else {
+		size_t sz = REGION_CHUNK;
+
+		if (sz < size) {
+			sz = REGION_ALIGN(size);
+			if (sz < size || sz + sizeof(*c) < sz)
+				return NULL;
+		}
+		c = malloc(sizeof(*c) + sz);
+		if (!c)
+			return NULL;
+		c->size = sz;
+	}
+	c->used_before = region_used(r);
+	c->prev = r->chunk;
+	r->chunk = c;
+	r->next = (char*)c->data;
+	r->end = r->next + c->size;
+	if (keep)
+		memcpy(r->next, old, keep);
+	return r->next;
+}
+
+void* FAST_FUNC region_alloc(region_t *r, size_t size)
+{
+	char *p;
+	size_t aligned = REGION_ALIGN(size);
+
+	if (aligned < size)
+		return NULL;
+	p = region_reserve(r, aligned, 0);
+	if (p)
+		r->next = p + aligned;
+	return p;
+}
+
+/* Like realloc, but the caller has to know the old size.
+ * The topmost allocation is grown in place when there is room.
+ */
+void* FAST_FUNC region_realloc(region_t *r, void *p, size_t oldsize, size_t size)
+{
+	char *q;
+	size_t aligned = REGION_ALIGN(size);
+
+	if (aligned < size)
+		return NULL;
+	if (p && (char*)p + REGION_ALIGN(oldsize) == r->next) {
+		r->next = p;
+		q = region_reserve(r, aligned, oldsize);
+		if (!q) {
+			r->next = (char*)p + REGION_ALIGN(oldsize);
+			return NULL;
+		}
+	} else {
+		q = region_reserve(r, aligned, 0);
+		if (!q)
+			return NULL;
+		if (p)
+			memcpy(q, p, oldsize < size ? oldsize : size);
+	}
+	r->next = q + aligned;
+	return q;
+}
+
+void FAST_FUNC region_release(region_t *r, const region_mark_t *m)
+{
+	struct region_chunk *c;
+	unsigned long used = region_used(r);
+	unsigned long now;
+
+	if (r->peak < used)
+		r->peak = used;
+
+	while ((c = r->chunk) != m->chunk) {
+		r->chunk = c->prev;
+		if (m->chunk && c->size == REGION_CHUNK && r->nspare < REGION_SPARE) {
+			c->prev = r->spare;
+			r->spare = c;
+			r->nspare++;
+		} else {
+			free(c);
+		}
+	}
+	r->next = m->next;
+	r->end = NULL;
+	if (c) {
+		r->end = (char*)c->data + c->size;
+	} else {
+		/* Emptied region keeps no memory */
+		while ((c = r->spare) != NULL) {
+			r->spare = c->prev;
+			free(c);
+		}
+		r->nspare = 0;
+	}
+
+	now = region_used(r);
+	if (used > now)
+		r->released += used - now;
+}
+
+/* Report peak and total bytes handed out since the previous call */
+void FAST_FUNC region_take_stats(region_t *r, unsigned long *peak, unsigned long *total)
+{
+	unsigned long used = region_used(r);
+
+	if (r->peak < used)
+		r->peak = used;
+	*peak = r->peak - r->stats_base;
+	*total = r->released + used - r->stats_base;
+
+	r->peak = r->stats_base = used;
+	r->released = 0;
+}
@@ -41,6 +41,9 @@
 #include <setjmp.h>
 #include <fnmatch.h>
 #include <sys/times.h>
+#if ENABLE_ASH_NOFORK_BACKQ
+# include <sys/syscall.h> /* __NR_memfd_create */
+#endif
 
 #include "busybox.h" /* for applet_names */
 #include "unicode.h"
@@ -185,6 +188,37 @@
 //config:	  This option recreates the prompt string from the environment
 //config:	  variable each time it is displayed.
 //config:
+//config:config ASH_VFORK
+//config:	bool "Use vfork to run external commands"
+//config:	default y
+//config:	depends on ASH
+//config:	help
+//config:	  Run simple external commands with vfork+exec instead of
+//config:	  forking the whole shell, unless job control is on or
+//config:	  traps are set. This saves copying page tables of a big
+//config:	  shell process for each command.
+//config:
+//config:config ASH_NOFORK_BACKQ
+//config:	bool "Run simple `cmd` in the shell process"
+//config:	default y
+//config:	depends on ASH
+//config:	help
+//config:	  Run $(cmd) and `cmd` without forking a subshell if cmd is
+//config:	  echo, printf, test, pwd, true, false or a NOFORK applet,
+//config:	  and expanding its arguments has no side effects.
+//config:	  The output is collected in memory.
+//config:
+//config:config ASH_SCRIPT_CACHE
+//config:	bool "Cache parsed scripts in $ASH_SCRIPT_CACHE"
+//config:	default y
+//config:	depends on ASH
+//config:	help
+//config:	  If $ASH_SCRIPT_CACHE names a directory, parse trees of scripts
+//config:	  run as "ash SCRIPT" are saved there, and the next run of the
+//config:	  same, unchanged script uses them instead of parsing it again.
+//config:	  Cache files are keyed by the script's path, size and times
+//config:	  and by the shell build.
+//config:
 
 //applet:IF_ASH(APPLET(ash, BB_DIR_BIN, BB_SUID_DROP))
 //applet:IF_FEATURE_SH_IS_ASH(APPLET_ODDNAME(sh, ash, BB_DIR_BIN, BB_SUID_DROP, sh))
@@ -198,7 +232,7 @@
 
 #define VTABSIZE 39
 #define ATABSIZE 39
-#define CMDTABLESIZE 31         /* should be prime */
+#define CMDTABLESIZE 32         /* initial size, power of 2 */
 
 
 /* ============ Shell options */
@@ -1342,48 +1376,32 @@ enum {
 	 * in some way.  The following macro will get this right
 	 * on many machines.  */
 	SHELL_SIZE = sizeof(union { int i; char *cp; double d; }) - 1,
-	/* Minimum size of a block */
-	MINSIZE = SHELL_ALIGN(504),
-};
-
-struct stack_block {
-	struct stack_block *prev;
-	char space[MINSIZE];
 };
 
 struct stackmark {
-	struct stack_block *stackp;
-	char *stacknxt;
-	size_t stacknleft;
-	struct stackmark *marknext;
+	region_mark_t rmark;
 };
 
 
+/* The stack lives in a libbb region: its blocks are never realloced,
+ * so nothing needs relocating when the top string grows. */
 struct globals_memstack {
-	struct stack_block *g_stackp; // = &stackbase;
-	struct stackmark *markp;
-	char *g_stacknxt; // = stackbase.space;
-	char *sstrend; // = stackbase.space + MINSIZE;
-	size_t g_stacknleft; // = MINSIZE;
+	region_t stackregion;
 	int    herefd; // = -1;
-	struct stack_block stackbase;
 };
 extern struct globals_memstack *const ash_ptr_to_globals_memstack;
 #define G_memstack (*ash_ptr_to_globals_memstack)
-#define g_stackp     (G_memstack.g_stackp    )
-#define markp        (G_memstack.markp       )
-#define g_stacknxt   (G_memstack.g_stacknxt  )
-#define sstrend      (G_memstack.sstrend     )
-#define g_stacknleft (G_memstack.g_stacknleft)
+#define stackregion  (G_memstack.stackregion)
+#define g_stacknxt   (stackregion.next       )
+#define sstrend      (stackregion.end        )
+#define g_stacknleft ((size_t)(sstrend - g_stacknxt))
 #define herefd       (G_memstack.herefd      )
-#define stackbase    (G_memstack.stackbase   )
 #define INIT_G_memstack() do { \
 	(*(struct globals_memstack**)&ash_ptr_to_globals_memstack) = xzalloc(sizeof(G_memstack)); \
 	barrier(); \
-	g_stackp = &stackbase; \
-	g_stacknxt = stackbase.space; \
-	g_stacknleft = MINSIZE; \
-	sstrend = stackbase.space + MINSIZE; \
+	/* There is always a block, so marks are never NULL */ \
+	if (!region_reserve(&stackregion, 1, 0)) \
+		bb_error_msg_and_die(bb_msg_memory_exhausted); \
 	herefd = -1; \
 } while (0)
 
@@ -1407,28 +1425,16 @@ stalloc(size_t nbytes)
 
 	aligned = SHELL_ALIGN(nbytes);
 	if (aligned > g_stacknleft) {
-		size_t len;
-		size_t blocksize;
-		struct stack_block *sp;
-
-		blocksize = aligned;
-		if (blocksize < MINSIZE)
-			blocksize = MINSIZE;
-		len = sizeof(struct stack_block) - MINSIZE + blocksize;
-		if (len < blocksize)
+		if (aligned < nbytes)
 			ash_msg_and_raise_error("%s", bb_msg_memory_exhausted);
 		INT_OFF;
-		sp = ckmalloc(len);
-		sp->prev = g_stackp;
-		g_stacknxt = sp->space;
-		g_stacknleft = blocksize;
-		sstrend = g_stacknxt + blocksize;
-		g_stackp = sp;
+		p = region_reserve(&stackregion, aligned, 0);
 		INT_ON;
+		if (!p)
+			ash_msg_and_raise_error("%s", bb_msg_memory_exhausted);
 	}
 	p = g_stacknxt;
 	g_stacknxt += aligned;
-	g_stacknleft -= aligned;
 	return p;
 }
 
@@ -1442,12 +1448,11 @@ static void
 stunalloc(void *p)
 {
 #if DEBUG
-	if (!p || (g_stacknxt < (char *)p) || ((char *)p < g_stackp->space)) {
+	if (!p || (g_stacknxt < (char *)p)) {
 		write(STDERR_FILENO, "stunalloc\n", 10);
 		abort();
 	}
 #endif
-	g_stacknleft += g_stacknxt - (char *)p;
 	g_stacknxt = p;
 }
 
@@ -1464,31 +1469,17 @@ ststrdup(const char *p)
 static void
 setstackmark(struct stackmark *mark)
 {
-	mark->stackp = g_stackp;
-	mark->stacknxt = g_stacknxt;
-	mark->stacknleft = g_stacknleft;
-	mark->marknext = markp;
-	markp = mark;
+	region_mark(&stackregion, &mark->rmark);
 }
 
 static void
 popstackmark(struct stackmark *mark)
 {
-	struct stack_block *sp;
-
-	if (!mark->stackp)
+	if (!mark->rmark.chunk)
 		return;
 
 	INT_OFF;
-	markp = mark->marknext;
-	while (g_stackp != mark->stackp) {
-		sp = g_stackp;
-		g_stackp = sp->prev;
-		free(sp);
-	}
-	g_stacknxt = mark->stacknxt;
-	g_stacknleft = mark->stacknleft;
-	sstrend = mark->stacknxt + mark->stacknleft;
+	region_release(&stackregion, &mark->rmark);
 	INT_ON;
 }
 
@@ -1505,6 +1496,7 @@ static void
 growstackblock(void)
 {
 	size_t newlen;
+	char *p;
 
 	newlen = g_stacknleft * 2;
 	if (newlen < g_stacknleft)
@@ -1512,46 +1504,12 @@ growstackblock(void)
 	if (newlen < 128)
 		newlen += 128;
 
-	if (g_stacknxt == g_stackp->space && g_stackp != &stackbase) {
-		struct stack_block *oldstackp;
-		struct stackmark *xmark;
-		struct stack_block *sp;
-		struct stack_block *prevstackp;
-		size_t grosslen;
-
-		INT_OFF;
-		oldstackp = g_stackp;
-		sp = g_stackp;
-		prevstackp = sp->prev;
-		grosslen = newlen + sizeof(struct stack_block) - MINSIZE;
-		sp = ckrealloc(sp, grosslen);
-		sp->prev = prevstackp;
-		g_stackp = sp;
-		g_stacknxt = sp->space;
-		g_stacknleft = newlen;
-		sstrend = sp->space + newlen;
-
-		/*
-		 * Stack marks pointing to the start of the old block
-		 * must be relocated to point to the new block
-		 */
-		xmark = markp;
-		while (xmark != NULL && xmark->stackp == oldstackp) {
-			xmark->stackp = g_stackp;
-			xmark->stacknxt = g_stacknxt;
-			xmark->stacknleft = g_stacknleft;
-			xmark = xmark->marknext;
-		}
-		INT_ON;
-	} else {
-		char *oldspace = g_stacknxt;
-		size_t oldlen = g_stacknleft;
-		char *p = stalloc(newlen);
-
-		/* free the space we just allocated */
-		g_stacknxt = memcpy(p, oldspace, oldlen);
-		g_stacknleft += newlen;
-	}
+	/* Move the string to a fresh block, the old one stays as it was */
+	INT_OFF;
+	p = region_reserve(&stackregion, newlen, g_stacknleft);
+	INT_ON;
+	if (!p)
+		ash_msg_and_raise_error("%s", bb_msg_memory_exhausted);
 }
 
 static void
@@ -1559,7 +1517,6 @@ grabstackblock(size_t len)
 {
 	len = SHELL_ALIGN(len);
 	g_stacknxt += len;
-	g_stacknleft -= len;
 }
 
 /*
@@ -5825,6 +5782,9 @@ struct backcmd {                /* result of evalbackcmd */
 static uint8_t back_exitstatus; /* exit status of backquoted command */
 #define EV_EXIT 01              /* exit after evaluating tree */
 static void evaltree(union node *, int);
+#if ENABLE_ASH_NOFORK_BACKQ
+static int evalbackcmd_nofork(union node *, struct backcmd *);
+#endif
 
 static void FAST_FUNC
 evalbackcmd(union node *n, struct backcmd *result)
@@ -5837,6 +5797,10 @@ evalbackcmd(union node *n, struct backcmd *result)
 	result->jp = NULL;
 	if (n == NULL)
 		goto out;
+#if ENABLE_ASH_NOFORK_BACKQ
+	if (evalbackcmd_nofork(n, result))
+		goto out;
+#endif
 
 	saveherefd = herefd;
 	herefd = -1;
@@ -7363,23 +7327,41 @@ static void find_command(char *, struct cmdentry *, int, const char *);
  * This ensures that a full path search will not have to be done for them
  * on each invocation.
  *
- * We should investigate converting to a linear search, even though that
- * would make the command name "hash" a misnomer.
+ * The table is open addressed with linear probing and doubles when
+ * it gets 3/4 full. Commands not found in $PATH are entered too,
+ * as CMDUNKNOWN: such an entry is good while no $PATH directory
+ * has changed its mtime since the first one was made.
  */
 
 struct tblentry {
-	struct tblentry *next;  /* next entry in hash chain */
 	union param param;      /* definition of builtin function */
+	unsigned hashval;
 	smallint cmdtype;       /* CMDxxx */
 	char rehash;            /* if set, cd done since entry created */
 	char cmdname[1];        /* name of command */
 };
 
 static struct tblentry **cmdtable;
+static unsigned cmdtable_size;  /* power of 2 */
+static unsigned cmdtable_used;
 #define INIT_G_cmdtable() do { \
+	cmdtable_size = CMDTABLESIZE; \
 	cmdtable = xzalloc(CMDTABLESIZE * sizeof(cmdtable[0])); \
 } while (0)
 
+/* For "hash -v" */
+static unsigned cmdtable_hits;
+static unsigned cmdtable_misses;
+static unsigned cmdtable_neghits;
+
+/* mtimes of $PATH directories when the not found entries were made */
+static time_t *pathdir_mtime;
+static int pathdir_count = -1;  /* -1: there are no such entries */
+/* The mtimes are checked at most once per top-level command:
+ * pathdir_gen counts those, pathdir_checked is when we last did it */
+static unsigned pathdir_gen;
+static unsigned pathdir_checked;
+
 static int builtinloc = -1;     /* index in path of %builtin, or -1 */
 
 
@@ -7511,6 +7493,136 @@ shellexec(char **argv, const char *path, int idx)
 	/* NOTREACHED */
 }
 
+#if ENABLE_ASH_VFORK
+/*
+ * Run a simple command's program in a vfork'ed child. This is only done
+ * where the child of forkshell() would not need to touch shell memory:
+ * no job control and no traps. Redirections are already in place; the
+ * environment and the program's path are made here, for the child to
+ * just close saved fds, reset signals and exec.
+ * Returns the pid, or 0 if the caller should fork instead - also when
+ * exec fails, so that errors are handled the usual way.
+ *
+ * Called with interrupts off.
+ */
+static int
+vforkexec(struct job *jp, union node *n, char **argv,
+		struct strlist *varlist, const char *path, int idx)
+{
+	const char *cmdname;
+	char **envp;
+	char **vars;
+	char **ep;
+	char **sargv;
+	struct strlist *sp;
+	struct strlist *sp2;
+	struct redirtab *rp;
+	sigset_t mask, omask;
+	volatile int failed;
+	int i;
+	pid_t pid;
+
+	if (doing_jobctl || may_have_traps)
+		return 0;
+
+	/* What shellexec() would try first */
+#if ENABLE_FEATURE_SH_STANDALONE
+	i = find_applet_by_name(argv[0]);
+	if (i >= 0) {
+		if (APPLET_IS_NOEXEC(i))
+			return 0;
+		cmdname = bb_busybox_exec_path;
+	} else
+#endif
+	if (strchr(argv[0], '/') != NULL) {
+		cmdname = argv[0];
+	} else {
+		if (idx < 0)
+			return 0;
+		do {
+			cmdname = path_advance(&path, argv[0]);
+			if (cmdname == NULL)
+				return 0;
+		} while (--idx >= 0);
+		if (pathopt)
+			return 0;
+	}
+
+	/* Exported variables, with VAR=VAL assignments of the command */
+	i = 1;
+	for (sp = varlist; sp; sp = sp->next) {
+		struct var *vp = *findvar(hashvar(sp->text), sp->text);
+		if (vp && (vp->flags & VREADONLY))
+			return 0;
+		i++;
+	}
+	vars = listvars(VEXPORT, VUNSET, &ep);
+	envp = ep = stalloc((ep - vars + i) * sizeof(ep[0]));
+	for (; *vars; vars++) {
+		for (sp = varlist; sp; sp = sp->next)
+			if (varcmp(*vars, sp->text) == 0)
+				break;
+		if (!sp)
+			*ep++ = *vars;
+	}
+	for (sp = varlist; sp; sp = sp->next) {
+		/* the last of "A=1 A=2" wins */
+		for (sp2 = sp->next; sp2; sp2 = sp2->next)
+			if (varcmp(sp->text, sp2->text) == 0)
+				break;
+		if (!sp2)
+			*ep++ = sp->text;
+	}
+	*ep = NULL;
+
+	/* For a script without #!, see tryexec() */
+	for (i = 0; argv[i]; i++)
+		continue;
+	sargv = stalloc((i + 2) * sizeof(sargv[0]));
+	sargv[0] = (char*) "ash";
+	sargv[1] = (char*) cmdname;
+	memcpy(sargv + 2, argv + 1, i * sizeof(sargv[0]));
+
+	/* No signal handler may run in the child, it would change our memory */
+	sigfillset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, &omask);
+	failed = 0;
+	pid = vfork();
+	if (pid == 0) {
+		/* Child: what clearredir(1) and forkchild() would do */
+		for (rp = redirlist; rp; rp = rp->next) {
+			for (i = 0; i < rp->pair_count; i++) {
+				int copy = rp->two_fd[i].copy;
+				if (copy != CLOSED && copy != EMPTY)
+					close(copy & ~COPYFD_RESTORE);
+			}
+		}
+		for (i = 1; i < NSIG; i++) {
+			if (sigmode[i - 1] == S_CATCH || sigmode[i - 1] == S_IGN)
+				signal(i, SIG_DFL);
+		}
+		sigprocmask(SIG_SETMASK, &omask, NULL);
+		execve(cmdname, argv, envp);
+		if (errno == ENOEXEC && cmdname != bb_busybox_exec_path)
+			execve(bb_busybox_exec_path, sargv, envp);
+		failed = errno;
+		_exit(127);
+	}
+	sigprocmask(SIG_SETMASK, &omask, NULL);
+	if (pid < 0)
+		return 0;
+	if (failed) {
+		/* Let forkshell() + shellexec() search on or report it */
+		while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+			continue;
+		return 0;
+	}
+	TRACE(("vforkexec: child %d execs %s\n", pid, cmdname));
+	forkparent(jp, n, FORK_FG, pid);
+	return pid;
+}
+#endif
+
 static void
 printentry(struct tblentry *cmdp)
 {
@@ -7531,38 +7643,68 @@ printentry(struct tblentry *cmdp)
  * Clear out command entries.  The argument specifies the first entry in
  * PATH which has changed.
  */
+/*
+ * Put the entries of the table in a new one of the given size.
+ * Slots of deleted entries must have been set to NULL.
+ * Called with interrupts off.
+ */
+static void
+cmdtable_rehash(unsigned size)
+{
+	struct tblentry **old = cmdtable;
+	struct tblentry **pp;
+	unsigned oldsize = cmdtable_size;
+	unsigned i;
+
+	cmdtable = xzalloc(size * sizeof(cmdtable[0]));
+	cmdtable_size = size;
+	for (pp = old; pp < &old[oldsize]; pp++) {
+		if (*pp == NULL)
+			continue;
+		i = (*pp)->hashval;
+		while (cmdtable[i &= size - 1] != NULL)
+			i++;
+		cmdtable[i] = *pp;
+	}
+	free(old);
+}
+
+/*
+ * Clear out command entries.  The argument specifies the first entry in
+ * PATH which has changed.  Not found entries are always cleared.
+ */
 static void
 clearcmdentry(int firstchange)
 {
-	struct tblentry **tblp;
 	struct tblentry **pp;
 	struct tblentry *cmdp;
 
 	INT_OFF;
-	for (tblp = cmdtable; tblp < &cmdtable[CMDTABLESIZE]; tblp++) {
-		pp = tblp;
-		while ((cmdp = *pp) != NULL) {
-			if ((cmdp->cmdtype == CMDNORMAL &&
-			     cmdp->param.index >= firstchange)
-			 || (cmdp->cmdtype == CMDBUILTIN &&
-			     builtinloc >= firstchange)
-			) {
-				*pp = cmdp->next;
-				free(cmdp);
-			} else {
-				pp = &cmdp->next;
-			}
+	for (pp = cmdtable; pp < &cmdtable[cmdtable_size]; pp++) {
+		cmdp = *pp;
+		if (cmdp == NULL)
+			continue;
+		if (cmdp->cmdtype == CMDUNKNOWN
+		 || (cmdp->cmdtype == CMDNORMAL &&
+		     cmdp->param.index >= firstchange)
+		 || (cmdp->cmdtype == CMDBUILTIN &&
+		     builtinloc >= firstchange)
+		) {
+			*pp = NULL;
+			cmdtable_used--;
+			free(cmdp);
 		}
 	}
+	cmdtable_rehash(cmdtable_size);
+	pathdir_count = -1;
 	INT_ON;
 }
 
 /*
  * Locate a command in the command hash table.  If "add" is nonzero,
  * add the command to the table if it is not already present.  The
- * variable "lastcmdentry" is set to point to the address of the link
- * pointing to the entry, so that delete_cmd_entry can delete the
- * entry.
+ * variable "lastcmdentry" is set to point to the slot of the entry,
+ * so that delete_cmd_entry can delete the entry.
  *
  * Interrupts must be off if called with add != 0.
  */
@@ -7571,32 +7713,36 @@ static struct tblentry **lastcmdentry;
 static struct tblentry *
 cmdlookup(const char *name, int add)
 {
-	unsigned int hashval;
+	unsigned hashval;
+	unsigned i;
 	const char *p;
 	struct tblentry *cmdp;
-	struct tblentry **pp;
 
 	p = name;
-	hashval = (unsigned char)*p << 4;
+	hashval = 5381;
 	while (*p)
-		hashval += (unsigned char)*p++;
-	hashval &= 0x7FFF;
-	pp = &cmdtable[hashval % CMDTABLESIZE];
-	for (cmdp = *pp; cmdp; cmdp = cmdp->next) {
-		if (strcmp(cmdp->cmdname, name) == 0)
+		hashval = hashval * 33 + (unsigned char)*p++;
+	hashval ^= hashval >> 16;
+
+	if (add && (cmdtable_used + 1) * 4 > cmdtable_size * 3)
+		cmdtable_rehash(cmdtable_size * 2);
+	i = hashval;
+	while ((cmdp = cmdtable[i &= cmdtable_size - 1]) != NULL) {
+		if (cmdp->hashval == hashval && strcmp(cmdp->cmdname, name) == 0)
 			break;
-		pp = &cmdp->next;
+		i++;
 	}
 	if (add && cmdp == NULL) {
-		cmdp = *pp = ckzalloc(sizeof(struct tblentry)
+		cmdp = cmdtable[i] = ckzalloc(sizeof(struct tblentry)
 				+ strlen(name)
 				/* + 1 - already done because
 				 * tblentry::cmdname is char[1] */);
-		/*cmdp->next = NULL; - ckzalloc did it */
+		cmdp->hashval = hashval;
 		cmdp->cmdtype = CMDUNKNOWN;
 		strcpy(cmdp->cmdname, name);
+		cmdtable_used++;
 	}
-	lastcmdentry = pp;
+	lastcmdentry = &cmdtable[i];
 	return cmdp;
 }
 
@@ -7607,16 +7753,94 @@ static void
 delete_cmd_entry(void)
 {
 	struct tblentry *cmdp;
+	unsigned i, j, k;
 
 	INT_OFF;
-	cmdp = *lastcmdentry;
-	*lastcmdentry = cmdp->next;
+	i = lastcmdentry - cmdtable;
+	cmdp = cmdtable[i];
+	cmdtable[i] = NULL;
+	cmdtable_used--;
+	/* Move up entries which probed past the freed slot */
+	j = i;
+	for (;;) {
+		j = (j + 1) & (cmdtable_size - 1);
+		if (cmdtable[j] == NULL)
+			break;
+		k = cmdtable[j]->hashval & (cmdtable_size - 1);
+		/* Leave it if its home slot is in (i, j] */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		cmdtable[i] = cmdtable[j];
+		cmdtable[j] = NULL;
+		i = j;
+	}
 	if (cmdp->cmdtype == CMDFUNCTION)
 		freefunc(cmdp->param.func);
 	free(cmdp);
 	INT_ON;
 }
 
+/*
+ * Stat $PATH directories. If mtime is NULL, compare with pathdir_mtime.
+ * Returns 0 if they differ, or if one is too new to tell a later change.
+ */
+static int
+pathdir_stat(time_t *mtime)
+{
+	const char *path = pathval();
+	char *dir;
+	struct stat statb;
+	time_t now = time(NULL);
+	time_t t;
+	int idx = 0;
+
+	while ((dir = path_advance(&path, "")) != NULL) {
+		stunalloc(dir);
+		t = 0;
+		if (stat(dir[0] ? dir : ".", &statb) == 0) {
+			t = statb.st_mtime;
+			if (t >= now)
+				return 0;
+		}
+		if (mtime)
+			mtime[idx] = t;
+		else if (idx >= pathdir_count || pathdir_mtime[idx] != t)
+			return 0;
+		idx++;
+	}
+	return idx;
+}
+
+/*
+ * Can a not found entry be added, or used?
+ */
+static int
+pathdir_unchanged(void)
+{
+	const char *p;
+	int n;
+
+	if (pathdir_count >= 0) {
+		if (pathdir_checked == pathdir_gen)
+			return 1;
+		if (pathdir_stat(NULL) == pathdir_count) {
+			pathdir_checked = pathdir_gen;
+			return 1;
+		}
+		clearcmdentry(9999);
+		return 0;
+	}
+	n = 1;
+	for (p = pathval(); *p; p++)
+		n += (*p == ':');
+	pathdir_mtime = ckrealloc(pathdir_mtime, n * sizeof(pathdir_mtime[0]));
+	if (pathdir_stat(pathdir_mtime) != n)
+		return 0;
+	pathdir_count = n;
+	pathdir_checked = pathdir_gen;
+	return 1;
+}
+
 /*
  * Add a new command entry, replacing any existing command entry for
  * the same name - except special builtins.
@@ -7644,17 +7868,23 @@ hashcmd(int argc UNUSED_PARAM, char **argv UNUSED_PARAM)
 	struct cmdentry entry;
 	char *name;
 
-	if (nextopt("r") != '\0') {
-		clearcmdentry(0);
+	while ((c = nextopt("rv")) != '\0') {
+		if (c == 'r') {
+			clearcmdentry(0);
+			return 0;
+		}
+		out1fmt("hits %u misses %u not found hits %u\n"
+			"entries %u size %u\n",
+			cmdtable_hits, cmdtable_misses, cmdtable_neghits,
+			cmdtable_used, cmdtable_size);
 		return 0;
 	}
 
 	if (*argptr == NULL) {
-		for (pp = cmdtable; pp < &cmdtable[CMDTABLESIZE]; pp++) {
-			for (cmdp = *pp; cmdp; cmdp = cmdp->next) {
-				if (cmdp->cmdtype == CMDNORMAL)
-					printentry(cmdp);
-			}
+		for (pp = cmdtable; pp < &cmdtable[cmdtable_size]; pp++) {
+			cmdp = *pp;
+			if (cmdp && cmdp->cmdtype == CMDNORMAL)
+				printentry(cmdp);
 		}
 		return 0;
 	}
@@ -7664,6 +7894,7 @@ hashcmd(int argc UNUSED_PARAM, char **argv UNUSED_PARAM)
 		cmdp = cmdlookup(name, 0);
 		if (cmdp != NULL
 		 && (cmdp->cmdtype == CMDNORMAL
+		     || cmdp->cmdtype == CMDUNKNOWN
 		     || (cmdp->cmdtype == CMDBUILTIN && builtinloc >= 0))
 		) {
 			delete_cmd_entry();
@@ -7686,15 +7917,17 @@ hashcd(void)
 	struct tblentry **pp;
 	struct tblentry *cmdp;
 
-	for (pp = cmdtable; pp < &cmdtable[CMDTABLESIZE]; pp++) {
-		for (cmdp = *pp; cmdp; cmdp = cmdp->next) {
-			if (cmdp->cmdtype == CMDNORMAL
-			 || (cmdp->cmdtype == CMDBUILTIN
-			     && !IS_BUILTIN_REGULAR(cmdp->param.cmd)
-			     && builtinloc > 0)
-			) {
-				cmdp->rehash = 1;
-			}
+	for (pp = cmdtable; pp < &cmdtable[cmdtable_size]; pp++) {
+		cmdp = *pp;
+		if (cmdp == NULL)
+			continue;
+		if (cmdp->cmdtype == CMDNORMAL
+		 || cmdp->cmdtype == CMDUNKNOWN
+		 || (cmdp->cmdtype == CMDBUILTIN
+		     && !IS_BUILTIN_REGULAR(cmdp->param.cmd)
+		     && builtinloc > 0)
+		) {
+			cmdp->rehash = 1;
 		}
 	}
 }
@@ -7863,7 +8096,7 @@ describe_command(char *command, int describe_command_verbose)
 #endif
 	/* Then check if it is a tracked alias */
 	cmdp = cmdlookup(command, 0);
-	if (cmdp != NULL) {
+	if (cmdp != NULL && cmdp->cmdtype != CMDUNKNOWN) {
 		entry.cmdtype = cmdp->cmdtype;
 		entry.u = cmdp->param;
 	} else {
@@ -9382,7 +9615,12 @@ evalcommand(union node *cmd, int flags)
 			/* No, forking off a child is necessary */
 			INT_OFF;
 			jp = makejob(/*cmd,*/ 1);
-			if (forkshell(jp, cmd, FORK_FG) != 0) {
+			if (
+#if ENABLE_ASH_VFORK
+			    vforkexec(jp, cmd, argv, varlist.list, path, cmdentry.u.index) != 0 ||
+#endif
+			    forkshell(jp, cmd, FORK_FG) != 0
+			) {
 				/* parent */
 				exitstatus = waitforjob(jp);
 				INT_ON;
@@ -9484,6 +9722,233 @@ evalbltin(const struct builtincmd *cmd, int argc, char **argv)
 	return i;
 }
 
+#if ENABLE_ASH_NOFORK_BACKQ
+/*
+ * Run `cmd` or $(cmd) in this shell, if cmd is a simple command of
+ * a builtin below or a NOFORK applet, without assignments or
+ * redirections, and expanding its arguments can't change anything:
+ * no ${v=..}, ${v?..}, $((..)) or nested backquotes, and no "set -u".
+ * Under "set -x" the subshell prints the trace line, so fork then too.
+ * Output goes to a memfd, which is read into result->buf.
+ * Returns 0 if cmd has to be run in a subshell.
+ *
+ * Called with interrupts off.
+ */
+static int
+evalbackcmd_nofork(union node *n, struct backcmd *result)
+{
+	static int memfd = -1;
+	static ino_t memfd_ino;
+	const struct builtincmd *bcmd;
+	struct stat st;
+	struct cmdentry entry;
+	union node *argp;
+	struct arglist arglist;
+	const struct strlist *sp;
+	struct strlist *savecmdenviron;
+	char *saveexpdest;
+	struct nodelist *saveargbackq;
+	struct ifsregion saveifsfirst;
+	struct ifsregion *saveifslastp;
+	struct arglist saveexparg;
+	struct stackmark smark;
+	volatile int saveint;
+	struct jmploc *volatile savehandler;
+	struct jmploc jmploc;
+	const char *p;
+	char **argv;
+	int argc;
+	int volatile fd1;
+	int status;
+	off_t len;
+	unsigned char c;
+
+	if (n->type != NCMD || n->ncmd.redirect || n->ncmd.assign
+	 || !n->ncmd.args || uflag || xflag
+	) {
+		return 0;
+	}
+	for (argp = n->ncmd.args; argp; argp = argp->narg.next) {
+		if (argp->narg.backquote)
+			return 0;
+		for (p = argp->narg.text; (c = *p) != '\0'; p++) {
+			if (c == CTLESC) {
+				p++;
+			} else if (c == CTLVAR) {
+				c = *++p & VSTYPE;
+				if (c == VSASSIGN || c == VSQUESTION)
+					return 0;
+			} else if (c == CTLARI) {
+				return 0;
+			}
+		}
+	}
+	/* Command name must be a plain word */
+	for (p = n->ncmd.args->narg.text; *p; p++) {
+		if ((unsigned char)*p >= CTL_FIRST && (unsigned char)*p <= CTL_LAST)
+			return 0;
+	}
+
+	find_command(n->ncmd.args->narg.text, &entry, 0, pathval());
+	bcmd = NULL;
+	if (entry.cmdtype == CMDBUILTIN) {
+		bcmd = entry.u.cmd;
+		if (bcmd->builtin != truecmd
+		 && bcmd->builtin != falsecmd
+		 && bcmd->builtin != pwdcmd
+#if ENABLE_ASH_BUILTIN_ECHO
+		 && bcmd->builtin != echocmd
+#endif
+#if ENABLE_ASH_BUILTIN_PRINTF
+		 && bcmd->builtin != printfcmd
+#endif
+#if ENABLE_ASH_BUILTIN_TEST
+		 && bcmd->builtin != testcmd
+#endif
+		) {
+			return 0;
+		}
+	}
+#if ENABLE_FEATURE_SH_NOFORK
+	else if (entry.cmdtype == CMDNORMAL
+	 && entry.u.index <= -2
+	 && APPLET_IS_NOFORK(-2 - entry.u.index)
+	) {
+		/* find_command() encodes applet_no as (-2 - applet_no) */
+	}
+#endif
+	else {
+		return 0;
+	}
+
+	/* A redirection may have taken over the fd */
+	if (memfd >= 0 && (fstat(memfd, &st) != 0 || st.st_ino != memfd_ino))
+		memfd = -1;
+	if (memfd < 0) {
+#ifdef __NR_memfd_create
+		fd1 = syscall(__NR_memfd_create, "ash", 0);
+#else
+		fd1 = -1;
+#endif
+		if (fd1 < 0)
+			return 0;
+		memfd = fcntl(fd1, F_DUPFD, 10);
+		close(fd1);
+		if (memfd < 0)
+			return 0;
+		close_on_exec_on(memfd);
+		fstat(memfd, &st);
+		memfd_ino = st.st_ino;
+	}
+
+	/* The outer word is being expanded, save its state */
+	saveexpdest = expdest;
+	saveargbackq = argbackq;
+	saveifsfirst = ifsfirst;
+	saveifslastp = ifslastp;
+	saveexparg = exparg;
+	savecmdenviron = cmdenviron;
+	setstackmark(&smark);
+	fd1 = -2; /* fd 1 is not redirected yet */
+
+	/* An error, such as "Illegal number" from ${v:1:zz}, would have
+	 * ended the subshell. Here it must end only this command */
+	SAVE_INT(saveint);
+	savehandler = exception_handler;
+	if (setjmp(jmploc.loc)) {
+		exception_handler = savehandler;
+		if (fd1 != -2) {
+			if (fd1 >= 0) {
+				dup2(fd1, 1);
+				close(fd1);
+			} else {
+				close(1);
+			}
+			ftruncate(memfd, 0);
+			lseek(memfd, 0, SEEK_SET);
+		}
+		cmdenviron = savecmdenviron;
+		if (ifsfirst.next)
+			ifsfree();
+		expdest = saveexpdest;
+		argbackq = saveargbackq;
+		ifsfirst = saveifsfirst;
+		ifslastp = saveifslastp;
+		exparg = saveexparg;
+		popstackmark(&smark);
+		if (exception_type != EXERROR)
+			longjmp(exception_handler->loc, 1);
+		RESTORE_INT(saveint);
+		back_exitstatus = 2;
+		return 1;
+	}
+	exception_handler = &jmploc;
+
+	arglist.lastp = &arglist.list;
+	for (argp = n->ncmd.args; argp; argp = argp->narg.next)
+		expandarg(argp, &arglist, EXP_FULL | EXP_TILDE);
+	*arglist.lastp = NULL;
+	expdest = saveexpdest;
+	argbackq = saveargbackq;
+	ifsfirst = saveifsfirst;
+	ifslastp = saveifslastp;
+	exparg = saveexparg;
+
+	argc = 0;
+	for (sp = arglist.list; sp; sp = sp->next)
+		argc++;
+	argv = stalloc(sizeof(char *) * (argc + 1));
+	argc = 0;
+	for (sp = arglist.list; sp; sp = sp->next)
+		argv[argc++] = sp->text;
+	argv[argc] = NULL;
+	/* Field splitting could have changed the command name */
+	if (argc == 0 || strcmp(argv[0], n->ncmd.args->narg.text) != 0) {
+		exception_handler = savehandler;
+		return 0;
+	}
+
+	flush_stdout_stderr();
+	fd1 = fcntl(1, F_DUPFD, 10);
+	if (fd1 >= 0)
+		close_on_exec_on(fd1);
+	dup2(memfd, 1);
+	cmdenviron = NULL;
+	status = exitstatus;
+	if (bcmd) {
+		if (evalbltin(bcmd, argc, argv))
+			exitstatus = 2;
+	}
+#if ENABLE_FEATURE_SH_NOFORK
+	else {
+		exitstatus = run_nofork_applet(-2 - entry.u.index, argv);
+		flush_stdout_stderr();
+	}
+#endif
+	exception_handler = savehandler;
+	back_exitstatus = exitstatus;
+	exitstatus = status;
+	cmdenviron = savecmdenviron;
+	if (fd1 >= 0) {
+		dup2(fd1, 1);
+		close(fd1);
+	} else {
+		close(1);
+	}
+
+	len = lseek(memfd, 0, SEEK_CUR);
+	if (len > 0) {
+		result->buf = ckmalloc(len);
+		result->nleft = pread(memfd, result->buf, len, 0);
+		if (result->nleft < 0)
+			result->nleft = 0;
+		ftruncate(memfd, 0);
+		lseek(memfd, 0, SEEK_SET);
+	}
+	return 1;
+}
+#endif
+
 static int
 goodname(const char *p)
 {
@@ -12110,6 +12575,7 @@ evalstring(char *s, int mask)
 
 	skip = 0;
 	while ((n = parsecmd(0)) != NODE_EOF) {
+		pathdir_gen++;
 		evaltree(n, 0);
 		popstackmark(&smark);
 		skip = evalskip;
@@ -12152,6 +12618,452 @@ evalcmd(int argc UNUSED_PARAM, char **argv)
 	return exitstatus;
 }
 
+#if ENABLE_ASH_SCRIPT_CACHE
+/* ============ Script cache
+ *
+ * If $ASH_SCRIPT_CACHE is set, "ash SCRIPT" saves each command it parses
+ * from SCRIPT into $ASH_SCRIPT_CACHE/<path with / replaced by %>: the
+ * block made by copyfunc() and the address it was at. Commands are saved
+ * before they run. The file ends with where parsing can go on from:
+ * offset and line number in the script, or EOF.
+ *
+ * The next run of the same, unchanged script by the same build reads the
+ * file, relocates the blocks to where they landed and runs them without
+ * calling the parser. At the end of the file, the script is seeked to the
+ * saved offset and parsed as usual (and the cache is extended).
+ * "Same build" is checked by bb_banner plus the node types and sizes:
+ * the banner need not change with the config, the node layout does.
+ *
+ * A command is saved only if the parser stopped at the end of a line
+ * without any lookahead. Aliases are expanded at parse time, so once
+ * the script defines one, nothing more is saved.
+ */
+struct scache_hdr {
+	char magic[4];
+	uint32_t node_size;
+	uint32_t hdr_size;      /* including bb_banner and path, padded */
+	uint32_t node_types;    /* N_NUMBER */
+	uint32_t node_layout;   /* hash of nodesize[] */
+	uint32_t pad;
+	int64_t script_size;
+	int64_t script_mtime;
+	int64_t script_ctime;
+	int64_t script_ino;
+	/* bb_banner and script path follow, NUL terminated */
+};
+
+struct scache_cmd {
+	uint32_t size;          /* of block, 0: end of file */
+	int32_t startlinno;
+	int32_t linno;
+	uint32_t pad;
+	uint64_t base;          /* address of block; at end: offset, or -1 (EOF) */
+	/* block follows, padded */
+};
+
+#define SCACHE_ALIGN(n) (((n) + 7) & ~7)
+
+static struct {
+	char *name;             /* cache file */
+	char *tmpname;          /* cache file being written */
+	int fd;                 /* of tmpname, -1 if not saving */
+	pid_t pid;              /* only this process saves */
+	char *hdr;
+	unsigned hdr_size;
+	off_t resume_off;       /* last place parsing can go on from */
+	int resume_linno;
+	char *buf;              /* cache file being replayed */
+	char *pos;              /* next scache_cmd in buf, NULL if not replaying */
+} scache = { .fd = -1 };
+
+/* Range of the block being relocated, delta to add to its pointers */
+static char *scache_lo;
+static char *scache_hi;
+static ptrdiff_t scache_delta;
+static smallint scache_bad;
+static const char scache_zero[8];
+
+static union node *
+scache_relocnode(union node *n);
+
+static char *
+scache_relocstr(char *s)
+{
+	s += scache_delta;
+	if (s < scache_lo || s >= scache_hi || !memchr(s, '\0', scache_hi - s)) {
+		scache_bad = 1;
+		return NULL;
+	}
+	return s;
+}
+
+static struct nodelist *
+scache_relocnodelist(struct nodelist *lp)
+{
+	struct nodelist *start;
+	struct nodelist **lpp;
+
+	lpp = &start;
+	while (lp) {
+		lp = (void *)((char *)lp + scache_delta);
+		if ((char *)lp < scache_lo || (char *)(lp + 1) > scache_hi) {
+			scache_bad = 1;
+			break;
+		}
+		*lpp = lp;
+		lp->n = scache_relocnode(lp->n);
+		lpp = &lp->next;
+		lp = lp->next;
+	}
+	*lpp = NULL;
+	return start;
+}
+
+/* Mirrors copynode(): n is an address from the cache file */
+static union node *
+scache_relocnode(union node *n)
+{
+	if (n == NULL || scache_bad)
+		return NULL;
+	n = (void *)((char *)n + scache_delta);
+	if ((char *)n < scache_lo
+	 || (char *)n + sizeof(n->type) > scache_hi
+	 || (unsigned)n->type >= N_NUMBER
+	 || nodesize[n->type] == 0
+	 || (char *)n + nodesize[n->type] > scache_hi
+	) {
+		scache_bad = 1;
+		return NULL;
+	}
+
+	switch (n->type) {
+	case NCMD:
+		n->ncmd.redirect = scache_relocnode(n->ncmd.redirect);
+		n->ncmd.args = scache_relocnode(n->ncmd.args);
+		n->ncmd.assign = scache_relocnode(n->ncmd.assign);
+		break;
+	case NPIPE:
+		n->npipe.cmdlist = scache_relocnodelist(n->npipe.cmdlist);
+		break;
+	case NREDIR:
+	case NBACKGND:
+	case NSUBSHELL:
+		n->nredir.redirect = scache_relocnode(n->nredir.redirect);
+		n->nredir.n = scache_relocnode(n->nredir.n);
+		break;
+	case NAND:
+	case NOR:
+	case NSEMI:
+	case NWHILE:
+	case NUNTIL:
+		n->nbinary.ch2 = scache_relocnode(n->nbinary.ch2);
+		n->nbinary.ch1 = scache_relocnode(n->nbinary.ch1);
+		break;
+	case NIF:
+		n->nif.elsepart = scache_relocnode(n->nif.elsepart);
+		n->nif.ifpart = scache_relocnode(n->nif.ifpart);
+		n->nif.test = scache_relocnode(n->nif.test);
+		break;
+	case NFOR:
+		n->nfor.var = scache_relocstr(n->nfor.var);
+		n->nfor.body = scache_relocnode(n->nfor.body);
+		n->nfor.args = scache_relocnode(n->nfor.args);
+		break;
+	case NCASE:
+		n->ncase.cases = scache_relocnode(n->ncase.cases);
+		n->ncase.expr = scache_relocnode(n->ncase.expr);
+		break;
+	case NCLIST:
+		n->nclist.body = scache_relocnode(n->nclist.body);
+		n->nclist.pattern = scache_relocnode(n->nclist.pattern);
+		n->nclist.next = scache_relocnode(n->nclist.next);
+		break;
+	case NDEFUN:
+	case NARG:
+		n->narg.backquote = scache_relocnodelist(n->narg.backquote);
+		n->narg.text = scache_relocstr(n->narg.text);
+		n->narg.next = scache_relocnode(n->narg.next);
+		break;
+	case NTO:
+#if ENABLE_ASH_BASH_COMPAT
+	case NTO2:
+#endif
+	case NCLOBBER:
+	case NFROM:
+	case NFROMTO:
+	case NAPPEND:
+		n->nfile.fname = scache_relocnode(n->nfile.fname);
+		n->nfile.next = scache_relocnode(n->nfile.next);
+		break;
+	case NTOFD:
+	case NFROMFD:
+		n->ndup.vname = scache_relocnode(n->ndup.vname);
+		n->ndup.next = scache_relocnode(n->ndup.next);
+		break;
+	case NHERE:
+	case NXHERE:
+		n->nhere.doc = scache_relocnode(n->nhere.doc);
+		n->nhere.next = scache_relocnode(n->nhere.next);
+		break;
+	case NNOT:
+		n->nnot.com = scache_relocnode(n->nnot.com);
+		break;
+	};
+	return n;
+}
+
+/* Check the cache file and relocate all its blocks. Returns 0 if bad */
+static int
+scache_load(char *buf, size_t size)
+{
+	char *p = buf + scache.hdr_size;
+	char *end = buf + size;
+
+	if (size < scache.hdr_size || memcmp(buf, scache.hdr, scache.hdr_size) != 0)
+		return 0;
+	scache_bad = 0;
+	for (;;) {
+		struct scache_cmd *c = (void *)p;
+		struct funcnode *f;
+
+		if ((size_t)(end - p) < sizeof(*c))
+			return 0;
+		p += sizeof(*c);
+		if (c->size == 0)
+			return 1;
+		if (c->size > (size_t)(end - p) || c->size <= offsetof(struct funcnode, n))
+			return 0;
+		f = (void *)p;
+		scache_lo = p;
+		scache_hi = p + c->size;
+		scache_delta = p - (char *)(uintptr_t)c->base;
+		scache_relocnode((union node *)((char *)(uintptr_t)c->base + offsetof(struct funcnode, n)));
+		if (scache_bad)
+			return 0;
+		f->count = 0;
+		p += SCACHE_ALIGN(c->size);
+	}
+}
+
+static void
+scache_stop(void)
+{
+	close(scache.fd);
+	scache.fd = -1;
+	unlink(scache.tmpname);
+}
+
+static int
+scache_write(const void *buf, size_t len)
+{
+	if (full_write(scache.fd, buf, len) != (ssize_t)len) {
+		scache_stop();
+		return 0;
+	}
+	return 1;
+}
+
+/* Start writing the cache file. Its first copy_len bytes
+ * are taken from the existing one */
+static void
+scache_start(off_t copy_len)
+{
+	int fd;
+
+	scache.tmpname = xasprintf("%s.XXXXXX", scache.name);
+	scache.fd = mkstemp(scache.tmpname);
+	if (scache.fd < 0)
+		return;
+	close_on_exec_on(scache.fd);
+	scache.pid = getpid();
+	if (copy_len == 0) {
+		scache_write(scache.hdr, scache.hdr_size);
+		return;
+	}
+	fd = open(scache.name, O_RDONLY);
+	if (fd < 0 || bb_copyfd_size(fd, scache.fd, copy_len) != copy_len)
+		scache_stop();
+	if (fd >= 0)
+		close(fd);
+}
+
+/* Write the end record, put the file in place */
+static void
+scache_finish(int eof)
+{
+	struct scache_cmd c;
+
+	if (scache.fd < 0 || scache.pid != getpid())
+		return;
+	memset(&c, 0, sizeof(c));
+	c.linno = scache.resume_linno;
+	c.base = eof ? (uint64_t)-1 : (uint64_t)scache.resume_off;
+	if (!scache_write(&c, sizeof(c)))
+		return;
+	close(scache.fd);
+	scache.fd = -1;
+	if (rename(scache.tmpname, scache.name) != 0)
+		unlink(scache.tmpname);
+}
+
+static int
+scache_parser_is_clean(void)
+{
+#if ENABLE_ASH_ALIAS
+	int i;
+
+	for (i = 0; i < ATABSIZE; i++)
+		if (atab[i])
+			return 0;
+#endif
+	return g_parsefile == &basepf
+		&& !g_parsefile->strpush
+		&& g_parsefile->left_in_line == 0
+		&& !tokpushback
+		&& !heredoclist
+		&& !vflag;
+}
+
+/* Called after parsecmd() in the top level cmdloop */
+static void
+scache_record(union node *n)
+{
+	struct scache_cmd c;
+	struct funcnode *f;
+	off_t off;
+
+	if (n == NODE_EOF) {
+		scache_finish(1);
+		return;
+	}
+	off = lseek(g_parsefile->pf_fd, 0, SEEK_CUR);
+	if (!scache_parser_is_clean() || off < 0) {
+		scache_finish(0);
+		return;
+	}
+	if (n) {
+		INT_OFF;
+		f = copyfunc(n);
+		memset(&c, 0, sizeof(c));
+		c.size = funcblocksize + funcstringsize;
+		c.startlinno = startlinno;
+		c.linno = g_parsefile->linno;
+		c.base = (uintptr_t)f;
+		if (scache_write(&c, sizeof(c)) && scache_write(f, c.size))
+			scache_write(scache_zero, SCACHE_ALIGN(c.size) - c.size);
+		free(f);
+		INT_ON;
+		if (scache.fd < 0)
+			return;
+	}
+	scache.resume_off = off - g_parsefile->left_in_buffer;
+	scache.resume_linno = g_parsefile->linno;
+}
+
+/* Called instead of parsecmd() while replaying */
+static union node *
+scache_next(int inter)
+{
+	struct scache_cmd *c = (void *)scache.pos;
+	struct funcnode *f;
+
+	if (c->size == 0) {
+		/* Go on parsing from where the cache ends */
+		off_t copy_len = scache.pos - scache.buf;
+
+		if (c->base == (uint64_t)-1)
+			lseek(g_parsefile->pf_fd, 0, SEEK_END);
+		else
+			lseek(g_parsefile->pf_fd, c->base, SEEK_SET);
+		g_parsefile->linno = c->linno;
+		g_parsefile->left_in_line = 0;
+		g_parsefile->left_in_buffer = 0;
+		if (c->base != (uint64_t)-1) {
+			scache.resume_off = c->base;
+			scache.resume_linno = c->linno;
+			scache_start(copy_len);
+		}
+		free(scache.buf);
+		scache.buf = scache.pos = NULL;
+		return parsecmd(inter);
+	}
+	f = (void *)(c + 1);
+	scache.pos = (char *)f + SCACHE_ALIGN(c->size);
+	startlinno = c->startlinno;
+	g_parsefile->linno = c->linno;
+	return &f->n;
+}
+
+/* Called when the script is opened */
+static void
+scache_init(const char *script)
+{
+	const char *dir = lookupvar("ASH_SCRIPT_CACHE");
+	struct scache_hdr *h;
+	struct stat st;
+	char *path, *p;
+	unsigned len;
+	uint32_t hash;
+	int fd;
+
+	if (!dir || !dir[0] || iflag || vflag)
+		return;
+	if (fstat(g_parsefile->pf_fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return;
+	path = xmalloc_realpath(script);
+	if (!path)
+		return;
+
+	len = sizeof(*h) + strlen(bb_banner) + 1 + strlen(path) + 1;
+	scache.hdr_size = SCACHE_ALIGN(len);
+	h = xzalloc(scache.hdr_size);
+	memcpy(h->magic, "ash\2", 4);
+	h->node_size = sizeof(union node);
+	h->hdr_size = scache.hdr_size;
+	h->node_types = N_NUMBER;
+	hash = 0;
+	for (len = 0; len < N_NUMBER; len++)
+		hash = hash * 31 + nodesize[len];
+	h->node_layout = hash;
+	h->script_size = st.st_size;
+	h->script_mtime = st.st_mtime;
+	h->script_ctime = st.st_ctime;
+	h->script_ino = st.st_ino;
+	p = stpcpy((char *)(h + 1), bb_banner) + 1;
+	strcpy(p, path);
+	scache.hdr = (char *)h;
+
+	for (p = path; *p; p++)
+		if (*p == '/')
+			*p = '%';
+	scache.name = concat_path_file(dir, path);
+	free(path);
+
+	fd = open(scache.name, O_RDONLY);
+	if (fd >= 0) {
+		/* Don't take commands from a file someone else can change */
+		if (fstat(fd, &st) == 0
+		 && S_ISREG(st.st_mode)
+		 && st.st_uid == geteuid()
+		 && !(st.st_mode & (S_IWGRP|S_IWOTH))
+		) {
+			size_t size = INT_MAX - 4095;
+			char *buf = xmalloc_read(fd, &size);
+			if (buf && scache_load(buf, size)) {
+				scache.buf = buf;
+				scache.pos = buf + scache.hdr_size;
+				close(fd);
+				return;
+			}
+			free(buf);
+		}
+		close(fd);
+	}
+	scache.resume_linno = 1;
+	scache_start(0);
+}
+#endif
+
 /*
  * Read and execute commands.
  * "Top" is nonzero for the top level command loop;
@@ -12179,7 +13091,16 @@ cmdloop(int top)
 			inter++;
 			chkmail();
 		}
-		n = parsecmd(inter);
+#if ENABLE_ASH_SCRIPT_CACHE
+		if (top && scache.pos)
+			n = scache_next(inter);
+		else
+#endif
+			n = parsecmd(inter);
+#if ENABLE_ASH_SCRIPT_CACHE
+		if (top && scache.fd >= 0)
+			scache_record(n);
+#endif
 #if DEBUG
 		if (DEBUG > 2 && debug && (n != NODE_EOF))
 			showtree(n);
@@ -12197,9 +13118,17 @@ cmdloop(int top)
 			/* job_warning can only be 2,1,0. Here 2->1, 1/0->0 */
 			job_warning >>= 1;
 			numeof = 0;
+			pathdir_gen++;
 			evaltree(n, 0);
 		}
 		popstackmark(&smark);
+#if DEBUG
+		if (top) {
+			unsigned long peak, total;
+			region_take_stats(&stackregion, &peak, &total);
+			TRACE(("stack: peak %lu total %lu bytes\n", peak, total));
+		}
+#endif
 		skip = evalskip;
 
 		if (skip) {
@@ -12367,6 +13296,21 @@ find_command(char *name, struct cmdentry *entry, int act, const char *path)
 
 	/* If name is in the table, check answer will be ok */
 	cmdp = cmdlookup(name, 0);
+	if (cmdp != NULL && cmdp->cmdtype == CMDUNKNOWN) {
+		if (act & DO_ALTPATH) {
+			cmdp = NULL;
+		} else if (!cmdp->rehash && pathdir_unchanged()) {
+			cmdtable_neghits++;
+			e = ENOENT;
+			goto fail;
+		} else {
+			/* pathdir_unchanged() may have deleted it */
+			cmdp = cmdlookup(name, 0);
+			if (cmdp)
+				delete_cmd_entry();
+			cmdp = NULL;
+		}
+	}
 	if (cmdp != NULL) {
 		int bit;
 
@@ -12388,9 +13332,11 @@ find_command(char *name, struct cmdentry *entry, int act, const char *path)
 		if (act & bit) {
 			updatetbl = 0;
 			cmdp = NULL;
-		} else if (cmdp->rehash == 0)
+		} else if (cmdp->rehash == 0) {
 			/* if not invalidated by cd, we're done */
+			cmdtable_hits++;
 			goto success;
+		}
 	}
 
 	/* If %builtin not in path, check for builtin next */
@@ -12418,6 +13364,7 @@ find_command(char *name, struct cmdentry *entry, int act, const char *path)
 #endif
 
 	/* We have to search path. */
+	cmdtable_misses++;
 	prev = -1;              /* where to start */
 	if (cmdp && cmdp->rehash) {     /* doing a rehash */
 		if (cmdp->cmdtype == CMDBUILTIN)
@@ -12494,6 +13441,13 @@ find_command(char *name, struct cmdentry *entry, int act, const char *path)
 	/* We failed.  If there was an entry for this command, delete it */
 	if (cmdp && updatetbl)
 		delete_cmd_entry();
+	/* Remember it isn't there, unless it was for some other reason */
+	if (e == ENOENT && updatetbl && pathdir_unchanged()) {
+		INT_OFF;
+		cmdlookup(name, 1);
+		INT_ON;
+	}
+ fail:
 	if (act & DO_ERR)
 		ash_msg("%s: %s", name, errmsg(e, "not found"));
 	entry->cmdtype = CMDUNKNOWN;
@@ -12959,6 +13913,10 @@ exitshell(void)
 	save_history(line_input_state);
 #endif
 
+#if ENABLE_ASH_SCRIPT_CACHE
+	scache_finish(0);
+#endif
+
 	status = exitstatus;
 	TRACE(("pid %d, exitshell(%d)\n", getpid(), status));
 	if (setjmp(loc.loc)) {
@@ -13088,6 +14046,9 @@ procargs(char **argv)
 			goto setarg0;
 	} else if (!sflag) {
 		setinputfile(*xargv, 0);
+#if ENABLE_ASH_SCRIPT_CACHE
+		scache_init(*xargv);
+#endif
  setarg0:
 		arg0 = *xargv++;
 		commandname = arg0;
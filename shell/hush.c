@@ -350,6 +350,7 @@
 #define debug_printf_list(...)   do {} while (0)
 #define debug_printf_subst(...)  do {} while (0)
 #define debug_printf_clean(...)  do {} while (0)
+#define debug_printf_region(...) do {} while (0)
 
 #define ERR_PTR ((void*)(long)1)
 
@@ -429,6 +430,8 @@ typedef struct o_string {
 	smallint has_quoted_part;
 	smallint has_empty_slot;
 	smallint o_assignment; /* 0:maybe, 1:yes, 2:no */
+	/* If set, data is allocated from this region, not malloced */
+	region_t *o_region;
 } o_string;
 enum {
 	EXP_FLAG_SINGLEWORD     = 0x80, /* must be 0x80 */
@@ -788,6 +791,8 @@ struct globals {
 	const char *cwd;
 	struct variable *top_var;
 	char **expanded_assignments;
+	/* argv of a simple command is expanded into this region */
+	region_t argv_region;
 #if ENABLE_HUSH_FUNCTIONS
 	struct function *top_func;
 # if ENABLE_HUSH_LOCAL
@@ -1032,6 +1037,13 @@ static const struct built_in_command bltins2[] = {
 # define DEBUG_CLEAN 0
 #endif
 
+#ifndef debug_printf_region
+# define debug_printf_region(...) (indent(), fdprintf(2, __VA_ARGS__))
+# define DEBUG_REGION 1
+#else
+# define DEBUG_REGION 0
+#endif
+
 #if DEBUG_EXPAND
 static void debug_print_strings(const char *prefix, char **vv)
 {
@@ -2175,21 +2187,34 @@ static void o_reset_to_empty_unquoted(o_string *o)
 
 static void o_free(o_string *o)
 {
-	free(o->data);
+	if (!o->o_region)
+		free(o->data);
 	memset(o, 0, sizeof(*o));
 }
 
 static ALWAYS_INLINE void o_free_unsafe(o_string *o)
 {
-	free(o->data);
+	if (!o->o_region)
+		free(o->data);
 }
 
-static void o_grow_by(o_string *o, int len)
+static void o_set_maxlen(o_string *o, int maxlen)
 {
-	if (o->length + len > o->maxlen) {
-		o->maxlen += (2*len > B_CHUNK ? 2*len : B_CHUNK);
-		o->data = xrealloc(o->data, 1 + o->maxlen);
+	if (o->o_region) {
+		o->data = region_realloc(o->o_region, o->data,
+				o->data ? 1 + o->maxlen : 0, 1 + maxlen);
+		if (!o->data)
+			bb_error_msg_and_die(bb_msg_memory_exhausted);
+	} else {
+		o->data = xrealloc(o->data, 1 + maxlen);
 	}
+	o->maxlen = maxlen;
+}
+
+static void o_grow_by(o_string *o, int len)
+{
+	if (o->length + len > o->maxlen)
+		o_set_maxlen(o, o->maxlen + (2*len > B_CHUNK ? 2*len : B_CHUNK));
 }
 
 static void o_addchr(o_string *o, int ch)
@@ -2378,8 +2403,7 @@ static int o_save_ptr_helper(o_string *o, int n)
 		if (!(n & 0xf)) { /* 0, 0x10, 0x20...? */
 			debug_printf_list("list[%d]=%d string_start=%d (growing)\n", n, string_len, string_start);
 			/* list[n] points to string_start, make space for 16 more pointers */
-			o->maxlen += 0x10 * sizeof(list[0]);
-			o->data = xrealloc(o->data, o->maxlen + 1);
+			o_set_maxlen(o, o->maxlen + 0x10 * sizeof(list[0]));
 			list = (char**)o->data;
 			memmove(list + n + 0x10, list + n, string_len);
 			o->length += 0x10 * sizeof(list[0]);
@@ -4725,10 +4749,12 @@ static int process_command_subs(o_string *dest, const char *s);
  * all variable references within and returns a pointer to
  * a list of expanded strings, possibly with larger number
  * of strings. (Think VAR="a b"; echo $VAR).
- * This new list is allocated as a single malloc block.
+ * This new list is allocated as a single malloc block
+ * (or as a single block in the region, if one is given).
  * NULL-terminated list of char* pointers is at the beginning of it,
  * followed by strings themselves.
- * Caller can deallocate entire list by single free(list). */
+ * Caller can deallocate entire list by single free(list)
+ * (or by releasing the region). */
 
 /* A horde of its helpers come first: */
 
@@ -5417,13 +5443,14 @@ static NOINLINE int expand_vars_to_list(o_string *output, int n, char *arg)
 	return n;
 }
 
-static char **expand_variables(char **argv, unsigned expflags)
+static char **expand_variables(char **argv, unsigned expflags, region_t *region)
 {
 	int n;
 	char **list;
 	o_string output = NULL_O_STRING;
 
 	output.o_expflags = expflags;
+	output.o_region = region;
 
 	n = 0;
 	while (*argv) {
@@ -5432,21 +5459,22 @@ static char **expand_variables(char **argv, unsigned expflags)
 	}
 	debug_print_list("expand_variables", &output, n);
 
-	/* output.data (malloced in one block) gets returned in "list" */
+	/* output.data (malloced in one block, or allocated from region)
+	 * gets returned in "list" */
 	list = o_finalize_list(&output, n);
 	debug_print_strings("expand_variables[1]", list);
 	return list;
 }
 
-static char **expand_strvec_to_strvec(char **argv)
+static char **expand_strvec_to_strvec(char **argv, region_t *region)
 {
-	return expand_variables(argv, EXP_FLAG_GLOB | EXP_FLAG_ESC_GLOB_CHARS);
+	return expand_variables(argv, EXP_FLAG_GLOB | EXP_FLAG_ESC_GLOB_CHARS, region);
 }
 
 #if ENABLE_HUSH_BASH_COMPAT
-static char **expand_strvec_to_strvec_singleword_noglob(char **argv)
+static char **expand_strvec_to_strvec_singleword_noglob(char **argv, region_t *region)
 {
-	return expand_variables(argv, EXP_FLAG_SINGLEWORD);
+	return expand_variables(argv, EXP_FLAG_SINGLEWORD, region);
 }
 #endif
 
@@ -5478,7 +5506,8 @@ static char *expand_string_to_string(const char *str, int do_unbackslash)
 	argv[1] = NULL;
 	list = expand_variables(argv, do_unbackslash
 			? EXP_FLAG_ESC_GLOB_CHARS | EXP_FLAG_SINGLEWORD
-			: EXP_FLAG_SINGLEWORD
+			: EXP_FLAG_SINGLEWORD,
+			NULL
 	);
 	if (HUSH_DEBUG)
 		if (!list[0] || list[1])
@@ -5496,7 +5525,7 @@ static char* expand_strvec_to_string(char **argv)
 {
 	char **list;
 
-	list = expand_variables(argv, EXP_FLAG_SINGLEWORD);
+	list = expand_variables(argv, EXP_FLAG_SINGLEWORD, NULL);
 	/* Convert all NULs to spaces */
 	if (list[0]) {
 		int n = 1;
@@ -6462,7 +6491,7 @@ static NOINLINE void pseudo_exec_argv(nommu_save_t *nommu_save,
 	if (argv_expanded) {
 		argv = argv_expanded;
 	} else {
-		argv = expand_strvec_to_strvec(argv + assignment_cnt);
+		argv = expand_strvec_to_strvec(argv + assignment_cnt, NULL);
 #if !BB_MMU
 		nommu_save->argv = argv;
 #endif
@@ -6907,6 +6936,17 @@ static int redirect_and_varexp_helper(char ***new_env_p,
 	}
 	return rcode;
 }
+
+static void release_argv_expanded(region_mark_t *mark)
+{
+	region_release(&G.argv_region, mark);
+	if (DEBUG_REGION) {
+		unsigned long peak, total;
+		region_take_stats(&G.argv_region, &peak, &total);
+		debug_printf_region("argv region: peak %lu total %lu bytes\n", peak, total);
+	}
+}
+
 static NOINLINE int run_pipe(struct pipe *pi)
 {
 	static const char *const null_ptr = NULL;
@@ -6915,6 +6955,7 @@ static NOINLINE int run_pipe(struct pipe *pi)
 	int next_infd;
 	struct command *command;
 	char **argv_expanded;
+	region_mark_t argv_mark;
 	char **argv;
 	/* it is not always needed, but we aim to smaller code */
 	int squirrel[] = { -1, -1, -1 };
@@ -6934,6 +6975,7 @@ static NOINLINE int run_pipe(struct pipe *pi)
 	pi->stopped_cmds = 0;
 	command = &pi->cmds[0];
 	argv_expanded = NULL;
+	region_mark(&G.argv_region, &argv_mark);
 
 	if (pi->num_cmds != 1
 	 || pi->followup == PIPE_BG
@@ -7057,16 +7099,16 @@ static NOINLINE int run_pipe(struct pipe *pi)
 		/* Expand the rest into (possibly) many strings each */
 #if ENABLE_HUSH_BASH_COMPAT
 		if (command->cmd_type == CMD_SINGLEWORD_NOGLOB) {
-			argv_expanded = expand_strvec_to_strvec_singleword_noglob(argv + command->assignment_cnt);
+			argv_expanded = expand_strvec_to_strvec_singleword_noglob(argv + command->assignment_cnt, &G.argv_region);
 		} else
 #endif
 		{
-			argv_expanded = expand_strvec_to_strvec(argv + command->assignment_cnt);
+			argv_expanded = expand_strvec_to_strvec(argv + command->assignment_cnt, &G.argv_region);
 		}
 
 		/* if someone gives us an empty string: `cmd with empty output` */
 		if (!argv_expanded[0]) {
-			free(argv_expanded);
+			release_argv_expanded(&argv_mark);
 			debug_leave();
 			return G.last_exitcode;
 		}
@@ -7116,7 +7158,7 @@ static NOINLINE int run_pipe(struct pipe *pi)
 /* clean_up_and_ret0: */
 			restore_redirects(squirrel);
  clean_up_and_ret1:
-			free(argv_expanded);
+			release_argv_expanded(&argv_mark);
 			IF_HAS_KEYWORDS(if (pi->pi_inverted) rcode = !rcode;)
 			debug_leave();
 			debug_printf_exec("run_pipe return %d\n", rcode);
@@ -7232,7 +7274,8 @@ static NOINLINE int run_pipe(struct pipe *pi)
 		unset_vars(nommu_save.new_env);
 		add_vars(nommu_save.old_vars);
 #endif
-		free(argv_expanded);
+		if (argv_expanded)
+			release_argv_expanded(&argv_mark);
 		argv_expanded = NULL;
 		if (command->pid < 0) { /* [v]fork failed */
 			/* Clearly indicate, was it fork or vfork */
@@ -7409,7 +7452,7 @@ static int run_list(struct pipe *pi)
 				} /* else: "for var; do..." -> assume "$@" list */
 				/* create list of variable values */
 				debug_print_strings("for_list made from", vals);
-				for_list = expand_strvec_to_strvec(vals);
+				for_list = expand_strvec_to_strvec(vals, NULL);
 				for_lcur = for_list;
 				debug_print_strings("for_list", for_list);
 			}
@@ -8665,21 +8708,24 @@ static int FAST_FUNC builtin_jobs(char **argv UNUSED_PARAM)
 #if HUSH_DEBUG
 static int FAST_FUNC builtin_memleak(char **argv UNUSED_PARAM)
 {
-	void *p;
 	unsigned long l;
 
-# ifdef M_TRIM_THRESHOLD
-	/* Optional. Reduces probability of false positives */
-	malloc_trim(0);
-# endif
+# if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	/* Count bytes in use: where free memory starts depends
+	 * on allocation pattern, not only on what is leaked */
+	l = mallinfo2().uordblks;
+# elif defined(M_TRIM_THRESHOLD)
+	l = mallinfo().uordblks;
+# else
 	/* Crude attempt to find where "free memory" starts,
 	 * sans fragmentation. */
-	p = malloc(240);
+	void *p = malloc(240);
 	l = (unsigned long)p;
 	free(p);
 	p = malloc(3400);
 	if (l < (unsigned long)p) l = (unsigned long)p;
 	free(p);
+# endif
 
 	if (!G.memleak_value)
 		G.memleak_value = l;